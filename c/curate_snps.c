@@ -0,0 +1,203 @@
+// Copyright [1999-2015] Wellcome Trust Sanger Institute and the EMBL-European Bioinformatics Institute
+// Copyright [2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Curates the SNP list of an eQTL file against a GTEx variant table
+// (e.g. GTEx_Analysis_var_info.txt, gzipped or not):
+//
+//   curate_snps var_info.txt snp_ids.txt [curated.txt]
+//
+// The variant table is streamed once through a hash of the SNP list. SNPs
+// match on the original or the current rsID of the table, the first
+// variant wins. Lines are written, to stdout by default, as EQTLAdaptor
+// reads them:
+//
+//   chrom  start  end  rsID  given rsID  consequence
+//
+// by chromosome, in the order of the table, then start. The table has no
+// consequences, that field is left empty.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "string_table.h"
+
+#define LINE_LENGTH 65536
+
+////////////////////////////////////////////////////////
+// SNP list
+////////////////////////////////////////////////////////
+
+// One rsID per line, indexed by rsID. Duplicates are dropped
+static StringTable * read_snp_list(char * filename) {
+	StringTable * snps = new_string_table();
+	char * line = malloc(LINE_LENGTH);
+
+	gzFile input = gzopen(filename, "rb");
+	if (!input) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		exit(1);
+	}
+	while (gzgets(input, line, LINE_LENGTH)) {
+		line[strcspn(line, "\t\r\n")] = '\0';
+		if (*line)
+			string_table_add(snps, line);
+	}
+	gzclose(input);
+	free(line);
+	string_table_index(snps);
+	return snps;
+}
+
+////////////////////////////////////////////////////////
+// Join
+////////////////////////////////////////////////////////
+
+typedef struct variant_st {
+	size_t chrom, snp;
+	unsigned long start, end;
+	char * name;
+} Variant;
+
+typedef struct join_st {
+	StringTable * snps;
+	bool * matched;
+	// Chromosome names in order of appearance
+	char ** chroms;
+	size_t chrom_count, chrom_capacity;
+	Variant * variants;
+	size_t count, capacity;
+	// Cleared if the table is not sorted by chromosome then position
+	bool sorted;
+} Join;
+
+static size_t chrom_index(Join * join, char * chrom) {
+	size_t index;
+	// Tables come by chromosome, the last one is the likely match
+	for (index = join->chrom_count; index > 0; index--)
+		if (!strcmp(join->chroms[index - 1], chrom))
+			return index - 1;
+	if (join->chrom_count == join->chrom_capacity) {
+		join->chrom_capacity = join->chrom_capacity ? 2 * join->chrom_capacity : 64;
+		join->chroms = realloc(join->chroms, join->chrom_capacity * sizeof(char *));
+	}
+	join->chroms[join->chrom_count] = strdup(chrom);
+	return join->chrom_count++;
+}
+
+static void add_variant(Join * join, char ** fields, size_t snp) {
+	if (join->count == join->capacity) {
+		join->capacity = join->capacity ? 2 * join->capacity : 1024;
+		join->variants = realloc(join->variants, join->capacity * sizeof(Variant));
+	}
+	Variant * variant = join->variants + join->count;
+	variant->chrom = chrom_index(join, fields[0]);
+	variant->start = strtoul(fields[1], NULL, 10);
+	// Deletions span their reference allele
+	variant->end = variant->start + strlen(fields[3]) - 1;
+	variant->name = strdup(fields[6][0] == 'r' ? fields[6] : fields[5]);
+	variant->snp = snp;
+	if (join->count) {
+		Variant * previous = variant - 1;
+		if (previous->chrom > variant->chrom || (previous->chrom == variant->chrom && previous->start > variant->start))
+			join->sorted = false;
+	}
+	join->matched[snp] = true;
+	join->count++;
+}
+
+static void join_variant_table(Join * join, char * filename) {
+	char * line = malloc(LINE_LENGTH);
+	char * fields[7];
+	size_t lines = 0, snp;
+
+	gzFile input = gzopen(filename, "rb");
+	if (!input) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		exit(1);
+	}
+	gzbuffer(input, 1 << 20);
+	while (gzgets(input, line, LINE_LENGTH)) {
+		// Chr, Pos, VariantID, Ref, Alt, original rsID, current rsID, ...
+		if (split_fields(line, fields, 7) < 7 || fields[1][0] < '0' || fields[1][0] > '9')
+			continue;
+		lines++;
+		if ((string_table_find(join->snps, fields[5], &snp) || string_table_find(join->snps, fields[6], &snp)) && !join->matched[snp])
+			add_variant(join, fields, snp);
+	}
+	fprintf(stderr, "Read %zu variants of %s, matched %zu of %zu SNPs\n", lines, filename, join->count, join->snps->count);
+	gzclose(input);
+	free(line);
+}
+
+static int cmp_variants(const void * a, const void * b) {
+	Variant * A = (Variant *) a;
+	Variant * B = (Variant *) b;
+	if (A->chrom != B->chrom)
+		return A->chrom < B->chrom ? -1 : 1;
+	if (A->start != B->start)
+		return A->start < B->start ? -1 : 1;
+	return A->snp < B->snp ? -1 : A->snp > B->snp;
+}
+
+static void write_variants(Join * join, FILE * output) {
+	size_t index;
+	if (!join->sorted) {
+		fprintf(stderr, "Variant table is not sorted by position, sorting matches\n");
+		qsort(join->variants, join->count, sizeof(Variant), &cmp_variants);
+	}
+	for (index = 0; index < join->count; index++) {
+		Variant * variant = join->variants + index;
+		fprintf(output, "%s\t%lu\t%lu\t%s\t%s\t\n", join->chroms[variant->chrom], variant->start, variant->end, variant->name, join->snps->keys[variant->snp]);
+	}
+}
+
+static void destroy_join(Join * join) {
+	size_t index;
+	for (index = 0; index < join->count; index++)
+		free(join->variants[index].name);
+	for (index = 0; index < join->chrom_count; index++)
+		free(join->chroms[index]);
+	free(join->variants);
+	free(join->chroms);
+	free(join->matched);
+	destroy_string_table(join->snps);
+	free(join);
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "Usage: curate_snps var_info.txt snp_ids.txt [curated.txt]\n");
+		exit(1);
+	}
+
+	Join * join = calloc(1, sizeof(Join));
+	join->snps = read_snp_list(argv[2]);
+	join->matched = calloc(join->snps->count, sizeof(bool));
+	join->sorted = true;
+	join_variant_table(join, argv[1]);
+
+	FILE * output = stdout;
+	if (argc == 4 && !(output = fopen(argv[3], "w"))) {
+		fprintf(stderr, "Could not write to %s\n", argv[3]);
+		exit(1);
+	}
+	write_variants(join, output);
+	if (output != stdout)
+		fclose(output);
+
+	destroy_join(join);
+	return 0;
+}
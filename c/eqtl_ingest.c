@@ -0,0 +1,286 @@
+// Copyright [1999-2015] Wellcome Trust Sanger Institute and the EMBL-European Bioinformatics Institute
+// Copyright [2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Loads gzipped GTEx .cis.eqtl tables into an eQTL file whose labels
+// are already stored (see EQTLAdaptor):
+//
+//   eqtl_ingest [-b batch_size] [-t threads] [-a snp_ids] file.hd5 tissue table.gz [tissue table.gz ...]
+//
+// Each line yields a beta and a p-value point. Labels are resolved through
+// the label index of the file, lines whose SNP or gene is not labelled in
+// the file are skipped and counted. SNPs renamed since the table was made
+// are resolved through the curated SNP file of EQTLAdaptor, file.hd5.snp.ids
+// unless given with -a.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "hdf5_wrapper.h"
+#include "string_table.h"
+
+#define LINE_LENGTH 65536
+#define DEFAULT_BATCH_SIZE 2000000
+
+////////////////////////////////////////////////////////
+// Point buffer
+// Points are accumulated and handed over to the bulk
+// writer, which sorts them by chunk
+////////////////////////////////////////////////////////
+
+typedef struct point_buffer_st {
+	hsize_t rank, count, capacity, stored;
+	hsize_t * coords;
+	hsize_t ** coord_ptrs;
+	double * values;
+} PointBuffer;
+
+static PointBuffer * new_point_buffer(hsize_t rank, hsize_t capacity) {
+	PointBuffer * buffer = calloc(1, sizeof(PointBuffer));
+	hsize_t index;
+	buffer->rank = rank;
+	buffer->capacity = capacity;
+	buffer->coords = calloc(capacity * rank, sizeof(hsize_t));
+	buffer->coord_ptrs = calloc(capacity, sizeof(hsize_t *));
+	buffer->values = calloc(capacity, sizeof(double));
+	for (index = 0; index < capacity; index++)
+		buffer->coord_ptrs[index] = buffer->coords + index * rank;
+	return buffer;
+}
+
+static void flush_points(FileContext * file, PointBuffer * buffer) {
+	if (!buffer->count)
+		return;
+	clock_t start = clock();
+	store_values(file, buffer->count, buffer->coord_ptrs, buffer->values);
+	buffer->stored += buffer->count;
+	fprintf(stderr, "Stored %lli points (%lli in total) in %lf s\n", buffer->count, buffer->stored, ((double) (clock() - start)) / CLOCKS_PER_SEC);
+	buffer->count = 0;
+}
+
+static void add_point(FileContext * file, PointBuffer * buffer, hsize_t * coords, double value) {
+	// Zeros are empty cells in the matrix
+	if (value == 0)
+		return;
+	if (buffer->count == buffer->capacity)
+		flush_points(file, buffer);
+	memcpy(buffer->coord_ptrs[buffer->count], coords, buffer->rank * sizeof(hsize_t));
+	buffer->values[buffer->count] = value;
+	buffer->count++;
+}
+
+static void destroy_point_buffer(PointBuffer * buffer) {
+	free(buffer->coords);
+	free(buffer->coord_ptrs);
+	free(buffer->values);
+	free(buffer);
+}
+
+////////////////////////////////////////////////////////
+// SNP aliases
+// Given rsIDs of the curated SNP file, indexed, and
+// their current name
+////////////////////////////////////////////////////////
+
+typedef struct alias_table_st {
+	StringTable * given;
+	char ** names;
+} AliasTable;
+
+static char * find_alias(AliasTable * aliases, char * given) {
+	size_t index;
+	return string_table_find(aliases->given, given, &index) ? aliases->names[index] : NULL;
+}
+
+// Lines of chrom, start, end, name, given name and consequence. An empty table
+// is returned if the file is missing, unless it was named explicitly
+static AliasTable * read_aliases(char * filename, bool required) {
+	AliasTable * aliases = calloc(1, sizeof(AliasTable));
+	char * line = malloc(LINE_LENGTH);
+	char * fields[6];
+	size_t capacity = 0;
+
+	aliases->given = new_string_table();
+	gzFile input = gzopen(filename, "rb");
+	if (!input) {
+		if (required) {
+			fprintf(stderr, "Could not open %s\n", filename);
+			exit(1);
+		}
+		free(line);
+		return aliases;
+	}
+	while (gzgets(input, line, LINE_LENGTH)) {
+		if (split_fields(line, fields, 6) < 5 || !strcmp(fields[3], fields[4]))
+			continue;
+		if (aliases->given->count == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			aliases->names = realloc(aliases->names, capacity * sizeof(char *));
+		}
+		aliases->names[aliases->given->count] = strdup(fields[3]);
+		string_table_add(aliases->given, fields[4]);
+	}
+	gzclose(input);
+	free(line);
+	string_table_index(aliases->given);
+	fprintf(stderr, "Read %zu SNP aliases from %s\n", aliases->given->count, filename);
+	return aliases;
+}
+
+static void destroy_aliases(AliasTable * aliases) {
+	size_t index;
+	for (index = 0; index < aliases->given->count; index++)
+		free(aliases->names[index]);
+	free(aliases->names);
+	destroy_string_table(aliases->given);
+	free(aliases);
+}
+
+////////////////////////////////////////////////////////
+// Ingest
+////////////////////////////////////////////////////////
+
+typedef struct eqtl_dims_st {
+	hsize_t gene, snp, tissue, statistic;
+	hsize_t beta, p_value;
+} EQTLDims;
+
+static hsize_t find_dim(FileContext * file, char * name) {
+	StringArray * names = get_dim_names(file);
+	hsize_t dim;
+	for (dim = 0; dim < names->count; dim++)
+		if (!strcmp(get_string_in_array(names, dim), name))
+			return dim;
+	fprintf(stderr, "File has no dimension named %s\n", name);
+	exit(1);
+}
+
+static hsize_t find_label_or_die(FileContext * file, hsize_t dim, char * label) {
+	hsize_t index;
+	if (!lookup_label(file, dim, label, &index)) {
+		fprintf(stderr, "Label %s is not stored in the file\n", label);
+		exit(1);
+	}
+	return index;
+}
+
+static void ingest_table(FileContext * file, EQTLDims * dims, AliasTable * aliases, PointBuffer * buffer, char * tissue, char * filename) {
+	hsize_t coords[4];
+	char * line = malloc(LINE_LENGTH);
+	char * fields[6];
+	hsize_t lines = 0, skipped = 0;
+
+	gzFile input = gzopen(filename, "rb");
+	if (!input) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		exit(1);
+	}
+	gzbuffer(input, 1 << 20);
+	coords[dims->tissue] = find_label_or_die(file, dims->tissue, tissue);
+
+	while (gzgets(input, line, LINE_LENGTH)) {
+		// SNP, gene, beta, t-stat, p-value, location
+		if (split_fields(line, fields, 6) < 5 || strncmp(fields[0], "rs", 2))
+			continue;
+		lines++;
+
+		// Gene versions are not part of the labels
+		char * version = strchr(fields[1], '.');
+		if (version)
+			*version = '\0';
+		char * alias;
+		if (!lookup_label(file, dims->snp, fields[0], coords + dims->snp)
+		    && !((alias = find_alias(aliases, fields[0])) && lookup_label(file, dims->snp, alias, coords + dims->snp))) {
+			skipped++;
+			continue;
+		}
+		if (!lookup_label(file, dims->gene, fields[1], coords + dims->gene)) {
+			skipped++;
+			continue;
+		}
+
+		coords[dims->statistic] = dims->beta;
+		add_point(file, buffer, coords, strtod(fields[2], NULL));
+		coords[dims->statistic] = dims->p_value;
+		add_point(file, buffer, coords, strtod(fields[4], NULL));
+	}
+
+	fprintf(stderr, "Read %lli lines of %s for tissue %s, skipped %lli with unknown labels\n", lines, filename, tissue, skipped);
+	gzclose(input);
+	free(line);
+}
+
+static void usage() {
+	fprintf(stderr, "Usage: eqtl_ingest [-b batch_size] [-t threads] [-a snp_ids] file.hd5 tissue table.gz [tissue table.gz ...]\n");
+	exit(1);
+}
+
+int main(int argc, char ** argv) {
+	hsize_t batch_size = DEFAULT_BATCH_SIZE;
+	FileOptions options = {1, STORAGE_NONE, 0, ENCODING_DOUBLE};
+	EQTLDims dims;
+	char * alias_file = NULL;
+	int opt, arg;
+
+	while ((opt = getopt(argc, argv, "b:t:a:")) != -1) {
+		if (opt == 'b')
+			batch_size = strtoull(optarg, NULL, 10);
+		else if (opt == 'a')
+			alias_file = optarg;
+		else if (opt == 't')
+			options.threads = atoi(optarg);
+		else
+			usage();
+	}
+	if (argc - optind < 3 || (argc - optind) % 2 != 1 || !batch_size)
+		usage();
+
+	time_t start = time(NULL);
+	FileContext * file = open_file(argv[optind], 0, &options);
+	hsize_t rank = get_file_rank(file);
+	if (rank != 4) {
+		fprintf(stderr, "Expected an eQTL file of rank 4, not %lli\n", rank);
+		exit(1);
+	}
+	dims.gene = find_dim(file, "gene");
+	dims.snp = find_dim(file, "snp");
+	dims.tissue = find_dim(file, "tissue");
+	dims.statistic = find_dim(file, "statistic");
+	dims.beta = find_label_or_die(file, dims.statistic, "beta");
+	dims.p_value = find_label_or_die(file, dims.statistic, "p-value");
+
+	AliasTable * aliases;
+	if (alias_file)
+		aliases = read_aliases(alias_file, true);
+	else {
+		char * default_file = malloc(strlen(argv[optind]) + strlen(".snp.ids") + 1);
+		sprintf(default_file, "%s.snp.ids", argv[optind]);
+		aliases = read_aliases(default_file, false);
+		free(default_file);
+	}
+
+	PointBuffer * buffer = new_point_buffer(rank, batch_size);
+	for (arg = optind + 1; arg < argc; arg += 2)
+		ingest_table(file, &dims, aliases, buffer, argv[arg], argv[arg + 1]);
+	flush_points(file, buffer);
+	close_file(file);
+	fprintf(stderr, "Ingested %lli points in %li s\n", buffer->stored, (long) (time(NULL) - start));
+
+	destroy_point_buffer(buffer);
+	destroy_aliases(aliases);
+	return 0;
+}
@@ -0,0 +1,278 @@
+// Copyright [1999-2015] Wellcome Trust Sanger Institute and the EMBL-European Bioinformatics Institute
+// Copyright [2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "hdf5_wrapper.h"
+#include "hdf5_wrapper_priv.h"
+
+#define RANK 4
+#define REPEATS 20
+
+////////////////////////////////////////////////////////
+// Reference implementation: two passes over the buffer,
+// one recursive call and one calloc per hit
+////////////////////////////////////////////////////////
+
+typedef struct legacy_table_st {
+	hsize_t rows, columns;
+	hsize_t * dims;
+	hsize_t ** coords;
+	double * values;
+} LegacyTable;
+
+static hsize_t volume(hsize_t rank, hsize_t * dim_sizes) {
+	hsize_t dim;
+	hsize_t res = 1;
+	for (dim = 0; dim < rank; dim++)
+		res *= dim_sizes[dim];
+	return res;
+}
+
+static hsize_t legacy_count_non_zero_values(double * array, hsize_t rank, hsize_t * width) {
+	hsize_t count = 0;
+	hsize_t pos;
+	hsize_t max = volume(rank, width);
+	for (pos = 0; pos < max; pos++) {
+		if (array[pos])
+			count++;
+	}
+
+	return count;
+}
+
+static void legacy_enter_new_data_point(LegacyTable * table, hsize_t rank, hsize_t write_index, hsize_t * offset, double value) {
+	table->values[write_index] = value;
+	hsize_t * vector = calloc(rank, sizeof(hsize_t));
+	hsize_t dim;
+	for (dim = 0; dim < table->columns; dim++)
+		vector[dim] = offset[table->dims[dim]];
+	table->coords[write_index] = vector;
+}
+
+static void legacy_unroll_matrix_recursive(double ** reader_ptr, hsize_t rank, hsize_t* width, LegacyTable * table, hsize_t * offset, hsize_t current_dim, hsize_t * write_index) {
+	hsize_t index;
+	if (current_dim == rank - 1) {
+		for (index = 0; index < width[current_dim]; index++) {
+			if (**reader_ptr) {
+				legacy_enter_new_data_point(table, rank, *write_index, offset, **reader_ptr);
+				(*write_index)++;
+			}
+			(*reader_ptr)++;
+			offset[current_dim]++;
+		}
+	} else {
+		for (index = 0; index < width[current_dim]; index++) {
+			legacy_unroll_matrix_recursive(reader_ptr, rank, width, table, offset, current_dim + 1, write_index);
+			offset[current_dim+1] -= width[current_dim+1];
+			offset[current_dim]++;
+		}
+	}
+}
+
+static hsize_t legacy_unroll_matrix(double * array, hsize_t rank, hsize_t * offset, hsize_t * width, hsize_t * dims, hsize_t columns) {
+	LegacyTable table;
+	hsize_t write_index = 0;
+	hsize_t offset2[RANK];
+	hsize_t row, dim;
+
+	table.columns = columns;
+	table.dims = dims;
+	table.rows = legacy_count_non_zero_values(array, rank, width);
+	table.coords = calloc(table.rows, sizeof(hsize_t*));
+	table.values = calloc(table.rows, sizeof(double));
+
+	for (dim = 0; dim < rank; dim++)
+		offset2[dim] = offset[dim];
+	double * reader_ptr = array;
+	legacy_unroll_matrix_recursive(&reader_ptr, rank, width, &table, offset2, 0, &write_index);
+
+	for (row = 0; row < table.rows; row++)
+		free(table.coords[row]);
+	free(table.coords);
+	free(table.values);
+	return write_index;
+}
+
+////////////////////////////////////////////////////////
+// Benchmark
+////////////////////////////////////////////////////////
+
+static double * random_buffer(hsize_t count, double density) {
+	double * buffer = calloc(count, sizeof(double));
+	hsize_t pos;
+	for (pos = 0; pos < count; pos++)
+		if (rand() < density * RAND_MAX)
+			buffer[pos] = rand() / (double) RAND_MAX + 1;
+	return buffer;
+}
+
+static void run_benchmark(char * name, double density) {
+	hsize_t width[RANK] = {16, 16, 64, 64};
+	hsize_t offset[RANK] = {0, 100, 200, 300};
+	bool set_dims[RANK] = {1, 0, 0, 0};
+	hsize_t dims[RANK] = {1, 2, 3};
+	hsize_t count = volume(RANK, width);
+	double * buffer = random_buffer(count, density);
+	hsize_t legacy_rows = 0, rows = 0;
+	int repeat;
+
+	clock_t start = clock();
+	for (repeat = 0; repeat < REPEATS; repeat++)
+		legacy_rows = legacy_unroll_matrix(buffer, RANK, offset, width, dims, 3);
+	double legacy_time = ((double) (clock() - start)) / CLOCKS_PER_SEC / REPEATS;
+
+	start = clock();
+	for (repeat = 0; repeat < REPEATS; repeat++) {
+		ResultTable * table = new_result_table(RANK, set_dims);
+		unroll_matrix(table, buffer, RANK, offset, width);
+		rows = table->rows;
+		destroy_result_table(table);
+	}
+	double time = ((double) (clock() - start)) / CLOCKS_PER_SEC / REPEATS;
+
+	if (rows != legacy_rows) {
+		printf("Mismatch on %s buffer: %lli vs %lli rows\n", name, rows, legacy_rows);
+		abort();
+	}
+
+	printf("%s\t%lli cells\t%lli hits\tlegacy %lf s\tkernel %lf s\tspeedup %.1fx\n", name, count, rows, legacy_time, time, legacy_time / time);
+	free(buffer);
+}
+
+////////////////////////////////////////////////////////
+// Storage profiles: eQTL-like file, each gene carrying
+// a window of SNPs in half of the tissues
+////////////////////////////////////////////////////////
+
+#define TISSUES 8
+#define GENES 500
+#define SNPS 20000
+#define WINDOW 200
+#define QUERIES 100
+
+static double wall_time() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static char ** make_labels(char * format, hsize_t count) {
+	char ** labels = calloc(count, sizeof(char *));
+	hsize_t index;
+	for (index = 0; index < count; index++) {
+		labels[index] = calloc(16, sizeof(char));
+		sprintf(labels[index], format, index);
+	}
+	return labels;
+}
+
+static void free_labels(char ** labels, hsize_t count) {
+	hsize_t index;
+	for (index = 0; index < count; index++)
+		free(labels[index]);
+	free(labels);
+}
+
+static void run_storage_benchmark(char * name, StorageProfile storage, ValueEncoding encoding) {
+	char * filename = "BENCH_STORAGE.hd5";
+	// Listed by increasing size, the order create_file sorts them in
+	char * dim_names[] = {"tissue", "gene", "snp"};
+	hsize_t dim_sizes[] = {TISSUES, GENES, SNPS};
+	hsize_t dim_label_lengths[] = {8, 15, 15};
+	FileOptions options = {1, storage, 0, encoding};
+	hsize_t tissue, gene, snp, query, count = 0;
+
+	srand(1);
+	hsize_t capacity = TISSUES * GENES * WINDOW;
+	hsize_t * coords = calloc(capacity * 3, sizeof(hsize_t));
+	hsize_t ** coord_array = calloc(capacity, sizeof(hsize_t *));
+	double * values = calloc(capacity, sizeof(double));
+	for (gene = 0; gene < GENES; gene++)
+		for (tissue = 0; tissue < TISSUES; tissue++) {
+			if (rand() % 2)
+				continue;
+			for (snp = gene * (SNPS - WINDOW) / GENES; snp < gene * (SNPS - WINDOW) / GENES + WINDOW; snp++) {
+				coord_array[count] = coords + 3 * count;
+				coord_array[count][0] = tissue;
+				coord_array[count][1] = gene;
+				coord_array[count][2] = snp;
+				values[count] = rand() / (double) RAND_MAX;
+				count++;
+			}
+		}
+
+	char ** tissues = make_labels("tissue%lli", TISSUES);
+	char ** genes = make_labels("ENSG%011lli", GENES);
+	char ** snps = make_labels("rs%lli", SNPS);
+
+	double start = wall_time();
+	FileContext * file = create_file(filename, 3, dim_names, dim_sizes, dim_label_lengths, NULL, &options);
+	store_dim_labels(file, "tissue", TISSUES, tissues);
+	store_dim_labels(file, "gene", GENES, genes);
+	store_dim_labels(file, "snp", SNPS, snps);
+	store_values(file, count, coord_array, values);
+	close_file(file);
+	double write_time = wall_time() - start;
+
+	struct stat info;
+	stat(filename, &info);
+
+	file = open_file(filename, 1, NULL);
+	bool set_dims[] = {0, 1, 0};
+	hsize_t constraints[] = {0, 0, 0};
+	hsize_t rows = 0;
+	start = wall_time();
+	for (query = 0; query < QUERIES; query++) {
+		constraints[1] = rand() % GENES;
+		StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
+		rows += res->rows;
+		destroy_string_result_table(res);
+	}
+	double read_time = (wall_time() - start) / QUERIES;
+	close_file(file);
+	remove(filename);
+
+	printf("%s\t%lli non zeros\t%lli bytes\t%.2lf bytes/non zero\twrite %lf s\tread %.3lf ms/query (%lli rows)\n", name, count, (long long) info.st_size, info.st_size / (double) count, write_time, read_time * 1000, rows / QUERIES);
+
+	free_labels(tissues, TISSUES);
+	free_labels(genes, GENES);
+	free_labels(snps, SNPS);
+	free(coords);
+	free(coord_array);
+	free(values);
+}
+
+int main(int argc, char ** argv) {
+	srand(1);
+	run_benchmark("dense", 1);
+	run_benchmark("half", 0.5);
+	run_benchmark("sparse", 0.001);
+	run_benchmark("empty", 0);
+
+	set_big_dim_length(100);
+	run_storage_benchmark("none", STORAGE_NONE, ENCODING_DOUBLE);
+	run_storage_benchmark("deflate", STORAGE_DEFLATE, ENCODING_DOUBLE);
+	run_storage_benchmark("shuffle+deflate", STORAGE_SHUFFLE_DEFLATE, ENCODING_DOUBLE);
+	run_storage_benchmark("lz4", STORAGE_LZ4, ENCODING_DOUBLE);
+	run_storage_benchmark("zstd", STORAGE_ZSTD, ENCODING_DOUBLE);
+	run_storage_benchmark("float", STORAGE_NONE, ENCODING_FLOAT);
+	run_storage_benchmark("-log10 p", STORAGE_NONE, ENCODING_NEG_LOG10_U16);
+	run_storage_benchmark("shuffle+deflate float", STORAGE_SHUFFLE_DEFLATE, ENCODING_FLOAT);
+	run_storage_benchmark("shuffle+deflate -log10 p", STORAGE_SHUFFLE_DEFLATE, ENCODING_NEG_LOG10_U16);
+	return 0;
+}
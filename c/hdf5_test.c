@@ -15,9 +15,531 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "hdf5_wrapper.h"
 #include "hdf5_wrapper_priv.h"
 
+static void test_chunked_fetch() {
+	char * dim_names[] = {"row", "column"};
+	hsize_t dim_sizes[] = {5, 5};
+	hsize_t chunk_sizes[] = {2, 2};
+	hsize_t dim_label_lengths[] = {2, 2};
+	char * labels[] = {"a", "b", "c", "d", "e"};
+	hsize_t coord[][2] = {{0,0}, {1,3}, {2,2}, {3,1}, {4,4}, {4,0}};
+	hsize_t * coord_array[] = {coord[0], coord[1], coord[2], coord[3], coord[4], coord[5]};
+	double values[] = {1, 2, 3, 4, 5, 6};
+	hsize_t row;
+
+	puts("Testing chunked fetch");
+	FileContext * file = create_file("TEST_CHUNKS.hd5", 2, dim_names, dim_sizes, dim_label_lengths, chunk_sizes, NULL);
+	store_dim_labels(file, "row", 5, labels);
+	store_dim_labels(file, "column", 5, labels);
+	store_values(file, 6, coord_array, values);
+
+	bool set_dims[] = {0, 0};
+	hsize_t constraints[] = {0, 0};
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
+	printf("- Data points: %lli\n", res->rows);
+	if (res->rows != 6)
+		abort();
+	double total = 0;
+	for (row = 0; row < res->rows; row++)
+		total += res->values[row];
+	if (total != 21)
+		abort();
+	destroy_string_result_table(res);
+
+	bool set_dims2[] = {1, 0};
+	hsize_t constraints2[] = {4, 0};
+	res = fetch_string_values(file, set_dims2, constraints2, NULL);
+	printf("- Data points in row 4: %lli\n", res->rows);
+	if (res->rows != 2)
+		abort();
+	for (row = 0; row < res->rows; row++) {
+		if (!strcmp(get_result_label(res, 0, row), "a") && res->values[row] != 6)
+			abort();
+		if (!strcmp(get_result_label(res, 0, row), "e") && res->values[row] != 5)
+			abort();
+	}
+	destroy_string_result_table(res);
+
+	puts("Testing value filters");
+	ValueFilter filter = {VALUE_GT, 2.5, 0, TOP_LARGEST};
+	res = fetch_string_values(file, set_dims, constraints, &filter);
+	printf("- Data points above 2.5: %lli\n", res->rows);
+	if (res->rows != 4)
+		abort();
+	destroy_string_result_table(res);
+
+	ValueFilter top = {VALUE_LT, 6, 3, TOP_SMALLEST};
+	res = fetch_string_values(file, set_dims, constraints, &top);
+	printf("- Smallest 3 data points below 6: %lli\n", res->rows);
+	if (res->rows != 3 || res->values[0] != 1 || res->values[1] != 2 || res->values[2] != 3)
+		abort();
+	if (strcmp(get_result_label(res, 0, 2), "c") || strcmp(get_result_label(res, 1, 2), "c"))
+		abort();
+	destroy_string_result_table(res);
+
+	puts("Testing point lookups");
+	hsize_t point[] = {2, 2};
+	if (get_value(file, point) != 3)
+		abort();
+	hsize_t * points[] = {coord[4], point, constraints};
+	double point_values[3];
+	get_values(file, 3, points, point_values);
+	printf("- Point values: %lf %lf %lf\n", point_values[0], point_values[1], point_values[2]);
+	if (point_values[0] != 5 || point_values[1] != 3 || point_values[2] != 1)
+		abort();
+	bool all_set[] = {1, 1};
+	res = fetch_string_values(file, all_set, point, NULL);
+	if (res->rows != 1 || res->columns != 0 || res->values[0] != 3)
+		abort();
+	destroy_string_result_table(res);
+
+	puts("Testing batched fetch");
+	bool * batch_set_dims[] = {set_dims2, set_dims, set_dims2};
+	hsize_t constraints3[] = {1, 0};
+	hsize_t * batch_constraints[] = {constraints2, constraints, constraints3};
+	StringResultTable ** batch = fetch_string_values_batch(file, 3, batch_set_dims, batch_constraints);
+	printf("- Data points per query: %lli %lli %lli\n", batch[0]->rows, batch[1]->rows, batch[2]->rows);
+	if (batch[0]->rows != 2 || batch[1]->rows != 6 || batch[2]->rows != 1)
+		abort();
+	if (strcmp(get_result_label(batch[2], 0, 0), "d") || batch[2]->values[0] != 2)
+		abort();
+	for (row = 0; row < 3; row++)
+		destroy_string_result_table(batch[row]);
+	free(batch);
+
+	puts("Testing range fetch");
+	hsize_t row_lo[] = {1, 4}, row_hi[] = {3, 5};
+	DimConstraint ranges[] = {{2, row_lo, row_hi}, {0, NULL, NULL}};
+	res = fetch_string_values_ranges(file, ranges, NULL);
+	printf("- Data points in rows [1,3) and [4,5): %lli\n", res->rows);
+	if (res->rows != 4 || res->columns != 2)
+		abort();
+	total = 0;
+	for (row = 0; row < res->rows; row++)
+		total += res->values[row];
+	if (total != 16)
+		abort();
+	destroy_string_result_table(res);
+
+	hsize_t point_lo[] = {4}, point_hi[] = {5}, column_lo[] = {3}, column_hi[] = {5};
+	DimConstraint ranges2[] = {{1, point_lo, point_hi}, {1, column_lo, column_hi}};
+	res = fetch_string_values_ranges(file, ranges2, NULL);
+	printf("- Data points in row 4, columns [3,5): %lli\n", res->rows);
+	if (res->rows != 1 || res->columns != 1 || res->values[0] != 5 || strcmp(get_result_label(res, 0, 0), "e"))
+		abort();
+	destroy_string_result_table(res);
+
+	DimConstraint * batch_ranges[] = {ranges, ranges2};
+	batch = fetch_string_values_batch_ranges(file, 2, batch_ranges);
+	printf("- Data points per range query: %lli %lli\n", batch[0]->rows, batch[1]->rows);
+	if (batch[0]->rows != 4 || batch[1]->rows != 1 || batch[1]->values[0] != 5)
+		abort();
+	destroy_string_result_table(batch[0]);
+	destroy_string_result_table(batch[1]);
+	free(batch);
+
+	Cursor * range_cursor = open_cursor_ranges(file, ranges);
+	total = 0;
+	while ((res = cursor_next(range_cursor, 1))->rows) {
+		total += res->values[0];
+		destroy_string_result_table(res);
+	}
+	destroy_string_result_table(res);
+	cursor_close(range_cursor);
+	printf("- Sum of data points through range cursor: %lf\n", total);
+	if (total != 16)
+		abort();
+
+	puts("Testing cursor");
+	Cursor * cursor = open_cursor(file, set_dims, constraints);
+	hsize_t count = 0;
+	total = 0;
+	while (true) {
+		res = cursor_next(cursor, 4);
+		if (res->rows > 4)
+			abort();
+		if (!res->rows) {
+			destroy_string_result_table(res);
+			break;
+		}
+		for (row = 0; row < res->rows; row++) {
+			char * label = get_result_label(res, 0, row);
+			if (label[0] - 'a' != res->indices[0][row])
+				abort();
+			total += res->values[row];
+		}
+		count += res->rows;
+		destroy_string_result_table(res);
+	}
+	cursor_close(cursor);
+	printf("- Data points through cursor: %lli\n", count);
+	if (count != 6 || total != 21)
+		abort();
+
+	puts("Testing chunk merges");
+	hsize_t overwrite[][2] = {{0,1}, {0,1}};
+	hsize_t * overwrite_array[] = {overwrite[0], overwrite[1]};
+	double overwrite_values[] = {8, 9};
+	store_values(file, 2, overwrite_array, overwrite_values);
+	hsize_t cell[] = {0, 1};
+	if (get_value(file, cell) != 9 || get_value(file, coord[0]) != 1 || get_value(file, coord[1]) != 2)
+		abort();
+
+	// Row 0 now spans columns 0 and 1, boundaries starting at 0 must hold
+	flush_file(file);
+	hsize_t constraints4[] = {0, 0};
+	res = fetch_string_values(file, set_dims2, constraints4, NULL);
+	printf("- Data points in row 0: %lli\n", res->rows);
+	if (res->rows != 2)
+		abort();
+	destroy_string_result_table(res);
+
+	close_file(file);
+	file = open_file("TEST_CHUNKS.hd5", 1, NULL);
+	res = fetch_string_values(file, set_dims2, constraints4, NULL);
+	if (res->rows != 2)
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_CHUNKS.hd5");
+}
+
+static void test_parallel_writes(StorageProfile storage) {
+	char * dim_names[] = {"row", "column"};
+	hsize_t dim_sizes[] = {10, 10};
+	hsize_t chunk_sizes[] = {4, 4};
+	hsize_t dim_label_lengths[] = {2, 2};
+	hsize_t coord[100][2];
+	hsize_t * coord_array[100];
+	double values[100], read[100];
+	char * labels[] = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j"};
+	FileOptions options = {4, storage, 6};
+	hsize_t index;
+
+	printf("Testing parallel compressed writes, storage profile %i\n", storage);
+	FileContext * file = create_file("TEST_PARALLEL.hd5", 2, dim_names, dim_sizes, dim_label_lengths, chunk_sizes, &options);
+	if (file->deflate_level != 6 || file->threads != 4 || file->shuffle != (storage == STORAGE_SHUFFLE_DEFLATE))
+		abort();
+	store_dim_labels(file, "row", 10, labels);
+	store_dim_labels(file, "column", 10, labels);
+	for (index = 0; index < 100; index++) {
+		coord[index][0] = index / 10;
+		coord[index][1] = index % 10;
+		coord_array[index] = coord[index];
+		values[index] = index % 7 ? index : 0;
+	}
+	store_values(file, 100, coord_array, values);
+
+	// Merged with the chunks written above, edge chunks included
+	hsize_t * diagonal[10];
+	double minus_ones[10];
+	for (index = 0; index < 10; index++) {
+		diagonal[index] = coord[index * 11];
+		minus_ones[index] = -1;
+	}
+	store_values(file, 10, diagonal, minus_ones);
+	close_file(file);
+
+	file = open_file("TEST_PARALLEL.hd5", 1, NULL);
+	get_values(file, 100, coord_array, read);
+	for (index = 0; index < 100; index++)
+		if (read[index] != (index % 11 ? values[index] : -1))
+			abort();
+
+	// Labels and boundaries are compressed too
+	bool set_dims[] = {1, 0};
+	hsize_t constraints[] = {1, 0};
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
+	if (res->rows != 9 || strcmp(get_result_label(res, 0, 0), "a") || res->values[1] != -1)
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_PARALLEL.hd5");
+}
+
+static void test_extend_dimension() {
+	char * dim_names[] = {"row", "column"};
+	hsize_t dim_sizes[] = {3, 4};
+	hsize_t chunk_sizes[] = {2, 2};
+	hsize_t dim_label_lengths[] = {2, 2};
+	char * labels[] = {"a", "b", "c", "d"};
+	char * new_labels[] = {"x", "y"};
+	hsize_t coord[][2] = {{0,0}, {2,3}, {4,1}};
+	hsize_t * coord_array[] = {coord[0], coord[1], coord[2]};
+	double values[] = {1, 2, 3};
+
+	puts("Testing dimension extension");
+	FileContext * file = create_file("TEST_EXTEND.hd5", 2, dim_names, dim_sizes, dim_label_lengths, chunk_sizes, NULL);
+	store_dim_labels(file, "row", 3, labels);
+	store_dim_labels(file, "column", 4, labels);
+	store_values(file, 2, coord_array, values);
+	extend_dimension(file, "row", 2, new_labels);
+	store_values_packed(file, 1, coord[2], values + 2);
+	close_file(file);
+
+	file = open_file("TEST_EXTEND.hd5", 0, NULL);
+	if (file->dim_sizes[0] != 5 || get_value(file, coord[1]) != 2 || get_value(file, coord[2]) != 3)
+		abort();
+	bool set_dims[] = {1, 0};
+	hsize_t constraints[] = {4, 0};
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
+	if (res->rows != 1 || strcmp(get_result_label(res, 0, 0), "b") || res->values[0] != 3)
+		abort();
+	destroy_string_result_table(res);
+	bool set_dims2[] = {0, 1};
+	hsize_t constraints2[] = {0, 1};
+	res = fetch_string_values(file, set_dims2, constraints2, NULL);
+	if (res->rows != 1 || strcmp(get_result_label(res, 0, 0), "y"))
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_EXTEND.hd5");
+}
+
+static void test_value_encoding(ValueEncoding encoding, StorageProfile storage, int threads) {
+	char * dim_names[] = {"row", "column"};
+	hsize_t dim_sizes[] = {3, 3};
+	hsize_t chunk_sizes[] = {2, 2};
+	hsize_t dim_label_lengths[] = {2, 2};
+	hsize_t coord[][2] = {{0,0}, {0,2}, {1,1}, {2,2}};
+	hsize_t * coord_array[] = {coord[0], coord[1], coord[2], coord[3]};
+	double values[] = {0.01, 1e-50, 0.5, 1};
+	double read[4];
+	FileOptions options = {threads, storage, 0, encoding};
+	hsize_t index;
+
+	printf("Testing value encoding %i, storage profile %i, %i thread(s)\n", encoding, storage, threads);
+	FileContext * file = create_file("TEST_ENCODING.hd5", 2, dim_names, dim_sizes, dim_label_lengths, chunk_sizes, &options);
+	// Written in two batches, so that chunks get merged
+	store_values(file, 2, coord_array, values);
+	store_values(file, 2, coord_array + 2, values + 2);
+	close_file(file);
+
+	file = open_file("TEST_ENCODING.hd5", 1, NULL);
+	if (file->encoding != encoding)
+		abort();
+	get_values(file, 4, coord_array, read);
+	for (index = 0; index < 4; index++) {
+		// Quantised -log10 p is within one code (0.01) of the value, floats never round to 0
+		if (read[index] == 0 || fabs(log10(read[index]) - log10(values[index])) > (encoding == ENCODING_FLOAT && index == 1 ? 20 : 0.011))
+			abort();
+	}
+	bool set_dims[] = {0, 0};
+	hsize_t constraints[] = {0, 0};
+	ValueFilter filter = {VALUE_LT, 0.1, 0, TOP_LARGEST};
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, &filter);
+	if (res->rows != 2)
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_ENCODING.hd5");
+}
+
+static void test_staging() {
+	char * dim_names[] = {"row", "column"};
+	hsize_t dim_sizes[] = {4, 4};
+	hsize_t chunk_sizes[] = {2, 2};
+	hsize_t dim_label_lengths[] = {2, 2};
+	hsize_t coord[][2] = {{0,0}, {3,3}, {0,0}, {1,2}, {3,3}};
+	hsize_t * coord_array[] = {coord[0], coord[1], coord[2], coord[3], coord[4]};
+	double values[] = {1, 2, 3, 4, 5};
+	// Room for 3 points of rank 2
+	FileOptions options = {1, STORAGE_NONE, 0, ENCODING_DOUBLE, 3 * 3 * sizeof(hsize_t) - 1};
+
+	puts("Testing write staging");
+	FileContext * file = create_file("TEST_STAGING.hd5", 2, dim_names, dim_sizes, dim_label_lengths, chunk_sizes, &options);
+	store_values(file, 2, coord_array, values);
+	if (file->staged != 2)
+		abort();
+	// Overflows the arena once, the later writes of a cell win
+	store_values(file, 3, coord_array + 2, values + 2);
+	if (file->staged != 2)
+		abort();
+	// Reads see the staged points
+	if (get_value(file, coord[0]) != 3 || get_value(file, coord[4]) != 5 || file->staged)
+		abort();
+	store_values(file, 1, coord_array, values);
+	close_file(file);
+
+	file = open_file("TEST_STAGING.hd5", 1, NULL);
+	if (get_value(file, coord[0]) != 1 || get_value(file, coord[3]) != 4 || get_value(file, coord[4]) != 5)
+		abort();
+	bool set_dims[] = {0, 0};
+	hsize_t constraints[] = {0, 0};
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
+	if (res->rows != 3)
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_STAGING.hd5");
+}
+
+static void test_label_index() {
+	char * dim_names[] = {"snp", "gene"};
+	hsize_t dim_sizes[] = {5, 2};
+	hsize_t dim_label_lengths[] = {12, 2};
+	char * snps[] = {"rs9\t1\t200", "rs10", "rs1\t1\t100"};
+	char * more_snps[] = {"rs5", "rs10"};
+	char * queries[] = {"rs1", "rs5", "rs2", "rs10", "rs9"};
+	hsize_t expected[] = {2, 3, 0, 1, 0};
+	bool expected_found[] = {1, 1, 0, 1, 1};
+	hsize_t indices[5], index;
+	bool found[5];
+
+	puts("Testing label index");
+	FileContext * file = create_file("TEST_INDEX.hd5", 2, dim_names, dim_sizes, dim_label_lengths, NULL, NULL);
+	hsize_t dim = strcmp(get_string_in_array(get_dim_names(file), 0), "snp") ? 1 : 0;
+	store_dim_labels(file, "snp", 3, snps);
+	if (!lookup_label(file, dim, "rs10", &index) || index != 1 || lookup_label(file, dim, "rs5", &index))
+		abort();
+	// The first of duplicate labels wins
+	store_dim_labels(file, "snp", 2, more_snps);
+	close_file(file);
+
+	file = open_file("TEST_INDEX.hd5", 1, NULL);
+	if (H5Lexists(file->file, "/label_index", H5P_DEFAULT) <= 0)
+		abort();
+	if (lookup_labels(file, dim, 5, queries, indices, found) != 4)
+		abort();
+	for (index = 0; index < 5; index++)
+		if (found[index] != expected_found[index] || (found[index] && indices[index] != expected[index]))
+			abort();
+	close_file(file);
+	remove("TEST_INDEX.hd5");
+}
+
+static void test_label_blob() {
+	char * dim_names[] = {"tissue", "snp"};
+	hsize_t dim_sizes[] = {2, 3};
+	// Label lengths are not needed by variable length tables
+	hsize_t dim_label_lengths[] = {0, 0};
+	char * snps[] = {"rs12345678\t1\t100", "rs7", ""};
+	char * tissues[] = {"Whole_Blood", "Lung"};
+	char * new_snps[] = {"rs42\t2\t4200"};
+	hsize_t coord[][2] = {{1,0}, {0,3}};
+	hsize_t * coord_array[] = {coord[0]};
+	double values[] = {1, 2};
+	hsize_t index;
+	FileOptions options = {1, STORAGE_SHUFFLE_DEFLATE, 0, ENCODING_DOUBLE, 0, LABELS_BLOB};
+
+	puts("Testing variable length labels");
+	FileContext * file = create_file("TEST_BLOB.hd5", 2, dim_names, dim_sizes, dim_label_lengths, NULL, &options);
+	store_dim_labels(file, "snp", 3, snps);
+	store_dim_labels(file, "tissue", 2, tissues);
+	store_values(file, 1, coord_array, values);
+	extend_dimension(file, "snp", 1, new_snps);
+	store_values_packed(file, 1, coord[1], values + 1);
+	close_file(file);
+
+	file = open_file("TEST_BLOB.hd5", 1, NULL);
+	StringArray * labels = get_all_dim_labels(file, 1);
+	if (labels->count != 4 || strcmp(get_string_in_array(labels, 0), snps[0]) || strcmp(get_string_in_array(labels, 2), "") || strcmp(get_string_in_array(labels, 3), new_snps[0]))
+		abort();
+	destroy_string_array(labels);
+	if (!lookup_label(file, 1, "rs42", &index) || index != 3 || !lookup_label(file, 0, "Lung", &index) || index != 1)
+		abort();
+	bool set_dims[] = {0, 1};
+	hsize_t constraints[] = {0, 3};
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
+	if (res->rows != 1 || strcmp(get_result_label(res, 0, 0), "Whole_Blood") || res->values[0] != 2)
+		abort();
+	destroy_string_result_table(res);
+	constraints[1] = 0;
+	res = fetch_string_values(file, set_dims, constraints, NULL);
+	if (res->rows != 1 || strcmp(get_result_label(res, 0, 0), "Lung"))
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_BLOB.hd5");
+}
+
+static void test_dim_meta() {
+	char * dim_names[] = {"gene", "snp"};
+	hsize_t dim_sizes[] = {2, 3};
+	hsize_t dim_label_lengths[] = {1, 3};
+	char * genes[] = {"A", "B"};
+	char * snps[] = {"rs1", "rs2", "rs3"};
+	char * chroms[] = {"1", "X"};
+	DimMeta meta[] = {{0, 1, 100, 101}, {1, 0, 2000, 2000}};
+	hsize_t coord[] = {1, 1};
+	double value = 3;
+
+	puts("Testing dimension metadata");
+	FileContext * file = create_file("TEST_META.hd5", 2, dim_names, dim_sizes, dim_label_lengths, NULL, NULL);
+	store_dim_labels(file, "gene", 2, genes);
+	store_dim_labels(file, "snp", 3, snps);
+	store_dim_meta(file, "snp", 2, meta);
+	store_meta_dictionary(file, "chrom", 2, chroms);
+	store_values_packed(file, 1, coord, &value);
+	close_file(file);
+
+	file = open_file("TEST_META.hd5", 1, NULL);
+	if (get_meta_dictionary(file, "consequence") || get_dim_meta(file, 0, 0, 2))
+		abort();
+	StringArray * dictionary = get_meta_dictionary(file, "chrom");
+	if (dictionary->count != 2 || strcmp(get_string_in_array(dictionary, 1), "X"))
+		abort();
+	destroy_string_array(dictionary);
+	// The third SNP has no metadata
+	DimMeta * rows = get_dim_meta(file, 1, 1, 2);
+	if (rows[0].chrom != 1 || rows[0].start != 2000 || rows[1].start != 0)
+		abort();
+	free(rows);
+	bool set_dims[] = {1, 0};
+	hsize_t constraints[] = {1, 0};
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
+	if (res->rows != 1 || get_result_meta(res, 0, 0)->end != 2000 || get_result_meta(res, 0, 0)->consequence != 0)
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_META.hd5");
+}
+
+static void test_region() {
+	char * dim_names[] = {"gene", "snp"};
+	hsize_t dim_sizes[] = {1, 6};
+	hsize_t dim_label_lengths[] = {1, 3};
+	char * genes[] = {"A"};
+	char * snps[] = {"rs0", "rs1", "rs2", "rs3", "rs4", "rs5"};
+	char * chroms[] = {"1", "2"};
+	// rs4 is a deletion reaching into the region from before it
+	DimMeta meta[] = {{0, 0, 100, 100}, {0, 0, 200, 200}, {0, 0, 300, 300}, {1, 0, 200, 200}, {0, 0, 120, 160}, {0, 0, 250, 250}};
+	hsize_t coords[] = {0, 0, 0, 1, 0, 2, 0, 3, 0, 4, 0, 5};
+	double values[] = {1, 2, 3, 4, 5, 6};
+	DimConstraint constraint;
+
+	puts("Testing region queries");
+	FileContext * file = create_file("TEST_REGION.hd5", 2, dim_names, dim_sizes, dim_label_lengths, NULL, NULL);
+	store_dim_labels(file, "gene", 1, genes);
+	store_dim_labels(file, "snp", 6, snps);
+	store_meta_dictionary(file, "chrom", 2, chroms);
+	store_dim_meta(file, "snp", 6, meta);
+	store_values_packed(file, 6, coords, values);
+	close_file(file);
+
+	file = open_file("TEST_REGION.hd5", 1, NULL);
+	if (H5Lexists(file->file, "/position_index", H5P_DEFAULT) <= 0)
+		abort();
+	// rs1, rs4 and rs5, in two intervals
+	if (find_region(file, 1, "1", 150, 250, &constraint) != 3 || constraint.count != 2 || constraint.lo[0] != 1 || constraint.hi[1] != 6)
+		abort();
+	free(constraint.lo);
+	free(constraint.hi);
+	StringResultTable * res = fetch_region(file, 1, "2", 1, 1000, NULL, NULL);
+	if (res->rows != 1 || res->values[0] != 4)
+		abort();
+	destroy_string_result_table(res);
+	res = fetch_region(file, 1, "X", 1, 1000, NULL, NULL);
+	if (res->rows != 0)
+		abort();
+	destroy_string_result_table(res);
+	close_file(file);
+	remove("TEST_REGION.hd5");
+}
+
 int main(int argc, char ** argv) {
 	int rank = 2;
 	char * dim_names[] = {"snp", "gene"};
@@ -32,13 +554,13 @@ int main(int argc, char ** argv) {
 	set_hdf5_log(2);
 
 	printf("Creating files\n");
-	hid_t file = create_file("TEST.hd5", rank, dim_names, dim_sizes, dim_label_lengths, NULL);
+	FileContext * file = create_file("TEST.hd5", rank, dim_names, dim_sizes, dim_label_lengths, NULL, NULL);
 
 	store_dim_labels(file, "snp", 1, ylabels);
 
 	close_file(file);
 
-	file = open_file("TEST.hd5", 0);
+	file = open_file("TEST.hd5", 0, NULL);
 	store_dim_labels(file, "gene", 2, xlabels);
 	store_dim_labels(file, "snp", 1, ylabels2);
 
@@ -68,7 +590,6 @@ int main(int argc, char ** argv) {
 		labelsY = get_all_dim_labels(file, 0);
 		labelsX = get_all_dim_labels(file, 1);
 	}
-	destroy_string_array(names);
 
 	puts("Testing dim labels");
 	if (labelsX->count != 2)
@@ -98,7 +619,7 @@ int main(int argc, char ** argv) {
 	hsize_t constraints[] = {0, 0};
 
 	printf("Fetching values\n");
-	StringResultTable * res = fetch_string_values(file, set_dims, constraints);
+	StringResultTable * res = fetch_string_values(file, set_dims, constraints, NULL);
 
 	printf("Testing output:\n");
 
@@ -123,7 +644,7 @@ int main(int argc, char ** argv) {
 	bool set_dims2[] = {0, 0};
 
 	printf("Fetching values again\n");
-	StringResultTable * res2 = fetch_string_values(file, set_dims2, constraints);
+	StringResultTable * res2 = fetch_string_values(file, set_dims2, constraints, NULL);
 
 	printf("- Column count: %lli\n", res2->columns);
 	if (res2->columns != 2)
@@ -138,13 +659,27 @@ int main(int argc, char ** argv) {
 	bool set_dims3[] = {1, 1};
 
 	printf("Fetching values single\n");
-	StringResultTable * res3 = fetch_string_values(file, set_dims3, constraints);
+	StringResultTable * res3 = fetch_string_values(file, set_dims3, constraints, NULL);
 
 	if (res3->columns)
 		abort();
 
 	destroy_string_result_table(res3);
 
+	test_chunked_fetch();
+	test_parallel_writes(STORAGE_DEFLATE);
+	test_parallel_writes(STORAGE_SHUFFLE_DEFLATE);
+	test_extend_dimension();
+	test_value_encoding(ENCODING_FLOAT, STORAGE_NONE, 1);
+	test_value_encoding(ENCODING_NEG_LOG10_U16, STORAGE_NONE, 1);
+	test_value_encoding(ENCODING_FLOAT, STORAGE_SHUFFLE_DEFLATE, 2);
+	test_value_encoding(ENCODING_NEG_LOG10_U16, STORAGE_SHUFFLE_DEFLATE, 2);
+	test_staging();
+	test_label_index();
+	test_label_blob();
+	test_dim_meta();
+	test_region();
+
 	printf("Success\n");
 	return 0;
 }
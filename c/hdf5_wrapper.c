@@ -17,8 +17,16 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <float.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "hdf5.h"
 #include "hdf5_wrapper.h"
+#include "hdf5_wrapper_priv.h"
 
 #define VERIFY(a) do { if((a)<0) { fprintf(stderr,"Failure line %d.\n",__LINE__); exit(-1);}}while(0)
 
@@ -41,6 +49,61 @@ static void * alloc_ndim_array(hsize_t rank, hsize_t * dim_sizes, size_t elem_si
 	return calloc(1 + volume(rank, dim_sizes), elem_size);
 }
 
+////////////////////////////////////////////////////////
+// Storage profiles
+// Filters only apply to chunked datasets, the callers
+// choose the chunks
+////////////////////////////////////////////////////////
+
+#define H5Z_FILTER_LZ4 32004
+#define H5Z_FILTER_ZSTD 32015
+#define DEFAULT_DEFLATE_LEVEL 6
+#define DEFAULT_ZSTD_LEVEL 3
+#define LABEL_CHUNK_ROWS 4096
+// Labels buffered per dimension before a write
+#define LABEL_BUFFER_ROWS 65536
+// Bytes buffered, and chunk size, of variable length labels
+#define LABEL_BUFFER_BYTES (1 << 22)
+#define LABEL_BLOB_CHUNK_BYTES 65536
+
+static bool is_compressed(FileOptions * options) {
+	return options && options->storage != STORAGE_NONE;
+}
+
+static void set_storage_filters(hid_t params, FileOptions * options) {
+	unsigned level;
+	if (!is_compressed(options))
+		return;
+	switch (options->storage) {
+	case STORAGE_SHUFFLE_DEFLATE:
+		VERIFY(H5Pset_shuffle(params));
+		// Fall through
+	case STORAGE_DEFLATE:
+		VERIFY(H5Pset_deflate(params, options->level > 0 ? options->level : DEFAULT_DEFLATE_LEVEL));
+		break;
+	case STORAGE_LZ4:
+		VERIFY(H5Pset_filter(params, H5Z_FILTER_LZ4, H5Z_FLAG_MANDATORY, 0, NULL));
+		break;
+	case STORAGE_ZSTD:
+		level = options->level > 0 ? options->level : DEFAULT_ZSTD_LEVEL;
+		VERIFY(H5Pset_filter(params, H5Z_FILTER_ZSTD, H5Z_FLAG_MANDATORY, 1, &level));
+		break;
+	default:
+		break;
+	}
+}
+
+// Returns the profile create_file can actually honour
+static StorageProfile available_storage(StorageProfile storage) {
+	H5Z_filter_t filter = storage == STORAGE_LZ4 ? H5Z_FILTER_LZ4 : H5Z_FILTER_ZSTD;
+	if (storage != STORAGE_LZ4 && storage != STORAGE_ZSTD)
+		return storage;
+	if (H5Zfilter_avail(filter) > 0)
+		return storage;
+	fprintf(stderr, "HDF5 filter %i is not available, using shuffle+deflate instead\n", filter);
+	return STORAGE_SHUFFLE_DEFLATE;
+}
+
 ////////////////////////////////////////////////////////
 // String arrays 
 // A string array is simply an array of equal length strings
@@ -58,6 +121,8 @@ static StringArray * new_string_array(hsize_t count, hsize_t length) {
 }
 
 char * get_string_in_array(StringArray * sarray, hsize_t index) {
+	if (sarray->offsets)
+		return sarray->array + sarray->offsets[index];
 	return sarray->array + index * (sarray->length + 1);
 }
 
@@ -65,6 +130,7 @@ void destroy_string_array(StringArray * sarray) {
 	if (DEBUG)
 		printf(">>>>>>>>>>>>>>> DESTROYNG STRING ARRAY %p\n", sarray);
 	free(sarray->array);
+	free(sarray->offsets);
 	free(sarray);
 }
 
@@ -94,16 +160,30 @@ static StringArray * normalize_strings(char ** strings, hsize_t count, hsize_t l
 	return sarray;
 }
 
-static void create_string_array_table(hid_t file, char * dataset_name, hsize_t count, hsize_t max_length) {
-	hsize_t shape[2];
+// Extensible tables can later grow by any number of strings
+static void create_string_array_table(hid_t file, char * dataset_name, hsize_t count, hsize_t max_length, bool extensible, FileOptions * options) {
+	hsize_t shape[2], max_shape[2], chunk[2];
 	shape[0] = count;
 	shape[1] = max_length + 1;
+	max_shape[0] = extensible ? H5S_UNLIMITED : count;
+	max_shape[1] = shape[1];
 	if (DEBUG)
 		printf("Allocating space for %lli names of length %lli in %s\n", count, shape[1], dataset_name);
-	hid_t dataspace = H5Screate_simple(2, shape, NULL);
+	hid_t dataspace = H5Screate_simple(2, shape, max_shape);
 	VERIFY(dataspace);
-	hid_t dataset = H5Dcreate(file, dataset_name, H5T_NATIVE_CHAR, dataspace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	hid_t params = H5Pcreate(H5P_DATASET_CREATE);
+	VERIFY(params);
+	if (extensible || (is_compressed(options) && count)) {
+		chunk[0] = count < LABEL_CHUNK_ROWS ? count : LABEL_CHUNK_ROWS;
+		if (!chunk[0])
+			chunk[0] = 1;
+		chunk[1] = shape[1];
+		VERIFY(H5Pset_chunk(params, 2, chunk));
+		set_storage_filters(params, options);
+	}
+	hid_t dataset = H5Dcreate(file, dataset_name, H5T_NATIVE_CHAR, dataspace, H5P_DEFAULT, params, H5P_DEFAULT);
 	VERIFY(dataset);
+	VERIFY(H5Pclose(params));
 
 	// Store initial offset
         hid_t aid  = H5Screate(H5S_SCALAR);
@@ -118,17 +198,15 @@ static void create_string_array_table(hid_t file, char * dataset_name, hsize_t c
 	VERIFY(H5Dclose(dataset));
 }
 
-static void store_string_array(hid_t file, char * dataset_name, hsize_t count, char ** strings) {
+static void store_string_array(hid_t dataset, hsize_t count, char ** strings) {
 	if (DEBUG) {
-		printf("Writing in %lli names into dataset %s of file %li:\n", count, dataset_name, file);
+		printf("Writing in %lli names into dataset %li:\n", count, dataset);
 		if (DEBUG > 1) {
 			int i;
 			for (i = 0; i < count; i++)
 				printf("%i:\t%s\n", i, strings[i]);
 		}
 	}
-	hid_t dataset = H5Dopen(file, dataset_name, H5P_DEFAULT);
-	VERIFY(dataset);
 	hsize_t max_length = max_string_length(strings, count);
 
 	hid_t dataspace = H5Dget_space(dataset);
@@ -177,12 +255,9 @@ static void store_string_array(hid_t file, char * dataset_name, hsize_t count, c
 	VERIFY(H5Aclose(attr));
 	VERIFY(H5Sclose(dataspace));
 	VERIFY(H5Sclose(memspace));
-	VERIFY(H5Dclose(dataset));
 }
 
-static StringArray * get_string_array(hid_t file, char * dataset_name) {
-	hid_t dataset = H5Dopen(file, dataset_name, H5P_DEFAULT);
-	VERIFY(dataset);
+static StringArray * get_string_array(hid_t dataset) {
 	hsize_t dim_sizes[2];
 	hid_t dataspace = H5Dget_space(dataset);
 	VERIFY(dataspace);
@@ -193,13 +268,10 @@ static StringArray * get_string_array(hid_t file, char * dataset_name) {
 	VERIFY(H5Dread(dataset, H5T_NATIVE_CHAR, H5S_ALL, H5S_ALL, H5P_DEFAULT, dim_names->array));
 	if (DEBUG)
 		printf("<<< HDF5 READ TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
-	VERIFY(H5Dclose(dataset));
 	return dim_names;
 }
 
-static StringArray * get_string_subarray(hid_t file, char * dataset_name, hsize_t offset, hsize_t count) {
-	hid_t dataset = H5Dopen(file, dataset_name, H5P_DEFAULT);
-	VERIFY(dataset);
+static StringArray * get_string_subarray(hid_t dataset, hsize_t offset, hsize_t count) {
 	hsize_t width[2];
 	hid_t dataspace = H5Dget_space(dataset);
 	VERIFY(dataspace);
@@ -210,7 +282,7 @@ static StringArray * get_string_subarray(hid_t file, char * dataset_name, hsize_
 	offset2[0] = offset;
 	offset2[1] = 0;
 	if (DEBUG)
-		printf("Querying names in %s: %lli-%lli\n", dataset_name, offset, offset + count);
+		printf("Querying names in dataset %li: %lli-%lli\n", dataset, offset, offset + count);
 	VERIFY(H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset2, NULL, width, NULL));
 	hid_t memspace = H5Screate_simple(2, width, NULL);
 	VERIFY(memspace);
@@ -244,7 +316,6 @@ static StringArray * get_string_subarray(hid_t file, char * dataset_name, hsize_
 	}
 	VERIFY(H5Sclose(dataspace));
 	VERIFY(H5Sclose(memspace));
-	VERIFY(H5Dclose(dataset));
 	return dim_names;
 }
 
@@ -253,15 +324,21 @@ static StringArray * get_string_subarray(hid_t file, char * dataset_name, hsize_
 ////////////////////////////////////////////////////////
 
 static void store_dim_names(hid_t file, hsize_t rank, char ** strings) {
-	create_string_array_table(file, "/dim_names", rank, max_string_length(strings, rank));
-	store_string_array(file, "/dim_names", rank, strings);
+	create_string_array_table(file, "/dim_names", rank, max_string_length(strings, rank), false, NULL);
+	hid_t dataset = H5Dopen(file, "/dim_names", H5P_DEFAULT);
+	VERIFY(dataset);
+	store_string_array(dataset, rank, strings);
+	VERIFY(H5Dclose(dataset));
 }
 
-StringArray * get_dim_names(hid_t file) {
+static StringArray * read_dim_names(hid_t file) {
 	if (DEBUG) {
 		printf(">>>>>>>>>>>>>>> READING DIM NAMES IN FILE %li\n", file);
 	}
-	StringArray * sa = get_string_array(file, "/dim_names");
+	hid_t dataset = H5Dopen(file, "/dim_names", H5P_DEFAULT);
+	VERIFY(dataset);
+	StringArray * sa = get_string_array(dataset);
+	VERIFY(H5Dclose(dataset));
 	if (DEBUG) {
 		printf("Reading %lli dim names\n", sa->count);
 		if (DEBUG > 1) {
@@ -273,242 +350,1356 @@ StringArray * get_dim_names(hid_t file) {
 	return sa;
 }
 
+// The returned array belongs to the file context, do not destroy it
+StringArray * get_dim_names(FileContext * file) {
+	return file->dim_names;
+}
+
 ////////////////////////////////////////////////////////
 // Dim labels
 ////////////////////////////////////////////////////////
 
-static void create_dim_labels_table(hid_t group, hsize_t dim, hsize_t dim_size, hsize_t dim_label_length) {
+static hid_t create_unlimited_vector(hid_t group, char * name, hid_t type, hsize_t size, hsize_t chunk, FileOptions * options) {
+	hsize_t max_size = H5S_UNLIMITED;
+	hid_t dataspace = H5Screate_simple(1, &size, &max_size);
+	VERIFY(dataspace);
+	hid_t params = H5Pcreate(H5P_DATASET_CREATE);
+	VERIFY(params);
+	VERIFY(H5Pset_chunk(params, 1, &chunk));
+	set_storage_filters(params, options);
+	hid_t dataset = H5Dcreate(group, name, type, dataspace, H5P_DEFAULT, params, H5P_DEFAULT);
+	VERIFY(dataset);
+	VERIFY(H5Pclose(params));
+	VERIFY(H5Sclose(dataspace));
+	return dataset;
+}
+
+// Variable length labels: /dim_labels/<dim> concatenates the null terminated
+// labels, /dim_labels/<dim>_offsets holds the start of each, then the end
+static void create_label_blob_table(hid_t group, hsize_t dim, FileOptions * options) {
+	char buf[32];
+	hsize_t zero = 0;
+	sprintf(buf, "%llu", dim);
+	hid_t dataset = create_unlimited_vector(group, buf, H5T_NATIVE_CHAR, 0, LABEL_BLOB_CHUNK_BYTES, options);
+	hid_t aid = H5Screate(H5S_SCALAR);
+	VERIFY(aid);
+	hid_t attr = H5Acreate(dataset, "count", H5T_NATIVE_HSIZE, aid, H5P_DEFAULT, H5P_DEFAULT);
+	VERIFY(attr);
+	VERIFY(H5Awrite(attr, H5T_NATIVE_HSIZE, &zero));
+	VERIFY(H5Aclose(attr));
+	VERIFY(H5Sclose(aid));
+	VERIFY(H5Dclose(dataset));
+
+	sprintf(buf, "%llu_offsets", dim);
+	dataset = create_unlimited_vector(group, buf, H5T_NATIVE_HSIZE, 1, LABEL_CHUNK_ROWS, options);
+	VERIFY(H5Dwrite(dataset, H5T_NATIVE_HSIZE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &zero));
+	VERIFY(H5Dclose(dataset));
+}
+
+static void create_dim_labels_table(hid_t group, hsize_t dim, hsize_t dim_size, hsize_t dim_label_length, FileOptions * options) {
 	char buf[5];
+	if (options && options->label_format == LABELS_BLOB) {
+		create_label_blob_table(group, dim, options);
+		return;
+	}
 	sprintf(buf, "%llu", dim);
-	create_string_array_table(group, buf, dim_size, dim_label_length);
+	create_string_array_table(group, buf, dim_size, dim_label_length, true, options);
 }
 
-static void create_all_dim_label_tables(hid_t file, hsize_t rank, hsize_t * dim_sizes, hsize_t * dim_label_lengths) {
+static void create_all_dim_label_tables(hid_t file, hsize_t rank, hsize_t * dim_sizes, hsize_t * dim_label_lengths, FileOptions * options) {
 	hsize_t dim;
 	hid_t group = H5Gcreate(file, "/dim_labels", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 	VERIFY(group);
 	for (dim = 0; dim < rank; dim++)
-		create_dim_labels_table(group, dim, dim_sizes[dim], dim_label_lengths[dim]);
+		create_dim_labels_table(group, dim, dim_sizes[dim], dim_label_lengths[dim], options);
 	VERIFY(H5Gclose(group));
 }
 
-static void store_dim_labels_in_table(hid_t file, hsize_t dim, hsize_t dim_size, char ** strings) {
-	char buf[5];
-	sprintf(buf, "%llu", dim);
-	hid_t group = H5Gopen(file, "/dim_labels", H5P_DEFAULT);
-	VERIFY(group);
-	store_string_array(group, buf, dim_size, strings);
-	VERIFY(H5Gclose(group));
+static hsize_t read_label_count(hid_t dataset) {
+	hsize_t count;
+	hid_t attr = H5Aopen(dataset, "count", H5P_DEFAULT);
+	VERIFY(attr);
+	VERIFY(H5Aread(attr, H5T_NATIVE_HSIZE, &count));
+	VERIFY(H5Aclose(attr));
+	return count;
 }
 
-static StringArray * get_dim_labels(hid_t group, hsize_t dim, hsize_t offset, hsize_t width) {
-	char buf[5];
-	sprintf(buf, "%llu", dim);
-	return get_string_subarray(group, buf, offset, width);
+static void write_label_count(hid_t dataset, hsize_t count) {
+	hid_t attr = H5Aopen(dataset, "count", H5P_DEFAULT);
+	VERIFY(attr);
+	VERIFY(H5Awrite(attr, H5T_NATIVE_HSIZE, &count));
+	VERIFY(H5Aclose(attr));
+}
+
+static hsize_t current_label_count(FileContext * file, hsize_t dim) {
+	if (file->label_buffers[dim])
+		return file->label_buffers[dim]->stored + file->label_buffers[dim]->pending->count;
+	return read_label_count(file->label_datasets[dim]);
+}
+
+static void read_vector(hid_t dataset, hid_t type, hsize_t offset, hsize_t count, void * data) {
+	hid_t dataspace = H5Dget_space(dataset);
+	VERIFY(dataspace);
+	hid_t memspace = H5Screate_simple(1, &count, NULL);
+	VERIFY(memspace);
+	VERIFY(H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, &offset, NULL, &count, NULL));
+	VERIFY(H5Dread(dataset, type, memspace, dataspace, H5P_DEFAULT, data));
+	VERIFY(H5Sclose(memspace));
+	VERIFY(H5Sclose(dataspace));
+}
+
+// Writes count elements at offset, growing the dataset as needed
+static void write_vector(hid_t dataset, hid_t type, hsize_t offset, hsize_t count, void * data) {
+	hsize_t size = offset + count;
+	VERIFY(H5Dset_extent(dataset, &size));
+	hid_t dataspace = H5Dget_space(dataset);
+	VERIFY(dataspace);
+	hid_t memspace = H5Screate_simple(1, &count, NULL);
+	VERIFY(memspace);
+	VERIFY(H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, &offset, NULL, &count, NULL));
+	VERIFY(H5Dwrite(dataset, type, memspace, dataspace, H5P_DEFAULT, data));
+	VERIFY(H5Sclose(memspace));
+	VERIFY(H5Sclose(dataspace));
+}
+
+// Labels [offset, offset + count) of a variable length table, those
+// beyond the stored labels read as empty strings
+static StringArray * read_label_blob(FileContext * file, hsize_t dim, hsize_t offset, hsize_t count) {
+	hsize_t stored = current_label_count(file, dim);
+	hsize_t available = offset >= stored ? 0 : offset + count > stored ? stored - offset : count;
+	hsize_t index;
+	StringArray * sarray = calloc(1, sizeof(StringArray));
+	sarray->count = count;
+	sarray->offsets = calloc(count + 1, sizeof(hsize_t));
+	if (available)
+		read_vector(file->label_offset_datasets[dim], H5T_NATIVE_HSIZE, offset, available + 1, sarray->offsets);
+
+	hsize_t start = sarray->offsets[0];
+	hsize_t bytes = sarray->offsets[available] - start;
+	sarray->array = calloc(bytes + 1, sizeof(char));
+	if (bytes)
+		read_vector(file->label_datasets[dim], H5T_NATIVE_CHAR, start, bytes, sarray->array);
+	for (index = 0; index <= count; index++) {
+		sarray->offsets[index] = index <= available ? sarray->offsets[index] - start : bytes;
+		if (index && index <= available && sarray->offsets[index] - sarray->offsets[index - 1] - 1 > sarray->length)
+			sarray->length = sarray->offsets[index] - sarray->offsets[index - 1] - 1;
+	}
+	return sarray;
+}
+
+static LabelBuffer * get_label_buffer(FileContext * file, hsize_t dim) {
+	if (!file->label_buffers[dim]) {
+		LabelBuffer * buffer = calloc(1, sizeof(LabelBuffer));
+		buffer->stored = read_label_count(file->label_datasets[dim]);
+		buffer->capacity = LABEL_BUFFER_ROWS;
+		if (file->dim_sizes[dim] && file->dim_sizes[dim] < buffer->capacity)
+			buffer->capacity = file->dim_sizes[dim];
+		if (file->label_offset_datasets[dim]) {
+			read_vector(file->label_offset_datasets[dim], H5T_NATIVE_HSIZE, buffer->stored, 1, &buffer->stored_bytes);
+			buffer->byte_capacity = LABEL_BLOB_CHUNK_BYTES;
+			buffer->pending = calloc(1, sizeof(StringArray));
+			buffer->pending->array = calloc(buffer->byte_capacity, sizeof(char));
+			buffer->pending->offsets = calloc(buffer->capacity + 1, sizeof(hsize_t));
+		} else {
+			buffer->pending = new_string_array(buffer->capacity, file->label_lengths[dim]);
+			buffer->pending->count = 0;
+		}
+		file->label_buffers[dim] = buffer;
+	}
+	return file->label_buffers[dim];
+}
+
+static void flush_label_blob(FileContext * file, hsize_t dim) {
+	LabelBuffer * buffer = file->label_buffers[dim];
+	StringArray * pending = buffer->pending;
+	hsize_t bytes = pending->offsets[pending->count];
+	hsize_t * ends = calloc(pending->count, sizeof(hsize_t));
+	hsize_t index;
+	if (DEBUG)
+		printf("Writing %lli labels of dim %lli, %lli bytes at offset %lli\n", pending->count, dim, bytes, buffer->stored_bytes);
+
+	write_vector(file->label_datasets[dim], H5T_NATIVE_CHAR, buffer->stored_bytes, bytes, pending->array);
+	for (index = 0; index < pending->count; index++)
+		ends[index] = buffer->stored_bytes + pending->offsets[index + 1];
+	write_vector(file->label_offset_datasets[dim], H5T_NATIVE_HSIZE, buffer->stored + 1, pending->count, ends);
+	buffer->stored_bytes += bytes;
+	free(ends);
+}
+
+// Writes the pending labels of a dimension in one block, and updates its count
+static void flush_label_buffer(FileContext * file, hsize_t dim) {
+	LabelBuffer * buffer = file->label_buffers[dim];
+	if (!buffer || !buffer->pending->count)
+		return;
+	hid_t dataset = file->label_datasets[dim];
+	if (file->label_offset_datasets[dim]) {
+		flush_label_blob(file, dim);
+		buffer->stored += buffer->pending->count;
+		write_label_count(dataset, buffer->stored);
+		buffer->pending->count = 0;
+		return;
+	}
+	hsize_t offset[2] = {buffer->stored, 0};
+	hsize_t width[2] = {buffer->pending->count, buffer->pending->length + 1};
+	if (DEBUG)
+		printf("Writing %lli labels of dim %lli at offset %lli\n", width[0], dim, offset[0]);
+
+	hid_t dataspace = H5Dget_space(dataset);
+	VERIFY(dataspace);
+	hid_t memspace = H5Screate_simple(2, width, NULL);
+	VERIFY(memspace);
+	VERIFY(H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset, NULL, width, NULL));
+	VERIFY(H5Dwrite(dataset, H5T_NATIVE_CHAR, memspace, dataspace, H5P_DEFAULT, buffer->pending->array));
+	VERIFY(H5Sclose(memspace));
+	VERIFY(H5Sclose(dataspace));
+
+	buffer->stored += buffer->pending->count;
+	write_label_count(dataset, buffer->stored);
+
+	buffer->pending->count = 0;
+	memset(buffer->pending->array, 0, buffer->capacity * (buffer->pending->length + 1));
+}
+
+static void flush_labels(FileContext * file) {
+	hsize_t dim;
+	for (dim = 0; dim < file->rank; dim++)
+		flush_label_buffer(file, dim);
+}
+
+static void destroy_label_buffer(LabelBuffer * buffer) {
+	destroy_string_array(buffer->pending);
+	free(buffer);
+}
+
+static void append_label_to_blob(FileContext * file, hsize_t dim, char * label, size_t length) {
+	LabelBuffer * buffer = file->label_buffers[dim];
+	StringArray * pending = buffer->pending;
+	if (pending->count == buffer->capacity || pending->offsets[pending->count] >= LABEL_BUFFER_BYTES)
+		flush_label_buffer(file, dim);
+	hsize_t start = pending->offsets[pending->count];
+	if (start + length + 1 > buffer->byte_capacity) {
+		while (start + length + 1 > buffer->byte_capacity)
+			buffer->byte_capacity *= 2;
+		pending->array = realloc(pending->array, buffer->byte_capacity);
+	}
+	memcpy(pending->array + start, label, length + 1);
+	pending->offsets[pending->count + 1] = start + length + 1;
+	pending->count++;
 }
 
-static StringArray ** get_table_dims_labels(hid_t file, ResultTable * table, hsize_t * offset, hsize_t * width) {
-	if (table->columns == 0)
+static void append_dim_labels(FileContext * file, hsize_t dim, hsize_t count, char ** labels) {
+	LabelBuffer * buffer = get_label_buffer(file, dim);
+	hsize_t index;
+	file->stale_label_indices[dim] = true;
+
+	if (buffer->stored + buffer->pending->count + count > file->dim_sizes[dim]) {
+		printf("Cannot store %lli more strings in a table allocated for %lli and containing already %lli\n", count, file->dim_sizes[dim], buffer->stored + buffer->pending->count);
+		abort();
+	}
+	for (index = 0; index < count; index++) {
+		size_t length = strlen(labels[index]);
+		if (file->label_offset_datasets[dim]) {
+			append_label_to_blob(file, dim, labels[index], length);
+			continue;
+		}
+		if (length > buffer->pending->length) {
+			printf("This table was not designed to store strings of length %zu, rather %lli\n", length, buffer->pending->length);
+			abort();
+		}
+		if (buffer->pending->count == buffer->capacity)
+			flush_label_buffer(file, dim);
+		memcpy(get_string_in_array(buffer->pending, buffer->pending->count++), labels[index], length);
+	}
+}
+
+static StringArray ** get_table_dims_labels(FileContext * file, ResultTable * table, hsize_t * offset, hsize_t * width) {
+	if (table->columns == 0 || table->rows == 0)
 		return NULL;
 	StringArray ** dim_labels = calloc(table->columns, sizeof(StringArray*));
 	hid_t dim;
 
-	hid_t group = H5Gopen(file, "/dim_labels", H5P_DEFAULT);
-	VERIFY(group);
-	for (dim = 0; dim < table->columns; dim++)
-		dim_labels[dim] = get_dim_labels(group, table->dims[dim], offset[table->dims[dim]], width[table->dims[dim]]);
-	VERIFY(H5Gclose(group));
+	for (dim = 0; dim < table->columns; dim++) {
+		hsize_t file_dim = table->dims[dim];
+		flush_label_buffer(file, file_dim);
+		if (file->label_offset_datasets[file_dim])
+			dim_labels[dim] = read_label_blob(file, file_dim, offset[file_dim], width[file_dim]);
+		else
+			dim_labels[dim] = get_string_subarray(file->label_datasets[file_dim], offset[file_dim], width[file_dim]);
+	}
 
 	return dim_labels;
 }
 
-StringArray * get_all_dim_labels(hid_t file, hsize_t dim) {
-	char buf[5];
-	sprintf(buf, "%llu", dim);
-	hid_t group = H5Gopen(file, "/dim_labels", H5P_DEFAULT);
-	VERIFY(group);
-	StringArray * res = get_string_array(group, buf);
-	VERIFY(H5Gclose(group));
-	return res;
+StringArray * get_all_dim_labels(FileContext * file, hsize_t dim) {
+	flush_label_buffer(file, dim);
+	if (file->label_offset_datasets[dim])
+		return read_label_blob(file, dim, 0, current_label_count(file, dim));
+	return get_string_array(file->label_datasets[dim]);
 }
 
 ////////////////////////////////////////////////////////
-// File info 
+// Label index
+// /label_index/<dim> holds the indices of the labels of
+// a dimension in label order. Lookups are binary searches
+// in memory, the permutation is rewritten on flush when
+// labels were added
 ////////////////////////////////////////////////////////
 
-hsize_t get_file_rank(hid_t file) {
-	hid_t dataset = H5Dopen(file, "/matrix", H5P_DEFAULT);
+// Compares labels up to their first tab, ties on position
+static int cmp_label_keys(const char * a, const char * b) {
+	for (; *a && *a != '\t' && *a == *b; a++, b++)
+		continue;
+	int A = *a == '\t' ? 0 : (unsigned char) *a;
+	int B = *b == '\t' ? 0 : (unsigned char) *b;
+	return A - B;
+}
+
+typedef struct label_ref_st {
+	char * label;
+	hsize_t index;
+} LabelRef;
+
+static int cmp_label_refs(const void * a, const void * b) {
+	LabelRef * A = (LabelRef *) a;
+	LabelRef * B = (LabelRef *) b;
+	int res = cmp_label_keys(A->label, B->label);
+	if (res)
+		return res;
+	return A->index < B->index ? -1 : A->index > B->index;
+}
+
+static void destroy_label_index(LabelIndex * index) {
+	destroy_string_array(index->labels);
+	free(index->order);
+	free(index);
+}
+
+static hid_t open_label_index_dataset(FileContext * file, hsize_t dim) {
+	char buf[32];
+	sprintf(buf, "/label_index/%llu", dim);
+	if (H5Lexists(file->file, "/label_index", H5P_DEFAULT) <= 0 || H5Lexists(file->file, buf, H5P_DEFAULT) <= 0)
+		return -1;
+	hid_t dataset = H5Dopen(file->file, buf, H5P_DEFAULT);
 	VERIFY(dataset);
+	return dataset;
+}
+
+// Reads the permutation on file, if it covers all the labels
+static hsize_t * read_label_order(FileContext * file, hsize_t dim, hsize_t count) {
+	hsize_t length;
+	hid_t dataset = open_label_index_dataset(file, dim);
+	if (dataset < 0)
+		return NULL;
 	hid_t dataspace = H5Dget_space(dataset);
 	VERIFY(dataspace);
-	hsize_t rank = H5Sget_simple_extent_ndims(dataspace);
-	VERIFY(rank);
+	VERIFY(H5Sget_simple_extent_dims(dataspace, &length, NULL));
 	VERIFY(H5Sclose(dataspace));
+	hsize_t * order = NULL;
+	if (length == count) {
+		order = calloc(count, sizeof(hsize_t));
+		VERIFY(H5Dread(dataset, H5T_NATIVE_HSIZE, H5S_ALL, H5S_ALL, H5P_DEFAULT, order));
+	}
 	VERIFY(H5Dclose(dataset));
-	return rank;
+	return order;
 }
 
-static void set_file_core_rank(hid_t file, hsize_t core_rank) {
-	hid_t dataset = H5Dopen(file, "/matrix", H5P_DEFAULT);
-	VERIFY(dataset);
-        hid_t aid2  = H5Screate(H5S_SCALAR);
-	VERIFY(aid2);
-        hid_t attr2 = H5Acreate(dataset, "Core dimensions", H5T_NATIVE_INT, aid2,
-                      H5P_DEFAULT, H5P_DEFAULT);
-	VERIFY(attr2);
+static hsize_t * sort_labels(StringArray * labels) {
+	LabelRef * refs = calloc(labels->count, sizeof(LabelRef));
+	hsize_t * order = calloc(labels->count, sizeof(hsize_t));
+	hsize_t index;
+	for (index = 0; index < labels->count; index++) {
+		refs[index].label = get_string_in_array(labels, index);
+		refs[index].index = index;
+	}
+	qsort(refs, labels->count, sizeof(LabelRef), &cmp_label_refs);
+	for (index = 0; index < labels->count; index++)
+		order[index] = refs[index].index;
+	free(refs);
+	return order;
+}
+
+static LabelIndex * get_label_index(FileContext * file, hsize_t dim) {
+	hsize_t count = current_label_count(file, dim);
+	LabelIndex * index = file->label_indices[dim];
+	if (index && index->labels->count == count)
+		return index;
+	if (index)
+		destroy_label_index(index);
+
+	index = calloc(1, sizeof(LabelIndex));
+	// Rows beyond the stored labels are left out
+	flush_label_buffer(file, dim);
+	if (file->label_offset_datasets[dim])
+		index->labels = read_label_blob(file, dim, 0, count);
+	else {
+		index->labels = get_string_array(file->label_datasets[dim]);
+		index->labels->count = count;
+	}
+	if (!file->stale_label_indices[dim])
+		index->order = read_label_order(file, dim, count);
+	if (!index->order) {
+		if (DEBUG)
+			printf("Sorting %lli labels of dim %lli\n", count, dim);
+		index->order = sort_labels(index->labels);
+		file->stale_label_indices[dim] = !file->readonly;
+	}
+	file->label_indices[dim] = index;
+	return index;
+}
+
+static void write_label_index(FileContext * file, hsize_t dim) {
+	LabelIndex * index = get_label_index(file, dim);
+	hsize_t count = index->labels->count;
 	if (DEBUG)
-		printf("Setting core rank %lli\n", core_rank);
-        H5Awrite(attr2, H5T_NATIVE_INT, &core_rank);
+		printf("Writing index of %lli labels of dim %lli\n", count, dim);
+
+	if (H5Lexists(file->file, "/label_index", H5P_DEFAULT) <= 0) {
+		hid_t group = H5Gcreate(file->file, "/label_index", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		VERIFY(group);
+		VERIFY(H5Gclose(group));
+	}
+	hid_t dataset = open_label_index_dataset(file, dim);
+	if (dataset < 0) {
+		char buf[32];
+		hsize_t max_count = H5S_UNLIMITED;
+		hsize_t chunk = count < LABEL_CHUNK_ROWS ? count : LABEL_CHUNK_ROWS;
+		sprintf(buf, "/label_index/%llu", dim);
+		hid_t dataspace = H5Screate_simple(1, &count, &max_count);
+		VERIFY(dataspace);
+		hid_t params = H5Pcreate(H5P_DATASET_CREATE);
+		VERIFY(params);
+		VERIFY(H5Pset_chunk(params, 1, &chunk));
+		dataset = H5Dcreate(file->file, buf, H5T_NATIVE_HSIZE, dataspace, H5P_DEFAULT, params, H5P_DEFAULT);
+		VERIFY(dataset);
+		VERIFY(H5Pclose(params));
+		VERIFY(H5Sclose(dataspace));
+	} else
+		VERIFY(H5Dset_extent(dataset, &count));
+	VERIFY(H5Dwrite(dataset, H5T_NATIVE_HSIZE, H5S_ALL, H5S_ALL, H5P_DEFAULT, index->order));
 	VERIFY(H5Dclose(dataset));
-        H5Aclose(attr2);
-        H5Sclose(aid2);
+	file->stale_label_indices[dim] = false;
 }
 
-hsize_t get_file_core_rank(hid_t file) {
-	hsize_t core_rank = 1;
-	hid_t attr = H5Aopen_by_name(file, "/matrix", "Core dimensions", H5P_DEFAULT, H5P_DEFAULT);
-	VERIFY(attr);
-	VERIFY(H5Aread(attr, H5T_NATIVE_INT, &core_rank));
-	VERIFY(H5Aclose(attr));
-	return core_rank;
+static void flush_label_indices(FileContext * file) {
+	hsize_t dim;
+	for (dim = 0; dim < file->rank; dim++)
+		if (file->stale_label_indices[dim] && current_label_count(file, dim))
+			write_label_index(file, dim);
 }
 
-////////////////////////////////////////////////////////
-// Matrix operations 
-////////////////////////////////////////////////////////
+bool lookup_label(FileContext * file, hsize_t dim, char * label, hsize_t * index) {
+	LabelIndex * label_index = get_label_index(file, dim);
+	hsize_t lo = 0, hi = label_index->labels->count;
+	// Lower bound, so that the first of duplicate labels is found
+	while (lo < hi) {
+		hsize_t mid = lo + (hi - lo) / 2;
+		if (cmp_label_keys(get_string_in_array(label_index->labels, label_index->order[mid]), label) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == label_index->labels->count || cmp_label_keys(get_string_in_array(label_index->labels, label_index->order[lo]), label))
+		return false;
+	*index = label_index->order[lo];
+	return true;
+}
 
-static hsize_t * automatic_chunks(hsize_t rank, hsize_t * dim_sizes) {
-	hsize_t * chunk_sizes = calloc(rank, sizeof(hsize_t));
-	hsize_t cache_size = 500000;
-	double log_ratio, l;
-	int dim, m;
+hsize_t lookup_labels(FileContext * file, hsize_t dim, hsize_t count, char ** labels, hsize_t * indices, bool * found) {
+	hsize_t index, hits = 0;
+	for (index = 0; index < count; index++) {
+		found[index] = lookup_label(file, dim, labels[index], indices + index);
+		if (found[index])
+			hits++;
+	}
+	return hits;
+}
 
-	if (DEBUG)
-		printf("Automatic setting of chunk sizes %lli\n", rank);
+////////////////////////////////////////////////////////
+// Dim metadata
+// /dim_meta/<dim> is a compound dataset of one DimMeta
+// row per label, appended as labels are. Its codes index
+// the string tables in /dim_meta/dictionaries
+////////////////////////////////////////////////////////
 
-	for (m = rank; m > 0; m--) {
-		if (DEBUG)
-			printf("Testing with %i chunked dimensions\n", m);
+static hid_t create_dim_meta_type() {
+	hid_t type = H5Tcreate(H5T_COMPOUND, sizeof(DimMeta));
+	VERIFY(type);
+	VERIFY(H5Tinsert(type, "chrom", HOFFSET(DimMeta, chrom), H5T_NATIVE_UINT));
+	VERIFY(H5Tinsert(type, "consequence", HOFFSET(DimMeta, consequence), H5T_NATIVE_UINT));
+	VERIFY(H5Tinsert(type, "start", HOFFSET(DimMeta, start), H5T_NATIVE_HSIZE));
+	VERIFY(H5Tinsert(type, "end", HOFFSET(DimMeta, end), H5T_NATIVE_HSIZE));
+	return type;
+}
 
-		log_ratio = log(cache_size);
-		for (dim = rank - m; dim < rank; dim++)
-			log_ratio -= log(dim_sizes[dim]) + log(sizeof(double));
+static void create_group_if_missing(hid_t file, char * name) {
+	if (H5Lexists(file, name, H5P_DEFAULT) > 0)
+		return;
+	hid_t group = H5Gcreate(file, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	VERIFY(group);
+	VERIFY(H5Gclose(group));
+}
 
-		if (DEBUG)
-			printf("Ratio of cache size / virtual space = %lf\n", exp(log_ratio));
+// Returns -1 if the dimension has no metadata
+static hid_t open_dim_meta_dataset(FileContext * file, hsize_t dim) {
+	char buf[32];
+	sprintf(buf, "/dim_meta/%llu", dim);
+	if (H5Lexists(file->file, "/dim_meta", H5P_DEFAULT) <= 0 || H5Lexists(file->file, buf, H5P_DEFAULT) <= 0)
+		return -1;
+	hid_t dataset = H5Dopen(file->file, buf, H5P_DEFAULT);
+	VERIFY(dataset);
+	return dataset;
+}
 
-		if (log_ratio == 0) {
-			if (DEBUG)
-				puts("Ratio rejected because null\n");
-			continue;
-		}
+// Compressed like the matrix
+static hid_t create_dim_meta_dataset(FileContext * file, hsize_t dim, hid_t type) {
+	char buf[32];
+	FileOptions options = {1, STORAGE_NONE, file->deflate_level, ENCODING_DOUBLE, 0, LABELS_FIXED};
+	if (file->deflate_level)
+		options.storage = file->shuffle ? STORAGE_SHUFFLE_DEFLATE : STORAGE_DEFLATE;
+	create_group_if_missing(file->file, "/dim_meta");
+	sprintf(buf, "/dim_meta/%llu", dim);
+	return create_unlimited_vector(file->file, buf, type, 0, LABEL_CHUNK_ROWS, &options);
+}
 
-		bool reject = false;
-		l = exp(log_ratio/m);
-		if (DEBUG)
-			printf("Chunking ratio = %lf\n", l);
-		hsize_t product = 1;
-		for (dim = rank - m; dim < rank; dim++) {
-			hsize_t chunk_size = (hsize_t) (l > 1 ? dim_sizes[dim]: l * dim_sizes[dim]);
-			product *= chunk_size;
+static hsize_t dataset_length(hid_t dataset) {
+	hsize_t length;
+	hid_t dataspace = H5Dget_space(dataset);
+	VERIFY(dataspace);
+	VERIFY(H5Sget_simple_extent_dims(dataspace, &length, NULL));
+	VERIFY(H5Sclose(dataspace));
+	return length;
+}
 
-			if (chunk_size <= 0 || product > cache_size) {
-				if (DEBUG) {
-					if (l * dim_sizes[dim] < 1) 
-						printf("Ratio rejected because dim %i too short\n", dim);
-					else
-						printf("Ratio rejected because too big for block\n");
-				}
-				reject = true;
-				break;
-			}
-		}
-		if (!reject)
-			break;
+static void append_dim_meta(FileContext * file, hsize_t dim, hsize_t count, DimMeta * meta) {
+	hid_t type = create_dim_meta_type();
+	hid_t dataset = open_dim_meta_dataset(file, dim);
+	if (dataset < 0)
+		dataset = create_dim_meta_dataset(file, dim, type);
+	hsize_t stored = dataset_length(dataset);
+	if (stored + count > file->dim_sizes[dim]) {
+		printf("Cannot store %lli more metadata rows for a dimension of size %lli with %lli already\n", count, file->dim_sizes[dim], stored);
+		abort();
 	}
-
 	if (DEBUG)
-		printf("The top %i dimensions will be chunked at ratio %lf\n", m, l);
-
-	for (dim = 0; dim < rank; dim++) {
-		if (rank - dim > m)
-			chunk_sizes[dim] = 1;
-		else
-			chunk_sizes[dim] = (hsize_t) (l > 1 ? dim_sizes[dim]: l * dim_sizes[dim]);
+		printf("Writing %lli metadata rows of dim %lli at offset %lli\n", count, dim, stored);
+	write_vector(dataset, type, stored, count, meta);
+	file->stale_position_indices[dim] = true;
+	VERIFY(H5Dclose(dataset));
+	VERIFY(H5Tclose(type));
+}
 
-		if (DEBUG)
-			printf("Dim %i, length %lli will be chunked every %lli cells\n", dim, dim_sizes[dim], chunk_sizes[dim]);
+DimMeta * get_dim_meta(FileContext * file, hsize_t dim, hsize_t offset, hsize_t count) {
+	hid_t dataset = open_dim_meta_dataset(file, dim);
+	if (dataset < 0)
+		return NULL;
+	DimMeta * meta = calloc(count, sizeof(DimMeta));
+	hsize_t stored = dataset_length(dataset);
+	if (offset < stored) {
+		hid_t type = create_dim_meta_type();
+		read_vector(dataset, type, offset, offset + count > stored ? stored - offset : count, meta);
+		VERIFY(H5Tclose(type));
 	}
+	VERIFY(H5Dclose(dataset));
+	return meta;
+}
 
-	return chunk_sizes;
+static DimMeta ** get_table_dims_meta(FileContext * file, hsize_t columns, hsize_t * dims, hsize_t * offset, hsize_t * width) {
+	if (columns == 0 || H5Lexists(file->file, "/dim_meta", H5P_DEFAULT) <= 0)
+		return NULL;
+	DimMeta ** dim_meta = calloc(columns, sizeof(DimMeta *));
+	hsize_t column;
+	for (column = 0; column < columns; column++)
+		dim_meta[column] = get_dim_meta(file, dims[column], offset[dims[column]], width[dims[column]]);
+	return dim_meta;
 }
 
-static void create_matrix(hid_t file, hsize_t rank, hsize_t * dim_sizes, hsize_t * chunk_sizes) {
+void store_meta_dictionary(FileContext * file, char * name, hsize_t count, char ** strings) {
+	char buf[256];
+	if (file->readonly) {
+		printf("Cannot store dictionary %s into a read-only file\n", name);
+		abort();
+	}
+	create_group_if_missing(file->file, "/dim_meta");
+	create_group_if_missing(file->file, "/dim_meta/dictionaries");
+	snprintf(buf, sizeof(buf), "/dim_meta/dictionaries/%s", name);
+	// Dictionaries are small, they are replaced whole
+	if (H5Lexists(file->file, buf, H5P_DEFAULT) > 0)
+		VERIFY(H5Ldelete(file->file, buf, H5P_DEFAULT));
+	create_string_array_table(file->file, buf, count, max_string_length(strings, count), false, NULL);
+	if (count) {
+		hid_t dataset = H5Dopen(file->file, buf, H5P_DEFAULT);
+		VERIFY(dataset);
+		store_string_array(dataset, count, strings);
+		VERIFY(H5Dclose(dataset));
+	}
+}
+
+StringArray * get_meta_dictionary(FileContext * file, char * name) {
+	char buf[256];
+	snprintf(buf, sizeof(buf), "/dim_meta/dictionaries/%s", name);
+	if (H5Lexists(file->file, "/dim_meta", H5P_DEFAULT) <= 0 || H5Lexists(file->file, "/dim_meta/dictionaries", H5P_DEFAULT) <= 0 || H5Lexists(file->file, buf, H5P_DEFAULT) <= 0)
+		return NULL;
+	hid_t dataset = H5Dopen(file->file, buf, H5P_DEFAULT);
+	VERIFY(dataset);
+	StringArray * dictionary = get_string_array(dataset);
+	VERIFY(H5Dclose(dataset));
+	return dictionary;
+}
+
+////////////////////////////////////////////////////////
+// Position index
+// /position_index/<dim> sorts the metadata rows of a
+// dimension by chromosome then start, so that the rows
+// overlapping a genomic interval are found by binary
+// search. Rewritten on flush when metadata was added
+////////////////////////////////////////////////////////
+
+typedef struct position_ref_st {
+	unsigned int chrom;
+	hsize_t start, end, index;
+} PositionRef;
+
+static int cmp_position_refs(const void * a, const void * b) {
+	PositionRef * A = (PositionRef *) a;
+	PositionRef * B = (PositionRef *) b;
+	if (A->chrom != B->chrom)
+		return A->chrom < B->chrom ? -1 : 1;
+	if (A->start != B->start)
+		return A->start < B->start ? -1 : 1;
+	return A->index < B->index ? -1 : A->index > B->index;
+}
+
+static void destroy_position_index(PositionIndex * index) {
+	free(index->chrom_offsets);
+	free(index->starts);
+	free(index->ends);
+	free(index->order);
+	free(index);
+}
+
+static void set_max_span(PositionIndex * index) {
+	hsize_t row;
+	index->max_span = 0;
+	for (row = 0; row < index->count; row++)
+		if (index->ends[row] > index->starts[row] && index->ends[row] - index->starts[row] > index->max_span)
+			index->max_span = index->ends[row] - index->starts[row];
+}
+
+static PositionIndex * build_position_index(FileContext * file, hsize_t dim, hsize_t count) {
+	DimMeta * meta = get_dim_meta(file, dim, 0, count);
+	PositionRef * refs = calloc(count, sizeof(PositionRef));
+	PositionIndex * index = calloc(1, sizeof(PositionIndex));
+	hsize_t row;
+	if (DEBUG)
+		printf("Sorting %lli positions of dim %lli\n", count, dim);
+
+	for (row = 0; row < count; row++) {
+		refs[row].chrom = meta[row].chrom;
+		refs[row].start = meta[row].start;
+		refs[row].end = meta[row].end;
+		refs[row].index = row;
+		if (meta[row].chrom + 1 > index->chrom_count)
+			index->chrom_count = meta[row].chrom + 1;
+	}
+	qsort(refs, count, sizeof(PositionRef), &cmp_position_refs);
+
+	index->count = count;
+	index->chrom_offsets = calloc(index->chrom_count + 1, sizeof(hsize_t));
+	index->starts = calloc(count, sizeof(hsize_t));
+	index->ends = calloc(count, sizeof(hsize_t));
+	index->order = calloc(count, sizeof(hsize_t));
+	for (row = 0; row < count; row++) {
+		index->starts[row] = refs[row].start;
+		index->ends[row] = refs[row].end;
+		index->order[row] = refs[row].index;
+		index->chrom_offsets[refs[row].chrom + 1]++;
+	}
+	for (row = 0; row < index->chrom_count; row++)
+		index->chrom_offsets[row + 1] += index->chrom_offsets[row];
+	set_max_span(index);
+
+	free(refs);
+	free(meta);
+	return index;
+}
+
+static char * position_index_path(char * buf, hsize_t dim, char * name) {
+	sprintf(buf, "/position_index/%llu/%s", dim, name);
+	return buf;
+}
+
+// Reads the index on file, if it covers all the metadata rows
+static PositionIndex * read_position_index(FileContext * file, hsize_t dim, hsize_t count) {
+	char buf[64];
+	sprintf(buf, "/position_index/%llu", dim);
+	if (H5Lexists(file->file, "/position_index", H5P_DEFAULT) <= 0 || H5Lexists(file->file, buf, H5P_DEFAULT) <= 0)
+		return NULL;
+	hid_t order = H5Dopen(file->file, position_index_path(buf, dim, "order"), H5P_DEFAULT);
+	VERIFY(order);
+	if (dataset_length(order) != count) {
+		VERIFY(H5Dclose(order));
+		return NULL;
+	}
+
+	PositionIndex * index = calloc(1, sizeof(PositionIndex));
+	index->count = count;
+	index->order = calloc(count, sizeof(hsize_t));
+	index->starts = calloc(count, sizeof(hsize_t));
+	index->ends = calloc(count, sizeof(hsize_t));
+	if (count)
+		read_vector(order, H5T_NATIVE_HSIZE, 0, count, index->order);
+	VERIFY(H5Dclose(order));
+
+	hid_t dataset = H5Dopen(file->file, position_index_path(buf, dim, "chrom_offsets"), H5P_DEFAULT);
+	VERIFY(dataset);
+	index->chrom_count = dataset_length(dataset) - 1;
+	index->chrom_offsets = calloc(index->chrom_count + 1, sizeof(hsize_t));
+	read_vector(dataset, H5T_NATIVE_HSIZE, 0, index->chrom_count + 1, index->chrom_offsets);
+	VERIFY(H5Dclose(dataset));
+
+	dataset = H5Dopen(file->file, position_index_path(buf, dim, "starts"), H5P_DEFAULT);
+	VERIFY(dataset);
+	if (count)
+		read_vector(dataset, H5T_NATIVE_HSIZE, 0, count, index->starts);
+	VERIFY(H5Dclose(dataset));
+	dataset = H5Dopen(file->file, position_index_path(buf, dim, "ends"), H5P_DEFAULT);
+	VERIFY(dataset);
+	if (count)
+		read_vector(dataset, H5T_NATIVE_HSIZE, 0, count, index->ends);
+	VERIFY(H5Dclose(dataset));
+	set_max_span(index);
+	return index;
+}
+
+// NULL if the dimension has no metadata
+static PositionIndex * get_position_index(FileContext * file, hsize_t dim) {
+	hid_t dataset = open_dim_meta_dataset(file, dim);
+	if (dataset < 0)
+		return NULL;
+	hsize_t count = dataset_length(dataset);
+	VERIFY(H5Dclose(dataset));
+
+	PositionIndex * index = file->position_indices[dim];
+	if (index && index->count == count)
+		return index;
+	if (index)
+		destroy_position_index(index);
+
+	index = NULL;
+	if (!file->stale_position_indices[dim])
+		index = read_position_index(file, dim, count);
+	if (!index) {
+		index = build_position_index(file, dim, count);
+		file->stale_position_indices[dim] = !file->readonly;
+	}
+	file->position_indices[dim] = index;
+	return index;
+}
+
+static void write_position_vector(hid_t group, char * name, hsize_t count, hsize_t * data) {
+	hid_t dataset;
+	if (H5Lexists(group, name, H5P_DEFAULT) > 0) {
+		dataset = H5Dopen(group, name, H5P_DEFAULT);
+		VERIFY(dataset);
+	} else
+		dataset = create_unlimited_vector(group, name, H5T_NATIVE_HSIZE, 0, LABEL_CHUNK_ROWS, NULL);
+	if (count)
+		write_vector(dataset, H5T_NATIVE_HSIZE, 0, count, data);
+	VERIFY(H5Dclose(dataset));
+}
+
+static void write_position_index(FileContext * file, hsize_t dim) {
+	char buf[64];
+	PositionIndex * index = get_position_index(file, dim);
+	if (DEBUG)
+		printf("Writing position index of %lli rows of dim %lli\n", index->count, dim);
+
+	create_group_if_missing(file->file, "/position_index");
+	sprintf(buf, "/position_index/%llu", dim);
+	create_group_if_missing(file->file, buf);
+	hid_t group = H5Gopen(file->file, buf, H5P_DEFAULT);
+	VERIFY(group);
+	write_position_vector(group, "chrom_offsets", index->chrom_count + 1, index->chrom_offsets);
+	write_position_vector(group, "starts", index->count, index->starts);
+	write_position_vector(group, "ends", index->count, index->ends);
+	write_position_vector(group, "order", index->count, index->order);
+	VERIFY(H5Gclose(group));
+	file->stale_position_indices[dim] = false;
+}
+
+static void flush_position_indices(FileContext * file) {
+	hsize_t dim;
+	for (dim = 0; dim < file->rank; dim++)
+		if (file->stale_position_indices[dim])
+			write_position_index(file, dim);
+}
+
+static int cmp_hsize(const void * a, const void * b) {
+	hsize_t A = *(hsize_t *) a;
+	hsize_t B = *(hsize_t *) b;
+	return A < B ? -1 : A > B;
+}
+
+// First row of [lo, hi) whose start is above value
+static hsize_t upper_bound_start(PositionIndex * index, hsize_t lo, hsize_t hi, hsize_t value) {
+	while (lo < hi) {
+		hsize_t mid = lo + (hi - lo) / 2;
+		if (index->starts[mid] <= value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+hsize_t find_region(FileContext * file, hsize_t dim, char * chrom, hsize_t start, hsize_t end, DimConstraint * constraint) {
+	PositionIndex * index = get_position_index(file, dim);
+	StringArray * chroms = get_meta_dictionary(file, "chrom");
+	hsize_t code, row, hits = 0;
+	memset(constraint, 0, sizeof(DimConstraint));
+	if (!index || !chroms) {
+		printf("Dimension %lli has no location metadata\n", dim);
+		abort();
+	}
+	for (code = 0; code < chroms->count; code++)
+		if (!strcmp(get_string_in_array(chroms, code), chrom))
+			break;
+	if (code >= index->chrom_count || end < start) {
+		destroy_string_array(chroms);
+		return 0;
+	}
+
+	// Rows overlapping [start, end] start at most max_span before it
+	hsize_t first = index->chrom_offsets[code];
+	hsize_t last = upper_bound_start(index, first, index->chrom_offsets[code + 1], end);
+	if (start > index->max_span)
+		first = upper_bound_start(index, first, last, start - index->max_span - 1);
+	hsize_t * rows = calloc(last - first, sizeof(hsize_t));
+	for (row = first; row < last; row++)
+		if (index->ends[row] >= start)
+			rows[hits++] = index->order[row];
+
+	// Rows sorted by position are usually contiguous, and make one interval
+	qsort(rows, hits, sizeof(hsize_t), &cmp_hsize);
+	constraint->lo = calloc(hits, sizeof(hsize_t));
+	constraint->hi = calloc(hits, sizeof(hsize_t));
+	for (row = 0; row < hits; row++) {
+		if (constraint->count && constraint->hi[constraint->count - 1] == rows[row])
+			constraint->hi[constraint->count - 1]++;
+		else {
+			constraint->lo[constraint->count] = rows[row];
+			constraint->hi[constraint->count++] = rows[row] + 1;
+		}
+	}
+
+	free(rows);
+	destroy_string_array(chroms);
+	return hits;
+}
+
+////////////////////////////////////////////////////////
+// File info 
+////////////////////////////////////////////////////////
+
+hsize_t get_file_rank(FileContext * file) {
+	return file->rank;
+}
+
+static void set_file_core_rank(hid_t file, hsize_t core_rank) {
+	hid_t dataset = H5Dopen(file, "/matrix", H5P_DEFAULT);
+	VERIFY(dataset);
+        hid_t aid2  = H5Screate(H5S_SCALAR);
+	VERIFY(aid2);
+        hid_t attr2 = H5Acreate(dataset, "Core dimensions", H5T_NATIVE_INT, aid2,
+                      H5P_DEFAULT, H5P_DEFAULT);
+	VERIFY(attr2);
+	if (DEBUG)
+		printf("Setting core rank %lli\n", core_rank);
+        H5Awrite(attr2, H5T_NATIVE_INT, &core_rank);
+	VERIFY(H5Dclose(dataset));
+        H5Aclose(attr2);
+        H5Sclose(aid2);
+}
+
+static hsize_t read_file_core_rank(hid_t matrix) {
+	hsize_t core_rank = 0;
+	hid_t attr = H5Aopen(matrix, "Core dimensions", H5P_DEFAULT);
+	VERIFY(attr);
+	VERIFY(H5Aread(attr, H5T_NATIVE_INT, &core_rank));
+	VERIFY(H5Aclose(attr));
+	return core_rank;
+}
+
+hsize_t get_file_core_rank(FileContext * file) {
+	return file->core_rank;
+}
+
+////////////////////////////////////////////////////////
+// Boundary cache
+// Writable files keep the boundary rows touched by stores
+// in memory, dirty blocks are written back as hyperslabs
+// when the file is flushed or closed
+////////////////////////////////////////////////////////
+
+#define BOUNDARY_BLOCK_ROWS 4096
+
+static BoundaryCache * new_boundary_cache(FileContext * file, hsize_t dim) {
+	BoundaryCache * cache = calloc(1, sizeof(BoundaryCache));
+	cache->rows = file->dim_sizes[dim];
+	cache->row_width = (file->core_rank - 1) * 2;
+	cache->block_count = (cache->rows + BOUNDARY_BLOCK_ROWS - 1) / BOUNDARY_BLOCK_ROWS;
+	cache->blocks = calloc(cache->block_count, sizeof(hsize_t *));
+	cache->dirty = calloc(cache->block_count, sizeof(bool));
+	return cache;
+}
+
+static void destroy_boundary_cache(BoundaryCache * cache) {
+	hsize_t block;
+	for (block = 0; block < cache->block_count; block++)
+		if (cache->blocks[block])
+			free(cache->blocks[block]);
+	free(cache->blocks);
+	free(cache->dirty);
+	free(cache);
+}
+
+static void transfer_boundary_block(FileContext * file, hsize_t dim, hsize_t block, bool write) {
+	BoundaryCache * cache = file->boundary_caches[dim];
+	hid_t dataset = file->boundary_datasets[dim];
+	hsize_t offset[3] = {block * BOUNDARY_BLOCK_ROWS, 0, 0};
+	hsize_t width[3] = {BOUNDARY_BLOCK_ROWS, file->core_rank - 1, 2};
+	if (offset[0] + width[0] > cache->rows)
+		width[0] = cache->rows - offset[0];
+
+	hid_t dataspace = H5Dget_space(dataset);
+	VERIFY(dataspace);
+	VERIFY(H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset, NULL, width, NULL));
+	hid_t memspace = H5Screate_simple(3, width, NULL);
+	VERIFY(memspace);
+	clock_t start = clock();
+	if (write)
+		VERIFY(H5Dwrite(dataset, H5T_NATIVE_HSIZE, memspace, dataspace, H5P_DEFAULT, cache->blocks[block]));
+	else
+		VERIFY(H5Dread(dataset, H5T_NATIVE_HSIZE, memspace, dataspace, H5P_DEFAULT, cache->blocks[block]));
+	if (DEBUG)
+		printf("<<< HDF5 %s TIME\t%lf (boundaries of dim %lli, rows %lli-%lli)\n", write ? "WRITE" : "READ", ((double) (clock() - start)) / CLOCKS_PER_SEC, dim, offset[0], offset[0] + width[0]);
+	VERIFY(H5Sclose(memspace));
+	VERIFY(H5Sclose(dataspace));
+}
+
+// Returns the cached boundaries of a value, loading its block if needed
+static hsize_t * boundary_row(FileContext * file, hsize_t dim, hsize_t row) {
+	if (!file->boundary_caches[dim])
+		file->boundary_caches[dim] = new_boundary_cache(file, dim);
+	BoundaryCache * cache = file->boundary_caches[dim];
+	hsize_t block = row / BOUNDARY_BLOCK_ROWS;
+	if (!cache->blocks[block]) {
+		cache->blocks[block] = calloc(BOUNDARY_BLOCK_ROWS * cache->row_width, sizeof(hsize_t));
+		transfer_boundary_block(file, dim, block, false);
+	}
+	return cache->blocks[block] + (row % BOUNDARY_BLOCK_ROWS) * cache->row_width;
+}
+
+// Returns the cached boundaries of a value if its block was loaded
+static hsize_t * cached_boundary_row(FileContext * file, hsize_t dim, hsize_t row) {
+	BoundaryCache * cache = file->boundary_caches[dim];
+	if (!cache || !cache->blocks[row / BOUNDARY_BLOCK_ROWS])
+		return NULL;
+	return cache->blocks[row / BOUNDARY_BLOCK_ROWS] + (row % BOUNDARY_BLOCK_ROWS) * cache->row_width;
+}
+
+static void flush_boundaries(FileContext * file) {
+	hsize_t dim, block, written = 0;
+	for (dim = file->rank - file->core_rank; dim < file->rank; dim++) {
+		BoundaryCache * cache = file->boundary_caches[dim];
+		if (!cache)
+			continue;
+		for (block = 0; block < cache->block_count; block++) {
+			if (cache->dirty[block]) {
+				transfer_boundary_block(file, dim, block, true);
+				cache->dirty[block] = false;
+				written++;
+			}
+		}
+	}
+	if (DEBUG && written)
+		printf("Flushed %lli boundary blocks\n", written);
+}
+
+////////////////////////////////////////////////////////
+// Value encodings
+// The matrix may hold floats or 16 bit codes instead of
+// doubles. Buffers are sized for doubles, encoded values
+// are packed at their start and converted in place
+////////////////////////////////////////////////////////
+
+#define NEG_LOG10_SCALE 100
+#define U16_CODES 65536
+
+static hid_t encoding_type(int encoding) {
+	switch (encoding) {
+	case ENCODING_FLOAT:
+		return H5T_NATIVE_FLOAT;
+	case ENCODING_NEG_LOG10_U16:
+		return H5T_NATIVE_UINT16;
+	default:
+		return H5T_NATIVE_DOUBLE;
+	}
+}
+
+static void write_encoding(hid_t matrix, int encoding) {
+	double scale = NEG_LOG10_SCALE;
+	hid_t aid = H5Screate(H5S_SCALAR);
+	VERIFY(aid);
+	hid_t attr = H5Acreate(matrix, "encoding", H5T_NATIVE_INT, aid, H5P_DEFAULT, H5P_DEFAULT);
+	VERIFY(attr);
+	VERIFY(H5Awrite(attr, H5T_NATIVE_INT, &encoding));
+	VERIFY(H5Aclose(attr));
+	attr = H5Acreate(matrix, "scale", H5T_NATIVE_DOUBLE, aid, H5P_DEFAULT, H5P_DEFAULT);
+	VERIFY(attr);
+	VERIFY(H5Awrite(attr, H5T_NATIVE_DOUBLE, &scale));
+	VERIFY(H5Aclose(attr));
+	VERIFY(H5Sclose(aid));
+}
+
+// Files which predate encodings hold doubles
+static void read_encoding(FileContext * file) {
+	file->encoding = ENCODING_DOUBLE;
+	file->scale = NEG_LOG10_SCALE;
+	if (H5Aexists(file->matrix, "encoding") > 0) {
+		hid_t attr = H5Aopen(file->matrix, "encoding", H5P_DEFAULT);
+		VERIFY(attr);
+		VERIFY(H5Aread(attr, H5T_NATIVE_INT, &file->encoding));
+		VERIFY(H5Aclose(attr));
+		attr = H5Aopen(file->matrix, "scale", H5P_DEFAULT);
+		VERIFY(attr);
+		VERIFY(H5Aread(attr, H5T_NATIVE_DOUBLE, &file->scale));
+		VERIFY(H5Aclose(attr));
+	}
+	file->value_type = encoding_type(file->encoding);
+	file->value_size = H5Tget_size(file->value_type);
+
+	if (file->encoding == ENCODING_NEG_LOG10_U16) {
+		hsize_t code;
+		file->decode_table = calloc(U16_CODES, sizeof(double));
+		for (code = 1; code < U16_CODES; code++)
+			file->decode_table[code] = pow(10, -(code / file->scale));
+	}
+}
+
+// Expands the count encoded values at the start of the buffer into doubles,
+// last one first so that no value is overwritten before it is read
+static void decode_values(FileContext * file, void * buffer, hsize_t count) {
+	unsigned char * bytes = buffer;
+	hsize_t index;
+	double value;
+	float encoded;
+	uint16_t code;
+
+	if (file->encoding == ENCODING_DOUBLE)
+		return;
+	for (index = count; index-- > 0;) {
+		if (file->encoding == ENCODING_FLOAT) {
+			memcpy(&encoded, bytes + index * sizeof(float), sizeof(float));
+			value = encoded;
+		} else {
+			memcpy(&code, bytes + index * sizeof(uint16_t), sizeof(uint16_t));
+			value = file->decode_table[code];
+		}
+		memcpy(bytes + index * sizeof(double), &value, sizeof(double));
+	}
+}
+
+// Packs count doubles into the file encoding, first one first. 
+// Non-zero values never round to 0, which would read as an empty cell
+static void encode_values(FileContext * file, void * buffer, hsize_t count) {
+	unsigned char * bytes = buffer;
+	hsize_t index;
+	double value;
+	float encoded;
+	uint16_t code;
+
+	if (file->encoding == ENCODING_DOUBLE)
+		return;
+	for (index = 0; index < count; index++) {
+		memcpy(&value, bytes + index * sizeof(double), sizeof(double));
+		if (file->encoding == ENCODING_FLOAT) {
+			if (value != 0 && fabs(value) < FLT_MIN)
+				value = copysign(FLT_MIN, value);
+			encoded = value;
+			memcpy(bytes + index * sizeof(float), &encoded, sizeof(float));
+		} else {
+			if (value == 0)
+				code = 0;
+			else if (value > 0 && value <= 1) {
+				double scaled = round(-log10(value) * file->scale);
+				code = scaled < 1 ? 1 : scaled > U16_CODES - 1 ? U16_CODES - 1 : scaled;
+			} else {
+				fprintf(stderr, "Value %lf is not a p-value, it cannot be stored as -log10(p)\n", value);
+				exit(-1);
+			}
+			memcpy(bytes + index * sizeof(uint16_t), &code, sizeof(uint16_t));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////
+// File context
+// All the handles and metadata which every query needs
+// are read once when the file is opened, and kept until
+// it is closed
+////////////////////////////////////////////////////////
+
+// Returns the deflate level if the matrix filters are [shuffle,] deflate, 0 otherwise
+static int read_deflate_level(hid_t matrix, bool * shuffle) {
+	int level = 0;
+	unsigned flags, config;
+	unsigned cd_values[1];
+	size_t cd_nelmts = 1;
+	char name[32];
+	hid_t cparms = H5Dget_create_plist(matrix);
+	VERIFY(cparms);
+	int filters = H5Pget_nfilters(cparms);
+	*shuffle = filters == 2 && H5Pget_filter2(cparms, 0, &flags, &cd_nelmts, cd_values, sizeof(name), name, &config) == H5Z_FILTER_SHUFFLE;
+	cd_nelmts = 1;
+	if ((filters == 1 || *shuffle) && H5Pget_filter2(cparms, filters - 1, &flags, &cd_nelmts, cd_values, sizeof(name), name, &config) == H5Z_FILTER_DEFLATE)
+		level = cd_values[0];
+	else
+		*shuffle = false;
+	VERIFY(H5Pclose(cparms));
+	return level;
+}
+
+static FileContext * new_file_context(hid_t file, bool readonly, FileOptions * options) {
+	FileContext * context = calloc(1, sizeof(FileContext));
+	hsize_t dim;
+	char buf[32];
+
+	context->file = file;
+	context->readonly = readonly;
+
+	context->matrix = H5Dopen(file, "/matrix", H5P_DEFAULT);
+	VERIFY(context->matrix);
+	context->matrix_space = H5Dget_space(context->matrix);
+	VERIFY(context->matrix_space);
+	int rank = H5Sget_simple_extent_ndims(context->matrix_space);
+	VERIFY(rank);
+	context->rank = rank;
+	context->core_rank = read_file_core_rank(context->matrix);
+	context->dim_sizes = calloc(context->rank, sizeof(hsize_t));
+	VERIFY(H5Sget_simple_extent_dims(context->matrix_space, context->dim_sizes, NULL));
+	context->chunk_sizes = calloc(context->rank, sizeof(hsize_t));
+	hid_t cparms = H5Dget_create_plist(context->matrix);
+	VERIFY(cparms);
+	VERIFY(H5Pget_chunk(cparms, context->rank, context->chunk_sizes));
+	VERIFY(H5Pclose(cparms));
+	context->deflate_level = read_deflate_level(context->matrix, &context->shuffle);
+	read_encoding(context);
+	context->threads = 1;
+	if (options && options->threads > 1)
+		context->threads = options->threads;
+	if (!readonly && options && options->staging_bytes)
+		context->staging_capacity = 1 + options->staging_bytes / ((context->rank + 1) * sizeof(hsize_t));
+	context->dim_names = read_dim_names(file);
+
+	context->labels_group = H5Gopen(file, "/dim_labels", H5P_DEFAULT);
+	VERIFY(context->labels_group);
+	context->label_datasets = calloc(context->rank, sizeof(hid_t));
+	context->label_offset_datasets = calloc(context->rank, sizeof(hid_t));
+	context->label_buffers = calloc(context->rank, sizeof(LabelBuffer *));
+	context->label_indices = calloc(context->rank, sizeof(LabelIndex *));
+	context->stale_label_indices = calloc(context->rank, sizeof(bool));
+	context->position_indices = calloc(context->rank, sizeof(PositionIndex *));
+	context->stale_position_indices = calloc(context->rank, sizeof(bool));
+	context->label_lengths = calloc(context->rank, sizeof(hsize_t));
+	for (dim = 0; dim < context->rank; dim++) {
+		hsize_t shape[2];
+		sprintf(buf, "%llu", dim);
+		context->label_datasets[dim] = H5Dopen(context->labels_group, buf, H5P_DEFAULT);
+		VERIFY(context->label_datasets[dim]);
+		hid_t dataspace = H5Dget_space(context->label_datasets[dim]);
+		VERIFY(dataspace);
+		int label_rank = H5Sget_simple_extent_ndims(dataspace);
+		VERIFY(H5Sget_simple_extent_dims(dataspace, shape, NULL));
+		VERIFY(H5Sclose(dataspace));
+		if (label_rank == 1) {
+			sprintf(buf, "%llu_offsets", dim);
+			context->label_offset_datasets[dim] = H5Dopen(context->labels_group, buf, H5P_DEFAULT);
+			VERIFY(context->label_offset_datasets[dim]);
+		} else
+			context->label_lengths[dim] = shape[1] - 1;
+	}
+
+	context->boundaries_group = H5Gopen(file, "/boundaries", H5P_DEFAULT);
+	VERIFY(context->boundaries_group);
+	context->boundary_datasets = calloc(context->rank, sizeof(hid_t));
+	context->boundary_caches = calloc(context->rank, sizeof(BoundaryCache *));
+	for (dim = context->rank - context->core_rank; dim < context->rank; dim++) {
+		sprintf(buf, "%llu", dim);
+		context->boundary_datasets[dim] = H5Dopen(context->boundaries_group, buf, H5P_DEFAULT);
+		VERIFY(context->boundary_datasets[dim]);
+	}
+
+	if (DEBUG)
+		printf("Opened file %li of rank %lli, %lli core, %i thread(s)\n", file, context->rank, context->core_rank, context->threads);
+	return context;
+}
+
+static void destroy_file_context(FileContext * context) {
+	hsize_t dim;
+	for (dim = 0; dim < context->rank; dim++) {
+		VERIFY(H5Dclose(context->label_datasets[dim]));
+		if (context->label_offset_datasets[dim])
+			VERIFY(H5Dclose(context->label_offset_datasets[dim]));
+		if (context->label_buffers[dim])
+			destroy_label_buffer(context->label_buffers[dim]);
+		if (context->label_indices[dim])
+			destroy_label_index(context->label_indices[dim]);
+		if (context->position_indices[dim])
+			destroy_position_index(context->position_indices[dim]);
+	}
+	for (dim = context->rank - context->core_rank; dim < context->rank; dim++) {
+		VERIFY(H5Dclose(context->boundary_datasets[dim]));
+		if (context->boundary_caches[dim])
+			destroy_boundary_cache(context->boundary_caches[dim]);
+	}
+	VERIFY(H5Gclose(context->labels_group));
+	VERIFY(H5Gclose(context->boundaries_group));
+	VERIFY(H5Sclose(context->matrix_space));
+	VERIFY(H5Dclose(context->matrix));
+	destroy_string_array(context->dim_names);
+	free(context->label_datasets);
+	free(context->label_offset_datasets);
+	free(context->label_buffers);
+	free(context->label_indices);
+	free(context->stale_label_indices);
+	free(context->position_indices);
+	free(context->stale_position_indices);
+	free(context->boundary_datasets);
+	free(context->boundary_caches);
+	free(context->label_lengths);
+	free(context->chunk_sizes);
+	free(context->dim_sizes);
+	free(context->decode_table);
+	free(context->staged_coords);
+	free(context->staged_values);
+	free(context);
+}
+
+////////////////////////////////////////////////////////
+// Matrix operations 
+////////////////////////////////////////////////////////
+
+static hsize_t * automatic_chunks(hsize_t rank, hsize_t * dim_sizes) {
+	hsize_t * chunk_sizes = calloc(rank, sizeof(hsize_t));
+	hsize_t cache_size = 500000;
+	double log_ratio, l;
+	int dim, m;
+
+	if (DEBUG)
+		printf("Automatic setting of chunk sizes %lli\n", rank);
+
+	for (m = rank; m > 0; m--) {
+		if (DEBUG)
+			printf("Testing with %i chunked dimensions\n", m);
+
+		log_ratio = log(cache_size);
+		for (dim = rank - m; dim < rank; dim++)
+			log_ratio -= log(dim_sizes[dim]) + log(sizeof(double));
+
+		if (DEBUG)
+			printf("Ratio of cache size / virtual space = %lf\n", exp(log_ratio));
+
+		if (log_ratio == 0) {
+			if (DEBUG)
+				puts("Ratio rejected because null\n");
+			continue;
+		}
+
+		bool reject = false;
+		l = exp(log_ratio/m);
+		if (DEBUG)
+			printf("Chunking ratio = %lf\n", l);
+		hsize_t product = 1;
+		for (dim = rank - m; dim < rank; dim++) {
+			hsize_t chunk_size = (hsize_t) (l > 1 ? dim_sizes[dim]: l * dim_sizes[dim]);
+			product *= chunk_size;
+
+			if (chunk_size <= 0 || product > cache_size) {
+				if (DEBUG) {
+					if (l * dim_sizes[dim] < 1) 
+						printf("Ratio rejected because dim %i too short\n", dim);
+					else
+						printf("Ratio rejected because too big for block\n");
+				}
+				reject = true;
+				break;
+			}
+		}
+		if (!reject)
+			break;
+	}
+
+	if (DEBUG)
+		printf("The top %i dimensions will be chunked at ratio %lf\n", m, l);
+
+	for (dim = 0; dim < rank; dim++) {
+		if (rank - dim > m)
+			chunk_sizes[dim] = 1;
+		else
+			chunk_sizes[dim] = (hsize_t) (l > 1 ? dim_sizes[dim]: l * dim_sizes[dim]);
+
+		if (DEBUG)
+			printf("Dim %i, length %lli will be chunked every %lli cells\n", dim, dim_sizes[dim], chunk_sizes[dim]);
+	}
+
+	return chunk_sizes;
+}
+
+static void create_matrix(hid_t file, hsize_t rank, hsize_t * dim_sizes, hsize_t * chunk_sizes, FileOptions * options) {
 	bool temp_chunk = false;
 	if (!chunk_sizes) {
 		temp_chunk = true;
 		chunk_sizes = automatic_chunks(rank, dim_sizes);
 	}
-	hid_t dataspace = H5Screate_simple(rank, dim_sizes, NULL);
+	// All dimensions can be extended later on
+	hsize_t * max_dim_sizes = calloc(rank, sizeof(hsize_t));
+	hsize_t dim;
+	for (dim = 0; dim < rank; dim++)
+		max_dim_sizes[dim] = H5S_UNLIMITED;
+	hid_t dataspace = H5Screate_simple(rank, dim_sizes, max_dim_sizes);
 	VERIFY(dataspace);
+	free(max_dim_sizes);
 	hid_t cparms = H5Pcreate(H5P_DATASET_CREATE);
 	VERIFY(cparms);
 	VERIFY(H5Pset_chunk(cparms, rank, chunk_sizes));
+	set_storage_filters(cparms, options);
 	if (DEBUG) {
-		printf("Creating matrix of rank %lli\n", rank);
+		printf("Creating matrix of rank %lli, storage profile %i\n", rank, options ? options->storage : STORAGE_NONE);
 		printf("Size\tChunk\n");
 		int i;
 		for (i = 0; i < rank; i++)
 			printf("%lli\t%lli\n", dim_sizes[i], chunk_sizes[i]);
 	}
-	hid_t dataset = H5Dcreate(file, "/matrix", H5T_NATIVE_DOUBLE, dataspace,
+	int encoding = options ? options->encoding : ENCODING_DOUBLE;
+	hid_t dataset = H5Dcreate(file, "/matrix", encoding_type(encoding), dataspace,
 		            H5P_DEFAULT, cparms, H5P_DEFAULT);
 	if (temp_chunk)
 		free(chunk_sizes);
 	VERIFY(dataset);
+	write_encoding(dataset, encoding);
 	VERIFY(H5Sclose(dataspace));
 	VERIFY(H5Pclose(cparms));
 	VERIFY(H5Dclose(dataset));
 }
 
-static void store_values_in_matrix(hid_t file, hsize_t count, hsize_t ** coords, double * values) {
-	hsize_t rank = get_file_rank(file);
-	hid_t dataset = H5Dopen(file, "/matrix", H5P_DEFAULT);
-	VERIFY(dataset);
- 	hid_t filespace = H5Dget_space(dataset);
-	VERIFY(filespace);
-	hid_t memspace = H5Screate_simple(1, &count, NULL);
-	VERIFY(memspace);
-	hsize_t * coord = calloc(count * rank, sizeof(hsize_t));
-	hsize_t index, dim, pos = 0;
-	for (index = 0; index < count; index++) {
-		for (dim = 0; dim < rank; dim++) {
-			coord[pos++] = coords[index][dim];
-		}
-	}
-	VERIFY(H5Sselect_elements(filespace, H5S_SELECT_SET, count, coord));
-	clock_t start = clock();
-	VERIFY(H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memspace, filespace, H5P_DEFAULT, values));
-	if (DEBUG)
-		printf("<<< HDF5 WRITE TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
-	free(coord);
-	VERIFY(H5Sclose(filespace));
-	VERIFY(H5Sclose(memspace));
-	VERIFY(H5Dclose(dataset));
-}
-
-static double * fetch_values(hid_t file, hsize_t * offset, hsize_t * width) {
-	hsize_t rank = get_file_rank(file);
-	hid_t dataset = H5Dopen(file, "/matrix", H5P_DEFAULT);
-	VERIFY(dataset);
-	hid_t dataspace = H5Dget_space(dataset);
-	VERIFY(dataspace);
+static void read_values(FileContext * file, hsize_t * offset, hsize_t * width, double * array) {
+	hsize_t rank = file->rank;
+	hid_t dataspace = file->matrix_space;
 
 	if (DEBUG) {
 		int dim;
 		printf("Reading with offset:");
-		hsize_t * dim_sizes = calloc(rank, sizeof(hsize_t));
-		VERIFY(H5Sget_simple_extent_dims(dataspace, dim_sizes, NULL));
 		for(dim = 0; dim < rank; dim++) {
 			printf("\t%lli", offset[dim]);
 		}
@@ -518,188 +1709,229 @@ static double * fetch_values(hid_t file, hsize_t * offset, hsize_t * width) {
 		}
 		printf("\ninside matrix of size:");
 		for(dim = 0; dim < rank; dim++)
-			printf("\t%lli", dim_sizes[dim]);
+			printf("\t%lli", file->dim_sizes[dim]);
 		puts("");
-		free(dim_sizes);
 	}
 
 	VERIFY(H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset, NULL, width, NULL));
 	hid_t memspace = H5Screate_simple(rank, width, NULL);
 	VERIFY(memspace);
 	clock_t start = clock();
-	double * array = alloc_ndim_array(rank, width, H5Tget_size(H5T_NATIVE_DOUBLE));
-	VERIFY(H5Dread(dataset, H5T_NATIVE_DOUBLE, memspace, dataspace, H5P_DEFAULT, array));
+	VERIFY(H5Dread(file->matrix, file->value_type, memspace, dataspace, H5P_DEFAULT, array));
+	decode_values(file, array, volume(rank, width));
 	if (DEBUG)
 		printf("<<< HDF5 READ TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
-	VERIFY(H5Sclose(dataspace));
 	VERIFY(H5Sclose(memspace));
-	VERIFY(H5Dclose(dataset));
-	return array;
+}
+
+////////////////////////////////////////////////////////
+// Interval selections
+// Each constrained dimension holds a list of [lo, hi)
+// intervals, their cross product is compiled into a
+// union of hyperslabs
+////////////////////////////////////////////////////////
+
+// Clips interval choice[dim] of each dimension to the box,
+// returns false if the resulting block is empty
+static bool clip_interval_block(hsize_t rank, hsize_t * offset, hsize_t * width, DimConstraint * ranges, hsize_t * choice, hsize_t * start, hsize_t * count) {
+	hsize_t dim;
+	for (dim = 0; dim < rank; dim++) {
+		hsize_t lower = offset[dim];
+		hsize_t upper = offset[dim] + width[dim];
+		if (ranges[dim].count) {
+			if (ranges[dim].lo[choice[dim]] > lower)
+				lower = ranges[dim].lo[choice[dim]];
+			if (ranges[dim].hi[choice[dim]] < upper)
+				upper = ranges[dim].hi[choice[dim]];
+		}
+		if (upper <= lower)
+			return false;
+		start[dim] = lower;
+		count[dim] = upper - lower;
+	}
+	return true;
+}
+
+// Moves on to the next combination of intervals, the last dimension varying fastest
+static bool next_interval_choice(hsize_t rank, DimConstraint * ranges, hsize_t * choice) {
+	hsize_t dim = rank;
+	while (dim > 0) {
+		dim--;
+		if (choice[dim] + 1 < ranges[dim].count) {
+			choice[dim]++;
+			return true;
+		}
+		choice[dim] = 0;
+	}
+	return false;
+}
+
+static bool box_overlaps_ranges(hsize_t rank, hsize_t * offset, hsize_t * width, DimConstraint * ranges) {
+	hsize_t dim, interval;
+	for (dim = 0; dim < rank; dim++) {
+		if (!ranges[dim].count)
+			continue;
+		for (interval = 0; interval < ranges[dim].count; interval++)
+			if (ranges[dim].lo[interval] < offset[dim] + width[dim] && ranges[dim].hi[interval] > offset[dim])
+				break;
+		if (interval == ranges[dim].count)
+			return false;
+	}
+	return true;
+}
+
+// Reads the cells of the box which fall within the intervals in a single
+// H5Dread, the other cells of the array are left at zero
+static void read_selected_values(FileContext * file, hsize_t * offset, hsize_t * width, DimConstraint * ranges, double * array) {
+	hsize_t rank = file->rank;
+	hsize_t * choice = calloc(rank, sizeof(hsize_t));
+	hsize_t * start = calloc(rank, sizeof(hsize_t));
+	hsize_t * count = calloc(rank, sizeof(hsize_t));
+	hsize_t * mem_start = calloc(rank, sizeof(hsize_t));
+	hsize_t blocks = 0, dim;
+	hid_t memspace = H5Screate_simple(rank, width, NULL);
+	VERIFY(memspace);
+	memset(array, 0, volume(rank, width) * sizeof(double));
+
+	do {
+		if (!clip_interval_block(rank, offset, width, ranges, choice, start, count))
+			continue;
+		for (dim = 0; dim < rank; dim++)
+			mem_start[dim] = start[dim] - offset[dim];
+		H5S_seloper_t op = blocks ? H5S_SELECT_OR : H5S_SELECT_SET;
+		VERIFY(H5Sselect_hyperslab(file->matrix_space, op, start, NULL, count, NULL));
+		VERIFY(H5Sselect_hyperslab(memspace, op, mem_start, NULL, count, NULL));
+		blocks++;
+	} while (next_interval_choice(rank, ranges, choice));
+
+	if (DEBUG)
+		printf("Reading %lli hyperslab(s) out of a box of %lli cells\n", blocks, volume(rank, width));
+	if (blocks) {
+		clock_t start_time = clock();
+		VERIFY(H5Dread(file->matrix, file->value_type, memspace, file->matrix_space, H5P_DEFAULT, array));
+		decode_values(file, array, volume(rank, width));
+		if (DEBUG)
+			printf("<<< HDF5 READ TIME\t%lf\n", ((double) (clock() - start_time)) / CLOCKS_PER_SEC);
+	}
+	VERIFY(H5Sclose(memspace));
+	free(choice);
+	free(start);
+	free(count);
+	free(mem_start);
 }
 
 ////////////////////////////////////////////////////////
 // Boundaries
 ////////////////////////////////////////////////////////
 
-static void create_boundaries_group(hid_t group, hsize_t core_rank, hsize_t dim, hsize_t dim_size) {
-	hsize_t shape[3];
+static void create_boundaries_group(hid_t group, hsize_t core_rank, hsize_t dim, hsize_t dim_size, FileOptions * options) {
+	hsize_t shape[3], max_shape[3], chunk[3];
 	shape[0] = dim_size;
 	shape[1] = core_rank - 1;
 	shape[2] = 2;
-	hid_t dataspace = H5Screate_simple(3, shape, NULL);
+	// Extensible along the values of the dimension. A chunked dimension
+	// cannot be fixed at 0, which it is when there is a single core dimension
+	max_shape[0] = H5S_UNLIMITED;
+	max_shape[1] = shape[1] ? shape[1] : H5S_UNLIMITED;
+	max_shape[2] = shape[2];
+	hid_t dataspace = H5Screate_simple(3, shape, max_shape);
 	VERIFY(dataspace);
 
 	hid_t params = H5Pcreate(H5P_DATASET_CREATE);
 	VERIFY(params);
 	hsize_t value = 0;
 	VERIFY(H5Pset_fill_value(params, H5T_NATIVE_HSIZE, &value));
+	// Chunks match the blocks of the boundary cache
+	chunk[0] = dim_size < BOUNDARY_BLOCK_ROWS ? dim_size : BOUNDARY_BLOCK_ROWS;
+	if (!chunk[0])
+		chunk[0] = 1;
+	chunk[1] = shape[1] ? shape[1] : 1;
+	chunk[2] = shape[2];
+	VERIFY(H5Pset_chunk(params, 3, chunk));
+	set_storage_filters(params, options);
 
 	char buf[5];
 	sprintf(buf, "%llu", dim);
 	hid_t dataset = H5Dcreate(group, buf, H5T_NATIVE_HSIZE, dataspace, H5P_DEFAULT, params, H5P_DEFAULT);
 	VERIFY(dataset);
 	VERIFY(H5Dclose(dataset));
+	VERIFY(H5Pclose(params));
 	VERIFY(H5Sclose(dataspace));
 }
 
-static void create_boundaries(hid_t file, hsize_t rank, hsize_t core_rank, hsize_t * dim_sizes) {
+static void create_boundaries(hid_t file, hsize_t rank, hsize_t core_rank, hsize_t * dim_sizes, FileOptions * options) {
 	int dim;
 	hid_t group = H5Gcreate(file, "/boundaries", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 	VERIFY(group);
 	for (dim = rank - core_rank; dim < rank; dim++)
-		create_boundaries_group(group, core_rank, dim, dim_sizes[dim]);
+		create_boundaries_group(group, core_rank, dim, dim_sizes[dim], options);
 	VERIFY(H5Gclose(group));
 }
 
-static hsize_t * initialise_boundary_array_dim(hid_t file, hsize_t dim) {
-	char buf[5];
-	hsize_t shape[3];
-	hid_t group = H5Gopen(file, "/boundaries", H5P_DEFAULT);
-	VERIFY(group);
-	sprintf(buf, "%llu", dim);
-	hid_t dataset = H5Dopen(group, buf, H5P_DEFAULT);
-	VERIFY(dataset);
-	hid_t dataspace = H5Dget_space(dataset);
-	VERIFY(dataspace);
-	VERIFY(H5Sget_simple_extent_dims(dataspace, shape, NULL));
-	if (DEBUG)
-		printf("Allocating matrix of dimensions (%lli,%lli,%lli) for dim%lli boundaries\n", shape[0], shape[1], shape[2], dim);
-	hsize_t * res = calloc(volume(3, shape), sizeof(hsize_t));
-	VERIFY(H5Dread(dataset, H5T_NATIVE_HSIZE, H5S_ALL, H5S_ALL, H5P_DEFAULT, res));
-	printf("DEBUG\n");
-	VERIFY(H5Sclose(dataspace));
-	VERIFY(H5Dclose(dataset));
-	VERIFY(H5Gclose(group));
-	return res;
-}
-
-static hsize_t ** initialise_boundary_array(hid_t file, hsize_t rank, hsize_t core_rank) {
-	hsize_t ** res = calloc(rank, sizeof(hsize_t *));
-	hsize_t dim;
-	for (dim = rank - core_rank; dim < rank; dim++)
-		res[dim] = initialise_boundary_array_dim(file, dim);
-	return res;
-}
-
-static void compute_boundaries_row_dim_2(hsize_t * boundaries, hsize_t rank, hsize_t core_rank, hsize_t * coords, hsize_t dim, hsize_t dim2) {
+// An empty pair of boundaries is (0, 0), the upper boundary being exclusive
+static void update_boundaries_dim_2(FileContext * file, hsize_t * coords, hsize_t dim, hsize_t dim2) {
+	hsize_t rank = file->rank;
+	hsize_t core_rank = file->core_rank;
 	if (DEBUG > 1)
 		printf("Entering position at (dim%lli:%lli;dim%lli:%lli)\n", dim, coords[dim], dim2, coords[dim2]);
 	hsize_t proj_dim2 = dim2 > dim? dim2 - 1 + core_rank - rank: dim2 + core_rank - rank;
-	hsize_t position = coords[dim] * (core_rank - 1) * 2 + proj_dim2 * 2;
+	hsize_t * bounds = boundary_row(file, dim, coords[dim]) + proj_dim2 * 2;
+	bool changed = false;
 
-	if (DEBUG > 1)
-		printf("Boundaries on dim%lli:%lli-%lli\n", dim2, boundaries[position], boundaries[position+1]);
+	if (bounds[1] == 0 || coords[dim2] < bounds[0]) {
+		bounds[0] = coords[dim2];
+		changed = true;
+	}
 
-	if (coords[dim2] < boundaries[position] || boundaries[position] == 0)
-		boundaries[position] = coords[dim2];
+	if (coords[dim2] + 1 > bounds[1]) {
+		bounds[1] = coords[dim2] + 1;
+		changed = true;
+	}
 
-	if (coords[dim2] + 1 > boundaries[position + 1])
-		boundaries[position + 1] = coords[dim2] + 1;
+	if (changed)
+		file->boundary_caches[dim]->dirty[coords[dim] / BOUNDARY_BLOCK_ROWS] = true;
 
 	if (DEBUG > 1)
-		printf("New boundaries: dim%lli == %lli => dim%lli in [%lli,%lli] (%lli-%lli)\n", dim, coords[dim], dim2, boundaries[position], boundaries[position+1], position, position+1);
+		printf("New boundaries: dim%lli == %lli => dim%lli in [%lli,%lli]\n", dim, coords[dim], dim2, bounds[0], bounds[1]);
 }
 
-static void compute_boundaries_row(hsize_t ** boundaries, hsize_t rank, hsize_t core_rank, hsize_t * coords) {
-	hsize_t dim, dim2;
+static void set_boundaries(FileContext * file, hsize_t count, hsize_t ** coords) {
+	hsize_t rank = file->rank;
+	hsize_t core_rank = file->core_rank;
+	hsize_t row, dim, dim2;
+	if (DEBUG)
+		printf("SETTING BOUNDARIES\n");
 
-	for (dim = rank - core_rank; dim < rank; dim++) {
-		for (dim2 = rank - core_rank; dim2 < dim; dim2++) {
-			compute_boundaries_row_dim_2(boundaries[dim], rank, core_rank, coords, dim, dim2);
-			compute_boundaries_row_dim_2(boundaries[dim2], rank, core_rank, coords, dim2, dim);
+	for (row = 0; row < count; row++) {
+		for (dim = rank - core_rank; dim < rank; dim++) {
+			for (dim2 = rank - core_rank; dim2 < dim; dim2++) {
+				update_boundaries_dim_2(file, coords[row], dim, dim2);
+				update_boundaries_dim_2(file, coords[row], dim2, dim);
+			}
 		}
 	}
 }
 
-static void compute_boundaries(hsize_t ** boundaries, hsize_t rank, hsize_t core_rank, hsize_t count, hsize_t ** coords) {
-	hsize_t row;
-
-	for (row = 0; row < count; row++)
-		compute_boundaries_row(boundaries, rank, core_rank, coords[row]);
-}
-
-static void store_boundaries_group(hid_t group, hsize_t dim, hsize_t * boundaries) {
-	char buf[5];
-	sprintf(buf, "%llu", dim);
-	hid_t dataset = H5Dopen(group, buf, H5P_DEFAULT);
-	VERIFY(dataset);
-	clock_t start = clock();
-	if (DEBUG)
-		printf("Writing into boundary table %s results %lli %lli, %lli %lli\n", buf, boundaries[0], boundaries[1], boundaries[2], boundaries[3]); 
-	VERIFY(H5Dwrite(dataset, H5T_NATIVE_HSIZE, H5S_ALL, H5S_ALL, H5P_DEFAULT, boundaries));
-	if (DEBUG)
-		printf("<<< HDF5 WRITE TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
-	VERIFY(H5Dclose(dataset));
-}
-
-static void store_boundaries(hid_t file, hsize_t rank, hsize_t core_rank, hsize_t ** boundaries) {
-	int dim;
-	hid_t group = H5Gopen(file, "/boundaries", H5P_DEFAULT);
-	VERIFY(group);
-	for (dim = rank - core_rank; dim < rank; dim++)
-		store_boundaries_group(group, dim, boundaries[dim]);
-	VERIFY(H5Gclose(group));
-}
-
-static void free_boundary_array(hsize_t ** array, hsize_t rank) {
-	hsize_t dim;
-	for (dim = 0; dim < rank; dim++)
-		if (array[dim])
-			free(array[dim]);
-	free(array);
-}
-
-static void set_boundaries(hid_t file, hsize_t count, hsize_t ** coords) {
-	if (DEBUG)
-		printf("SETTING BOUNDARIES\n");
-	hsize_t rank = get_file_rank(file);
-	hsize_t core_rank = get_file_core_rank(file);
-	hsize_t ** boundaries = initialise_boundary_array(file, rank, core_rank);
-	if (DEBUG)
-		printf("COMPUTING BOUNDARIES\n");
-	compute_boundaries(boundaries, rank, core_rank, count, coords);
-	if (DEBUG)
-		printf("STORING BOUNDARIES\n");
-	store_boundaries(file, rank, core_rank, boundaries);
-	free_boundary_array(boundaries, rank);
-}
-
 ////////////////////////////////////////////////////////
 // Extracting boundary information 
 ////////////////////////////////////////////////////////
 
-static hsize_t * open_boundaries_dim(hid_t group, hsize_t rank, hsize_t core_rank, hsize_t dim, hsize_t constraint) {
-	char buf[5];
-	sprintf(buf, "%llu", dim);
-	hid_t dataset = H5Dopen(group, buf, H5P_DEFAULT);
-	VERIFY(dataset);
+static hsize_t * open_boundaries_dim(FileContext * file, hsize_t dim, hsize_t constraint) {
+	hsize_t * cached = cached_boundary_row(file, dim, constraint);
+	if (cached) {
+		hsize_t * res = calloc((file->core_rank - 1) * 2, sizeof(hsize_t));
+		memcpy(res, cached, (file->core_rank - 1) * 2 * sizeof(hsize_t));
+		return res;
+	}
+
+	hid_t dataset = file->boundary_datasets[dim];
 	hsize_t offset[3];
 	offset[0] = constraint;
 	offset[1] = 0;
 	offset[2] = 0;
 	hsize_t width[3];
 	width[0] = 1;
-	width[1] = core_rank - 1;
+	width[1] = file->core_rank - 1;
 	width[2] = 2;
 	hid_t dataspace = H5Dget_space(dataset);
 	VERIFY(dataspace);
@@ -734,22 +1966,73 @@ static hsize_t * open_boundaries_dim(hid_t group, hsize_t rank, hsize_t core_ran
 		printf("<<< HDF5 READ TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
 	VERIFY(H5Sclose(dataspace));
 	VERIFY(H5Sclose(memspace));
-	VERIFY(H5Dclose(dataset));
 	return res;
 }
 
-static hsize_t ** open_boundaries(hid_t file, hsize_t rank, hsize_t core_rank, bool * set_dims, hsize_t * constraints) {
-	hsize_t ** boundaries = calloc(rank, sizeof(hsize_t *));
-	hid_t group = H5Gopen(file, "boundaries", H5P_DEFAULT);
-	VERIFY(group);
+static hsize_t ** open_boundaries(FileContext * file, bool * set_dims, hsize_t * constraints) {
+	hsize_t ** boundaries = calloc(file->rank, sizeof(hsize_t *));
 	hsize_t dim;
-	for (dim = rank - core_rank; dim < rank; dim++)
+	for (dim = file->rank - file->core_rank; dim < file->rank; dim++)
 		if (set_dims[dim])
-			boundaries[dim] = open_boundaries_dim(group, rank, core_rank, dim, constraints[dim]);
-	VERIFY(H5Gclose(group));
+			boundaries[dim] = open_boundaries_dim(file, dim, constraints[dim]);
 	return boundaries;
 }
 
+// Reads the boundary rows of all the values within the intervals at once,
+// and merges them into a single row of (min, max) pairs
+static hsize_t * open_boundaries_intervals(FileContext * file, hsize_t dim, DimConstraint * range) {
+	if (file->core_rank < 2)
+		return NULL;
+	// Pending updates must be on file before the rows are read back
+	flush_boundaries(file);
+	hid_t dataset = file->boundary_datasets[dim];
+	hsize_t pairs = file->core_rank - 1;
+	hsize_t offset[3] = {0, 0, 0};
+	hsize_t width[3] = {0, pairs, 2};
+	hsize_t rows = 0, interval, row, pair;
+	hid_t dataspace = H5Dget_space(dataset);
+	VERIFY(dataspace);
+
+	for (interval = 0; interval < range->count; interval++) {
+		offset[0] = range->lo[interval];
+		width[0] = range->hi[interval] - range->lo[interval];
+		VERIFY(H5Sselect_hyperslab(dataspace, interval ? H5S_SELECT_OR : H5S_SELECT_SET, offset, NULL, width, NULL));
+	}
+	// Overlapping intervals are only selected once
+	rows = H5Sget_select_npoints(dataspace) / (pairs * 2);
+	if (DEBUG)
+		printf("Boundaries of %lli values in %lli interval(s) of dim %lli\n", rows, range->count, dim);
+
+	width[0] = rows;
+	hsize_t * buffer = alloc_ndim_array(3, width, sizeof(hsize_t));
+	hid_t memspace = H5Screate_simple(3, width, NULL);
+	VERIFY(memspace);
+	clock_t start = clock();
+	VERIFY(H5Dread(dataset, H5T_NATIVE_HSIZE, memspace, dataspace, H5P_DEFAULT, buffer));
+	if (DEBUG)
+		printf("<<< HDF5 READ TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
+	VERIFY(H5Sclose(dataspace));
+	VERIFY(H5Sclose(memspace));
+
+	// Values without any data have empty (0, 0) boundaries
+	hsize_t * res = calloc(pairs * 2, sizeof(hsize_t));
+	for (pair = 0; pair < pairs; pair++) {
+		bool found = false;
+		for (row = 0; row < rows; row++) {
+			hsize_t * bounds = buffer + (row * pairs + pair) * 2;
+			if (bounds[1] == 0)
+				continue;
+			if (!found || bounds[0] < res[2 * pair])
+				res[2 * pair] = bounds[0];
+			if (!found || bounds[1] > res[2 * pair + 1])
+				res[2 * pair + 1] = bounds[1];
+			found = true;
+		}
+	}
+	free(buffer);
+	return res;
+}
+
 static hsize_t lower_search_bound(hsize_t rank, hsize_t core_rank, hsize_t dim, hsize_t ** boundaries) {
 	hsize_t dim2;
 	hsize_t offset = 0;
@@ -778,17 +2061,11 @@ static hsize_t upper_search_bound(hsize_t rank, hsize_t core_rank, hsize_t dim,
 	return upper;
 }
 
-static bool set_query_parameters(hid_t file, hsize_t rank, bool * set_dims, hsize_t * constraints, hsize_t * offset, hsize_t * width) {
-	int core_rank = get_file_core_rank(file);
-	hsize_t * dim_sizes = calloc(rank, sizeof(hsize_t));
-	hid_t dataset = H5Dopen(file, "/matrix", H5P_DEFAULT);
-	VERIFY(dataset);
-	hid_t dataspace = H5Dget_space(dataset);
-	VERIFY(dataspace);
-	VERIFY(H5Sget_simple_extent_dims(dataspace, dim_sizes, NULL));
-	VERIFY(H5Sclose(dataspace));
-	VERIFY(H5Dclose(dataset));
-	hsize_t ** boundaries = open_boundaries(file, rank, core_rank, set_dims, constraints);
+static bool set_query_parameters(FileContext * file, bool * set_dims, hsize_t * constraints, hsize_t * offset, hsize_t * width) {
+	hsize_t rank = file->rank;
+	int core_rank = file->core_rank;
+	hsize_t * dim_sizes = file->dim_sizes;
+	hsize_t ** boundaries = open_boundaries(file, set_dims, constraints);
 
 	hsize_t dim;
 	if (DEBUG)
@@ -801,7 +2078,9 @@ static bool set_query_parameters(hid_t file, hsize_t rank, bool * set_dims, hsiz
 				printf("Constrained dim %lli searched from %lli -> %lli\n", dim, offset[dim], offset[dim]+width[dim]);
 		} else if (dim >= rank - core_rank) {
 			offset[dim] = lower_search_bound(rank, core_rank, dim, boundaries);
-			width[dim] = upper_search_bound(rank, core_rank, dim, dim_sizes[dim], boundaries) - offset[dim];
+			hsize_t upper = upper_search_bound(rank, core_rank, dim, dim_sizes[dim], boundaries);
+			// Constraints with no data in common leave an empty interval
+			width[dim] = upper > offset[dim] ? upper - offset[dim] : 0;
 			if (DEBUG)
 				printf("Bounded dim %lli searched from %lli -> %lli\n", dim, offset[dim], offset[dim]+width[dim]);
 		} else {
@@ -822,28 +2101,66 @@ static bool set_query_parameters(hid_t file, hsize_t rank, bool * set_dims, hsiz
 	// Cleaning up
 	for (dim = 0; dim < core_rank; dim++)
 		if (set_dims[dim + rank - core_rank])
-			free(boundaries[dim]);
+			free(boundaries[dim + rank - core_rank]);
 	free(boundaries);
-	free(dim_sizes);
 	return false;
 }
 
-////////////////////////////////////////////////////////
-// ResultTable operations 
-////////////////////////////////////////////////////////
+static bool set_range_query_parameters(FileContext * file, DimConstraint * constraints, hsize_t * offset, hsize_t * width) {
+	hsize_t rank = file->rank;
+	hsize_t core_rank = file->core_rank;
+	hsize_t dim, interval;
 
-static hsize_t count_non_zero_values(double * array, hsize_t rank, hsize_t * width) {
-	hsize_t count = 0;
-	hsize_t pos;
-	hsize_t max = volume(rank, width);
-	for (pos = 0; pos < max; pos++) {
-		if (array[pos])
-			count++;
+	for (dim = 0; dim < rank; dim++) {
+		for (interval = 0; interval < constraints[dim].count; interval++) {
+			if (constraints[dim].lo[interval] >= constraints[dim].hi[interval] || constraints[dim].hi[interval] > file->dim_sizes[dim]) {
+				if (DEBUG)
+					printf("Invalid interval [%lli, %lli) on dim %lli\n", constraints[dim].lo[interval], constraints[dim].hi[interval], dim);
+				return true;
+			}
+		}
 	}
 
-	return count;
+	hsize_t ** boundaries = calloc(rank, sizeof(hsize_t *));
+	for (dim = rank - core_rank; dim < rank; dim++)
+		if (constraints[dim].count)
+			boundaries[dim] = open_boundaries_intervals(file, dim, &constraints[dim]);
+
+	for (dim = 0; dim < rank; dim++) {
+		if (constraints[dim].count) {
+			hsize_t lower = constraints[dim].lo[0];
+			hsize_t upper = constraints[dim].hi[0];
+			for (interval = 1; interval < constraints[dim].count; interval++) {
+				if (constraints[dim].lo[interval] < lower)
+					lower = constraints[dim].lo[interval];
+				if (constraints[dim].hi[interval] > upper)
+					upper = constraints[dim].hi[interval];
+			}
+			offset[dim] = lower;
+			width[dim] = upper - lower;
+		} else if (dim >= rank - core_rank) {
+			offset[dim] = lower_search_bound(rank, core_rank, dim, boundaries);
+			hsize_t upper = upper_search_bound(rank, core_rank, dim, file->dim_sizes[dim], boundaries);
+			width[dim] = upper > offset[dim] ? upper - offset[dim] : 0;
+		} else {
+			offset[dim] = 0;
+			width[dim] = file->dim_sizes[dim];
+		}
+		if (DEBUG)
+			printf("Dim %lli searched from %lli -> %lli\n", dim, offset[dim], offset[dim]+width[dim]);
+	}
+
+	for (dim = 0; dim < rank; dim++)
+		if (boundaries[dim])
+			free(boundaries[dim]);
+	free(boundaries);
+	return false;
 }
 
+////////////////////////////////////////////////////////
+// ResultTable operations 
+////////////////////////////////////////////////////////
+
 static hsize_t count_width_rank(hsize_t rank, bool * set_dims) {
 	hsize_t dim;
 	hsize_t count = 0;
@@ -870,84 +2187,987 @@ static hsize_t * projected_dims(hsize_t rank, hsize_t width_rank, bool * set_dim
 	return res;
 }
 
-static void enter_new_data_point(ResultTable * table, hsize_t rank, hsize_t write_index, hsize_t * offset, double value) {
-	table->values[write_index] = value;
-	hsize_t * vector = calloc(rank, sizeof(hsize_t));
-	hsize_t dim;
-	for (dim = 0; dim < table->columns; dim++)
-		vector[dim] = offset[table->dims[dim]];
-	if (DEBUG) {
-		printf("Found value %lf at (", value);
-		for (dim = 0; dim < rank; dim++)
-			printf("%lli,", offset[dim]);
-		puts(")");
+ResultTable * new_result_table(hsize_t rank, bool * set_dims) {
+	ResultTable * table = calloc(1, sizeof(ResultTable));
+	hsize_t width_rank = count_width_rank(rank, set_dims);
+	table->columns = width_rank;
+	table->dims = projected_dims(rank, width_rank, set_dims);
+	if (width_rank)
+		table->indices = calloc(width_rank, sizeof(hsize_t *));
+	return table;
+}
+
+static void reserve_result_table(ResultTable * table, hsize_t extra) {
+	if (table->rows + extra <= table->capacity)
+		return;
+
+	hsize_t capacity = table->capacity ? table->capacity : 1024;
+	while (capacity < table->rows + extra)
+		capacity *= 2;
+
+	if (DEBUG)
+		printf("Growing result table from %lli to %lli rows\n", table->capacity, capacity);
+	hsize_t column;
+	for (column = 0; column < table->columns; column++)
+		table->indices[column] = realloc(table->indices[column], capacity * sizeof(hsize_t));
+	table->values = realloc(table->values, capacity * sizeof(double));
+	table->capacity = capacity;
+}
+
+void destroy_result_table(ResultTable * table) {
+	hsize_t column;
+	if (table->indices) {
+		for (column = 0; column < table->columns; column++)
+			if (table->indices[column])
+				free(table->indices[column]);
+		free(table->indices);
+	}
+	if (table->values)
+		free(table->values);
+	if (table->dims)
+		free(table->dims);
+	free(table);
+}
+
+////////////////////////////////////////////////////////
+// Non-zero extraction kernel
+// Each innermost run of a dense block is scanned once,
+// and the coordinates and values of its non-zero cells
+// are appended straight into the result table
+////////////////////////////////////////////////////////
+
+// Stores the positions of the non-zero cells of the run into hits, 
+// returns the number of hits. NaNs count as non-zero, -0 does not.
+static hsize_t find_non_zero_values(double * run, hsize_t length, hsize_t * hits) {
+	hsize_t pos = 0, count = 0;
+#if defined(__AVX2__)
+	__m256d zero = _mm256_setzero_pd();
+	for (; pos + 4 <= length; pos += 4) {
+		int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(run + pos), zero, _CMP_NEQ_UQ));
+		while (mask) {
+			hits[count++] = pos + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#elif defined(__SSE2__)
+	__m128d zero = _mm_setzero_pd();
+	for (; pos + 2 <= length; pos += 2) {
+		int mask = _mm_movemask_pd(_mm_cmpneq_pd(_mm_loadu_pd(run + pos), zero));
+		while (mask) {
+			hits[count++] = pos + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; pos < length; pos++) {
+		hits[count] = pos;
+		count += run[pos] != 0;
+	}
+	return count;
+}
+
+// Drops the hits which fail the predicate, returns the number of hits left
+static hsize_t filter_hits(ValueFilter * filter, double * run, hsize_t * hits, hsize_t count) {
+	double threshold = filter->threshold;
+	hsize_t hit, kept = 0;
+	switch (filter->predicate) {
+	case VALUE_LT:
+		for (hit = 0; hit < count; hit++) {
+			hits[kept] = hits[hit];
+			kept += run[hits[hit]] < threshold;
+		}
+		return kept;
+	case VALUE_GT:
+		for (hit = 0; hit < count; hit++) {
+			hits[kept] = hits[hit];
+			kept += run[hits[hit]] > threshold;
+		}
+		return kept;
+	case VALUE_ABS_GT:
+		for (hit = 0; hit < count; hit++) {
+			hits[kept] = hits[hit];
+			kept += fabs(run[hits[hit]]) > threshold;
+		}
+		return kept;
+	default:
+		return count;
+	}
+}
+
+////////////////////////////////////////////////////////
+// Top-k selection
+// The table is kept as a min-heap of at most top_k rows, 
+// the root being the worst row kept so far
+////////////////////////////////////////////////////////
+
+static double top_key(TopOrder order, double value) {
+	switch (order) {
+	case TOP_SMALLEST:
+		return -value;
+	case TOP_LARGEST_ABS:
+		return fabs(value);
+	default:
+		return value;
+	}
+}
+
+static void swap_rows(ResultTable * table, hsize_t a, hsize_t b) {
+	hsize_t column;
+	for (column = 0; column < table->columns; column++) {
+		hsize_t index = table->indices[column][a];
+		table->indices[column][a] = table->indices[column][b];
+		table->indices[column][b] = index;
+	}
+	double value = table->values[a];
+	table->values[a] = table->values[b];
+	table->values[b] = value;
+}
+
+static void sift_up(ResultTable * table, hsize_t row) {
+	TopOrder order = table->filter->order;
+	while (row > 0) {
+		hsize_t parent = (row - 1) / 2;
+		if (top_key(order, table->values[parent]) <= top_key(order, table->values[row]))
+			break;
+		swap_rows(table, parent, row);
+		row = parent;
+	}
+}
+
+static void sift_down(ResultTable * table, hsize_t row, hsize_t size) {
+	TopOrder order = table->filter->order;
+	while (2 * row + 1 < size) {
+		hsize_t child = 2 * row + 1;
+		if (child + 1 < size && top_key(order, table->values[child + 1]) < top_key(order, table->values[child]))
+			child++;
+		if (top_key(order, table->values[row]) <= top_key(order, table->values[child]))
+			break;
+		swap_rows(table, row, child);
+		row = child;
+	}
+}
+
+// Enters the hits of a run into the heap, only touching the table 
+// when a hit beats the worst row kept
+static void offer_top_k(ResultTable * table, double * run, hsize_t * hits, hsize_t count, hsize_t rank, hsize_t * position, hsize_t run_offset) {
+	ValueFilter * filter = table->filter;
+	hsize_t hit, column, row;
+	for (hit = 0; hit < count; hit++) {
+		double value = run[hits[hit]];
+		if (table->rows < filter->top_k) {
+			reserve_result_table(table, 1);
+			row = table->rows++;
+		} else if (top_key(filter->order, value) > top_key(filter->order, table->values[0]))
+			row = 0;
+		else
+			continue;
+
+		for (column = 0; column < table->columns; column++) {
+			if (table->dims[column] == rank - 1)
+				table->indices[column][row] = run_offset + hits[hit];
+			else
+				table->indices[column][row] = position[table->dims[column]];
+		}
+		table->values[row] = value;
+		if (row)
+			sift_up(table, row);
+		else
+			sift_down(table, 0, table->rows);
+	}
+}
+
+// Sorts the heap, best row first
+void sort_top_k(ResultTable * table) {
+	if (!table->filter || !table->filter->top_k)
+		return;
+	hsize_t end;
+	for (end = table->rows; end > 1; end--) {
+		swap_rows(table, 0, end - 1);
+		sift_down(table, 0, end - 1);
+	}
+}
+
+// Appends the non zero values of a dense block to the table
+void unroll_matrix(ResultTable * table, double * array, hsize_t rank, hsize_t * offset, hsize_t * width) {
+	hsize_t length = width[rank - 1];
+	hsize_t runs = volume(rank - 1, width);
+	hsize_t * position = calloc(rank, sizeof(hsize_t));
+	hsize_t * hits = calloc(length, sizeof(hsize_t));
+	hsize_t run, hit, column, dim;
+
+	for (dim = 0; dim < rank; dim++)
+		position[dim] = offset[dim];
+
+	for (run = 0; run < runs; run++) {
+		double * reader = array + run * length;
+		hsize_t count = find_non_zero_values(reader, length, hits);
+		if (count && table->filter)
+			count = filter_hits(table->filter, reader, hits, count);
+
+		if (count && table->filter && table->filter->top_k)
+			offer_top_k(table, reader, hits, count, rank, position, offset[rank - 1]);
+		else if (count) {
+			reserve_result_table(table, count);
+			for (column = 0; column < table->columns; column++) {
+				hsize_t * indices = table->indices[column] + table->rows;
+				if (table->dims[column] == rank - 1) {
+					for (hit = 0; hit < count; hit++)
+						indices[hit] = offset[rank - 1] + hits[hit];
+				} else {
+					for (hit = 0; hit < count; hit++)
+						indices[hit] = position[table->dims[column]];
+				}
+			}
+			double * values = table->values + table->rows;
+			for (hit = 0; hit < count; hit++)
+				values[hit] = reader[hits[hit]];
+			table->rows += count;
+		}
+
+		// Move on to the next run, the last dimension varying fastest
+		dim = rank - 1;
+		while (dim > 0) {
+			dim--;
+			if (++position[dim] < offset[dim] + width[dim])
+				break;
+			position[dim] = offset[dim];
+		}
+	}
+
+	free(position);
+	free(hits);
+}
+
+////////////////////////////////////////////////////////
+// Chunk iteration
+// A query box is read one chunk of the matrix at a time,
+// so that the memory footprint of a query is bounded by
+// the chunk size rather than by the volume of the box
+////////////////////////////////////////////////////////
+
+static void first_chunk(FileContext * file, hsize_t * offset, hsize_t * width, hsize_t * chunk, hsize_t * first, hsize_t * last) {
+	hsize_t dim;
+	for (dim = 0; dim < file->rank; dim++) {
+		first[dim] = offset[dim] / file->chunk_sizes[dim];
+		last[dim] = (offset[dim] + width[dim] - 1) / file->chunk_sizes[dim];
+		chunk[dim] = first[dim];
+	}
+}
+
+static bool next_chunk(hsize_t rank, hsize_t * chunk, hsize_t * first, hsize_t * last) {
+	hsize_t dim = rank;
+	while (dim > 0) {
+		dim--;
+		if (chunk[dim] < last[dim]) {
+			chunk[dim]++;
+			return true;
+		}
+		chunk[dim] = first[dim];
+	}
+	return false;
+}
+
+static void intersect_chunk(FileContext * file, hsize_t * chunk, hsize_t * offset, hsize_t * width, hsize_t * sub_offset, hsize_t * sub_width) {
+	hsize_t dim;
+	for (dim = 0; dim < file->rank; dim++) {
+		hsize_t lower = chunk[dim] * file->chunk_sizes[dim];
+		hsize_t upper = lower + file->chunk_sizes[dim];
+		if (lower < offset[dim])
+			lower = offset[dim];
+		if (upper > offset[dim] + width[dim])
+			upper = offset[dim] + width[dim];
+		sub_offset[dim] = lower;
+		sub_width[dim] = upper - lower;
+	}
+}
+
+// Chunks of the sparse matrix which were never written are not allocated
+// in the file, the chunk index tells us so without reading any data
+static bool chunk_allocated(FileContext * file, hsize_t * chunk, hsize_t * chunk_offset) {
+	hsize_t dim, size;
+	haddr_t address;
+	unsigned filter_mask;
+	for (dim = 0; dim < file->rank; dim++)
+		chunk_offset[dim] = chunk[dim] * file->chunk_sizes[dim];
+	VERIFY(H5Dget_chunk_info_by_coord(file->matrix, chunk_offset, &filter_mask, &address, &size));
+	return address != HADDR_UNDEF;
+}
+
+static hsize_t count_allocated_chunks(FileContext * file) {
+	hsize_t count;
+	VERIFY(H5Dget_num_chunks(file->matrix, file->matrix_space, &count));
+	return count;
+}
+
+// State of a walk through the allocated chunks of a query box
+typedef struct chunk_scan_st {
+	FileContext * file;
+	hsize_t * offset, * width;
+	hsize_t * chunk, * first, * last;
+	hsize_t * sub_offset, * sub_width;
+	hsize_t * chunk_offset;
+	// Optional intervals, cells outside of them are ignored
+	DimConstraint * ranges;
+	bool done;
+	hsize_t read, skipped;
+	// A single buffer, sized for one chunk, is reused for every read
+	double * buffer;
+} ChunkScan;
+
+static ChunkScan * new_chunk_scan(FileContext * file, hsize_t * offset, hsize_t * width, DimConstraint * ranges) {
+	hsize_t rank = file->rank;
+	ChunkScan * scan = calloc(1, sizeof(ChunkScan));
+	scan->file = file;
+	scan->ranges = ranges;
+	scan->offset = calloc(rank, sizeof(hsize_t));
+	scan->width = calloc(rank, sizeof(hsize_t));
+	memcpy(scan->offset, offset, rank * sizeof(hsize_t));
+	memcpy(scan->width, width, rank * sizeof(hsize_t));
+	scan->chunk = calloc(rank, sizeof(hsize_t));
+	scan->first = calloc(rank, sizeof(hsize_t));
+	scan->last = calloc(rank, sizeof(hsize_t));
+	scan->sub_offset = calloc(rank, sizeof(hsize_t));
+	scan->sub_width = calloc(rank, sizeof(hsize_t));
+	scan->chunk_offset = calloc(rank, sizeof(hsize_t));
+	scan->done = !volume(rank, width) || !count_allocated_chunks(file);
+	if (!scan->done) {
+		first_chunk(file, offset, width, scan->chunk, scan->first, scan->last);
+		scan->buffer = alloc_ndim_array(rank, file->chunk_sizes, sizeof(double));
+	}
+	return scan;
+}
+
+// Appends the hits of the next allocated chunk to the table,
+// returns false once the box is exhausted
+static bool scan_next_chunk(ChunkScan * scan, ResultTable * table) {
+	FileContext * file = scan->file;
+	while (!scan->done) {
+		bool allocated = false;
+		intersect_chunk(file, scan->chunk, scan->offset, scan->width, scan->sub_offset, scan->sub_width);
+		if (scan->ranges && !box_overlaps_ranges(file->rank, scan->sub_offset, scan->sub_width, scan->ranges))
+			// Chunks between the intervals are not even looked up
+			scan->skipped++;
+		else if (!chunk_allocated(file, scan->chunk, scan->chunk_offset))
+			scan->skipped++;
+		else {
+			allocated = true;
+			if (scan->ranges)
+				read_selected_values(file, scan->sub_offset, scan->sub_width, scan->ranges, scan->buffer);
+			else
+				read_values(file, scan->sub_offset, scan->sub_width, scan->buffer);
+			unroll_matrix(table, scan->buffer, file->rank, scan->sub_offset, scan->sub_width);
+			scan->read++;
+		}
+		scan->done = !next_chunk(file->rank, scan->chunk, scan->first, scan->last);
+		if (allocated)
+			return true;
+	}
+	return false;
+}
+
+static void destroy_chunk_scan(ChunkScan * scan) {
+	if (DEBUG)
+		printf("Read %lli chunks, skipped %lli unallocated chunks\n", scan->read, scan->skipped);
+	if (scan->buffer)
+		free(scan->buffer);
+	free(scan->offset);
+	free(scan->width);
+	free(scan->chunk);
+	free(scan->first);
+	free(scan->last);
+	free(scan->sub_offset);
+	free(scan->sub_width);
+	free(scan->chunk_offset);
+	free(scan);
+}
+
+static ResultTable * fetch_values(FileContext * file, hsize_t * offset, hsize_t * width, bool * set_dims, ValueFilter * filter) {
+	ResultTable * table = new_result_table(file->rank, set_dims);
+	table->filter = filter;
+	ChunkScan * scan = new_chunk_scan(file, offset, width, NULL);
+	while (scan_next_chunk(scan, table))
+		continue;
+	destroy_chunk_scan(scan);
+	sort_top_k(table);
+	return table;
+}
+
+////////////////////////////////////////////////////////
+// Batched fetches
+// The chunks touched by a set of queries are listed and
+// sorted, so that each chunk is read once and its hits
+// are dispatched to all the queries which overlap it
+////////////////////////////////////////////////////////
+
+typedef struct chunk_request_st {
+	hsize_t chunk;
+	hsize_t query;
+} ChunkRequest;
+
+static int cmp_chunk_requests(const void * a, const void * b) {
+	ChunkRequest * A = (ChunkRequest *) a;
+	ChunkRequest * B = (ChunkRequest *) b;
+	if (A->chunk != B->chunk)
+		return A->chunk < B->chunk ? -1 : 1;
+	if (A->query != B->query)
+		return A->query < B->query ? -1 : 1;
+	return 0;
+}
+
+static hsize_t chunk_grid_size(FileContext * file, hsize_t dim) {
+	return (file->dim_sizes[dim] + file->chunk_sizes[dim] - 1) / file->chunk_sizes[dim];
+}
+
+// Chunk ids follow the order in which fetch_values visits chunks
+static hsize_t chunk_to_id(FileContext * file, hsize_t * chunk) {
+	hsize_t dim, id = 0;
+	for (dim = 0; dim < file->rank; dim++)
+		id = id * chunk_grid_size(file, dim) + chunk[dim];
+	return id;
+}
+
+static void id_to_chunk(FileContext * file, hsize_t id, hsize_t * chunk) {
+	hsize_t dim = file->rank;
+	while (dim > 0) {
+		dim--;
+		chunk[dim] = id % chunk_grid_size(file, dim);
+		id /= chunk_grid_size(file, dim);
+	}
+}
+
+// Chunks which fall between the intervals of a query are left out
+static ChunkRequest * plan_chunk_requests(FileContext * file, hsize_t count, hsize_t ** offsets, hsize_t ** widths, DimConstraint ** ranges, hsize_t * request_count) {
+	hsize_t rank = file->rank;
+	hsize_t * chunk = calloc(rank, sizeof(hsize_t));
+	hsize_t * first = calloc(rank, sizeof(hsize_t));
+	hsize_t * last = calloc(rank, sizeof(hsize_t));
+	hsize_t * sub_offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * sub_width = calloc(rank, sizeof(hsize_t));
+	hsize_t capacity = 0, query;
+	ChunkRequest * requests = NULL;
+
+	*request_count = 0;
+	for (query = 0; query < count; query++) {
+		if (!offsets[query] || !volume(rank, widths[query]))
+			continue;
+		first_chunk(file, offsets[query], widths[query], chunk, first, last);
+		do {
+			if (ranges && ranges[query]) {
+				intersect_chunk(file, chunk, offsets[query], widths[query], sub_offset, sub_width);
+				if (!box_overlaps_ranges(rank, sub_offset, sub_width, ranges[query]))
+					continue;
+			}
+			if (*request_count == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				requests = realloc(requests, capacity * sizeof(ChunkRequest));
+			}
+			requests[*request_count].chunk = chunk_to_id(file, chunk);
+			requests[*request_count].query = query;
+			(*request_count)++;
+		} while (next_chunk(rank, chunk, first, last));
+	}
+
+	if (*request_count)
+		qsort(requests, *request_count, sizeof(ChunkRequest), &cmp_chunk_requests);
+	free(chunk);
+	free(first);
+	free(last);
+	free(sub_offset);
+	free(sub_width);
+	return requests;
+}
+
+// Copies the box (sub_offset, sub_width) out of a dense buffer 
+// holding the enclosing box (offset, width)
+static void extract_box(hsize_t rank, double * src, hsize_t * offset, hsize_t * width, double * dst, hsize_t * sub_offset, hsize_t * sub_width) {
+	hsize_t * position = calloc(rank, sizeof(hsize_t));
+	hsize_t runs = volume(rank - 1, sub_width);
+	hsize_t run, dim;
+
+	for (run = 0; run < runs; run++) {
+		hsize_t src_index = 0;
+		for (dim = 0; dim < rank; dim++)
+			src_index = src_index * width[dim] + sub_offset[dim] + position[dim] - offset[dim];
+		memcpy(dst, src + src_index, sub_width[rank - 1] * sizeof(double));
+		dst += sub_width[rank - 1];
+
+		dim = rank - 1;
+		while (dim > 0) {
+			dim--;
+			if (++position[dim] < sub_width[dim])
+				break;
+			position[dim] = 0;
+		}
+	}
+	free(position);
+}
+
+// Zeroes the cells of a dense box which fall outside the intervals
+static void mask_ranges(hsize_t rank, double * array, hsize_t * offset, hsize_t * width, DimConstraint * ranges) {
+	bool ** inside = calloc(rank, sizeof(bool *));
+	hsize_t * position = calloc(rank, sizeof(hsize_t));
+	hsize_t cells = volume(rank, width);
+	hsize_t cell, dim, index, interval;
+
+	for (dim = 0; dim < rank; dim++) {
+		if (!ranges[dim].count)
+			continue;
+		inside[dim] = calloc(width[dim], sizeof(bool));
+		for (interval = 0; interval < ranges[dim].count; interval++)
+			for (index = ranges[dim].lo[interval]; index < ranges[dim].hi[interval]; index++)
+				if (index >= offset[dim] && index < offset[dim] + width[dim])
+					inside[dim][index - offset[dim]] = true;
+	}
+
+	for (cell = 0; cell < cells; cell++) {
+		for (dim = 0; dim < rank; dim++)
+			if (inside[dim] && !inside[dim][position[dim]])
+				break;
+		if (dim < rank)
+			array[cell] = 0;
+
+		dim = rank;
+		while (dim > 0) {
+			dim--;
+			if (++position[dim] < width[dim])
+				break;
+			position[dim] = 0;
+		}
+	}
+
+	for (dim = 0; dim < rank; dim++)
+		if (inside[dim])
+			free(inside[dim]);
+	free(inside);
+	free(position);
+}
+
+// ranges may be NULL, or hold NULL for the queries without intervals
+static void fetch_values_batch(FileContext * file, hsize_t count, hsize_t ** offsets, hsize_t ** widths, DimConstraint ** ranges, ResultTable ** tables) {
+	hsize_t rank = file->rank;
+	hsize_t request_count, request, next, dim;
+	hsize_t read = 0, skipped = 0;
+	ChunkRequest * requests = plan_chunk_requests(file, count, offsets, widths, ranges, &request_count);
+	if (!request_count || !count_allocated_chunks(file)) {
+		if (requests)
+			free(requests);
+		return;
+	}
+
+	hsize_t * chunk = calloc(rank, sizeof(hsize_t));
+	hsize_t * chunk_offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * read_offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * read_width = calloc(rank, sizeof(hsize_t));
+	hsize_t * read_end = calloc(rank, sizeof(hsize_t));
+	hsize_t * sub_offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * sub_width = calloc(rank, sizeof(hsize_t));
+	double * buffer = alloc_ndim_array(rank, file->chunk_sizes, sizeof(double));
+	double * scratch = alloc_ndim_array(rank, file->chunk_sizes, sizeof(double));
+
+	for (request = 0; request < request_count; request = next) {
+		for (next = request + 1; next < request_count && requests[next].chunk == requests[request].chunk; next++)
+			continue;
+
+		id_to_chunk(file, requests[request].chunk, chunk);
+		if (!chunk_allocated(file, chunk, chunk_offset)) {
+			skipped++;
+			continue;
+		}
+
+		// Read the bounding box of all the queries' slices of the chunk
+		hsize_t index;
+		for (index = request; index < next; index++) {
+			hsize_t query = requests[index].query;
+			intersect_chunk(file, chunk, offsets[query], widths[query], sub_offset, sub_width);
+			for (dim = 0; dim < rank; dim++) {
+				hsize_t end = sub_offset[dim] + sub_width[dim];
+				if (index == request) {
+					read_offset[dim] = sub_offset[dim];
+					read_end[dim] = end;
+				} else {
+					if (sub_offset[dim] < read_offset[dim])
+						read_offset[dim] = sub_offset[dim];
+					if (end > read_end[dim])
+						read_end[dim] = end;
+				}
+			}
+		}
+		for (dim = 0; dim < rank; dim++)
+			read_width[dim] = read_end[dim] - read_offset[dim];
+		read_values(file, read_offset, read_width, buffer);
+		read++;
+
+		for (index = request; index < next; index++) {
+			hsize_t query = requests[index].query;
+			intersect_chunk(file, chunk, offsets[query], widths[query], sub_offset, sub_width);
+			double * slice = buffer;
+			if (next - request > 1) {
+				extract_box(rank, buffer, read_offset, read_width, scratch, sub_offset, sub_width);
+				slice = scratch;
+			}
+			if (ranges && ranges[query])
+				mask_ranges(rank, slice, sub_offset, sub_width, ranges[query]);
+			unroll_matrix(tables[query], slice, rank, sub_offset, sub_width);
+		}
+	}
+
+	if (DEBUG)
+		printf("Read %lli chunks for %lli queries, skipped %lli unallocated chunks\n", read, count, skipped);
+	free(requests);
+	free(chunk);
+	free(chunk_offset);
+	free(read_offset);
+	free(read_width);
+	free(read_end);
+	free(sub_offset);
+	free(sub_width);
+	free(buffer);
+	free(scratch);
+}
+
+////////////////////////////////////////////////////////
+// Bulk writes
+// Points are sorted by chunk, each touched chunk is 
+// assembled in memory and written whole, so that the 
+// cost follows the number of chunks, not of points
+////////////////////////////////////////////////////////
+
+typedef struct point_ref_st {
+	hsize_t chunk;
+	hsize_t index;
+} PointRef;
+
+// Ties are broken on the input order, so that the last write of a cell wins
+static int cmp_point_refs(const void * a, const void * b) {
+	PointRef * A = (PointRef *) a;
+	PointRef * B = (PointRef *) b;
+	if (A->chunk != B->chunk)
+		return A->chunk < B->chunk ? -1 : 1;
+	if (A->index != B->index)
+		return A->index < B->index ? -1 : 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////
+// Parallel chunk compression
+// When the matrix is only deflated, after an optional
+// shuffle, chunks are assembled and compressed by a pool
+// of worker threads, and the compressed buffers are
+// handed to HDF5 in chunk order with direct chunk
+// writes. Workers never call HDF5: the writing thread
+// reads existing chunks back a few jobs ahead of them.
+////////////////////////////////////////////////////////
+
+// Jobs read back ahead of the oldest unwritten one, per worker
+#define CHUNK_JOBS_AHEAD 2
+
+typedef struct chunk_job_st {
+	hsize_t * chunk_offset;
+	PointRef * refs;
+	hsize_t ref_count;
+	// Stored bytes of an existing chunk, NULL for new chunks
+	void * stored;
+	size_t stored_size;
+	unsigned stored_filter_mask;
+	// Set once stored was read back, if the chunk exists
+	bool ready;
+	// Filtered chunk, set by the worker
+	void * data;
+	size_t data_size;
+	bool done;
+} ChunkJob;
+
+typedef struct chunk_pool_st {
+	FileContext * file;
+	hsize_t ** coords;
+	double * values;
+	ChunkJob * jobs;
+	// Jobs [0, prepared) are ready
+	hsize_t job_count, next_job, prepared;
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready, job_done;
+} ChunkPool;
+
+// Same byte order as the HDF5 shuffle filter: byte b of cell i goes to b * cells + i
+static void shuffle_bytes(unsigned char * src, unsigned char * dst, hsize_t cells, size_t cell_size, bool reverse) {
+	hsize_t cell, byte;
+	for (cell = 0; cell < cells; cell++)
+		for (byte = 0; byte < cell_size; byte++) {
+			if (reverse)
+				dst[cell * cell_size + byte] = src[byte * cells + cell];
+			else
+				dst[byte * cells + cell] = src[cell * cell_size + byte];
+		}
+}
+
+static void compress_chunk(ChunkPool * pool, ChunkJob * job, double * buffer, double * scratch) {
+	FileContext * file = pool->file;
+	hsize_t rank = file->rank;
+	hsize_t cells = volume(rank, file->chunk_sizes);
+	uLongf length = cells * file->value_size;
+	// Bits of the filter mask, set when a filter was skipped on write
+	unsigned shuffle_bit = 1;
+	unsigned deflate_bit = file->shuffle ? 2 : 1;
+	hsize_t index, dim;
+
+	// Existing chunks are unfiltered and decoded, new ones start empty
+	if (!job->stored)
+		memset(buffer, 0, cells * sizeof(double));
+	else {
+		bool shuffled = file->shuffle && !(job->stored_filter_mask & shuffle_bit);
+		double * target = shuffled ? scratch : buffer;
+		if (job->stored_filter_mask & deflate_bit) {
+			if (job->stored_size != length) {
+				fprintf(stderr, "Stored chunk of %zu bytes instead of %lu\n", job->stored_size, (unsigned long) length);
+				exit(-1);
+			}
+			memcpy(target, job->stored, length);
+		} else {
+			uLongf inflated = length;
+			if (uncompress((Bytef *) target, &inflated, job->stored, job->stored_size) != Z_OK || inflated != length) {
+				fprintf(stderr, "Could not inflate stored chunk\n");
+				exit(-1);
+			}
+		}
+		if (shuffled)
+			shuffle_bytes((unsigned char *) scratch, (unsigned char *) buffer, cells, file->value_size, true);
+		decode_values(file, buffer, cells);
+	}
+
+	// Direct chunk writes always cover the full chunk, even on the edge of the matrix
+	for (index = 0; index < job->ref_count; index++) {
+		hsize_t * coord = pool->coords[job->refs[index].index];
+		hsize_t pos = 0;
+		for (dim = 0; dim < rank; dim++)
+			pos = pos * file->chunk_sizes[dim] + coord[dim] - job->chunk_offset[dim];
+		buffer[pos] = pool->values[job->refs[index].index];
+	}
+
+	encode_values(file, buffer, cells);
+	if (file->shuffle) {
+		shuffle_bytes((unsigned char *) buffer, (unsigned char *) scratch, cells, file->value_size, false);
+		buffer = scratch;
+	}
+	uLongf bound = compressBound(length);
+	job->data = malloc(bound);
+	if (compress2(job->data, &bound, (Bytef *) buffer, length, file->deflate_level) != Z_OK) {
+		fprintf(stderr, "Could not deflate chunk\n");
+		exit(-1);
+	}
+	job->data_size = bound;
+}
+
+static void * chunk_worker(void * arg) {
+	ChunkPool * pool = (ChunkPool *) arg;
+	double * buffer = alloc_ndim_array(pool->file->rank, pool->file->chunk_sizes, sizeof(double));
+	double * scratch = alloc_ndim_array(pool->file->rank, pool->file->chunk_sizes, sizeof(double));
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		hsize_t job = pool->next_job++;
+		while (job < pool->job_count && !pool->jobs[job].ready)
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+		if (job >= pool->job_count)
+			break;
+
+		compress_chunk(pool, pool->jobs + job, buffer, scratch);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->jobs[job].done = true;
+		pthread_cond_broadcast(&pool->job_done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	free(buffer);
+	free(scratch);
+	return NULL;
+}
+
+// Lists one job per touched chunk
+static ChunkJob * plan_chunk_jobs(FileContext * file, PointRef * refs, hsize_t count, hsize_t * job_count) {
+	hsize_t ref, next, capacity = 0;
+	ChunkJob * jobs = NULL;
+	*job_count = 0;
+
+	for (ref = 0; ref < count; ref = next) {
+		for (next = ref + 1; next < count && refs[next].chunk == refs[ref].chunk; next++)
+			continue;
+		if (*job_count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			jobs = realloc(jobs, capacity * sizeof(ChunkJob));
+		}
+		ChunkJob * job = jobs + (*job_count)++;
+		memset(job, 0, sizeof(ChunkJob));
+		job->chunk_offset = calloc(file->rank, sizeof(hsize_t));
+		job->refs = refs + ref;
+		job->ref_count = next - ref;
+	}
+	return jobs;
+}
+
+// Reads back the stored bytes of the chunk of a job, if it exists
+static void read_stored_chunk(FileContext * file, ChunkJob * job, hsize_t * chunk) {
+	id_to_chunk(file, job->refs[0].chunk, chunk);
+	if (chunk_allocated(file, chunk, job->chunk_offset)) {
+		hsize_t size;
+		uint32_t filter_mask;
+		VERIFY(H5Dget_chunk_storage_size(file->matrix, job->chunk_offset, &size));
+		job->stored = malloc(size);
+		job->stored_size = size;
+		// The filters are optional, HDF5 may have skipped some of them
+		VERIFY(H5Dread_chunk(file->matrix, H5P_DEFAULT, job->chunk_offset, &filter_mask, job->stored));
+		job->stored_filter_mask = filter_mask;
 	}
-	table->coords[write_index] = vector;
 }
 
-static void unroll_matrix_recursive(double ** reader_ptr, hsize_t rank, hsize_t* width, ResultTable * table, hsize_t * offset, hsize_t current_dim, hsize_t * write_index) {
-	hsize_t index;
-	if (current_dim == rank - 1) {
-		for (index = 0; index < width[current_dim]; index++) {
-			if (**reader_ptr) {
-				enter_new_data_point(table, rank, *write_index, offset, **reader_ptr);
-				(*write_index)++;
-			}
-			(*reader_ptr)++;
-			offset[current_dim]++;
+static void store_chunks_in_parallel(FileContext * file, PointRef * refs, hsize_t count, hsize_t ** coords, double * values) {
+	ChunkPool pool;
+	hsize_t job, merged = 0;
+	int thread;
+
+	pool.file = file;
+	pool.coords = coords;
+	pool.values = values;
+	pool.next_job = 0;
+	pool.prepared = 0;
+	pool.jobs = plan_chunk_jobs(file, refs, count, &pool.job_count);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.job_ready, NULL);
+	pthread_cond_init(&pool.job_done, NULL);
+	hsize_t * chunk = calloc(file->rank, sizeof(hsize_t));
+	hsize_t ahead = CHUNK_JOBS_AHEAD * file->threads;
+
+	clock_t start = clock();
+	pthread_t * threads = calloc(file->threads, sizeof(pthread_t));
+	for (thread = 0; thread < file->threads; thread++)
+		if (pthread_create(threads + thread, NULL, &chunk_worker, &pool)) {
+			fprintf(stderr, "Could not start worker thread\n");
+			exit(-1);
 		}
-	} else {
-		for (index = 0; index < width[current_dim]; index++) {
-			unroll_matrix_recursive(reader_ptr, rank, width, table, offset, current_dim + 1, write_index);
-			offset[current_dim+1] -= width[current_dim+1];
-			offset[current_dim]++;
+
+	// Chunks are written in order as soon as they are ready. Existing
+	// chunks are read back in between, a bounded number of jobs ahead
+	for (job = 0; job < pool.job_count; job++) {
+		ChunkJob * current = pool.jobs + job;
+		while (pool.prepared < pool.job_count && pool.prepared < job + ahead) {
+			ChunkJob * next = pool.jobs + pool.prepared;
+			read_stored_chunk(file, next, chunk);
+			pthread_mutex_lock(&pool.lock);
+			next->ready = true;
+			pool.prepared++;
+			pthread_cond_broadcast(&pool.job_ready);
+			pthread_mutex_unlock(&pool.lock);
 		}
+		pthread_mutex_lock(&pool.lock);
+		while (!current->done)
+			pthread_cond_wait(&pool.job_done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		VERIFY(H5Dwrite_chunk(file->matrix, H5P_DEFAULT, 0, current->chunk_offset, current->data_size, current->data));
+		if (current->stored)
+			merged++;
+		free(current->data);
+		free(current->stored);
+		free(current->chunk_offset);
 	}
-}
 
-static ResultTable * newResultTable(double * array, hsize_t rank, hsize_t * offset, hsize_t* width, bool * set_dims) {
-	ResultTable * table = calloc(1, sizeof(ResultTable));
-	hsize_t width_rank = count_width_rank(rank, set_dims);
-	table->columns = width_rank;
-	table->dims = projected_dims(rank, width_rank, set_dims);
-	table->rows = count_non_zero_values(array, rank, width);
-	if (table->rows) {
-		table->coords = calloc(table->rows, sizeof(hsize_t*));
-		table->values = calloc(table->rows, sizeof(double));
+	for (thread = 0; thread < file->threads; thread++)
+		pthread_join(threads[thread], NULL);
+	if (DEBUG) {
+		printf("Compressed %lli chunks on %i threads, %lli of which were merged with existing data\n", pool.job_count, file->threads, merged);
+		printf("<<< HDF5 WRITE TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
 	}
-	return table;
+
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.job_ready);
+	pthread_cond_destroy(&pool.job_done);
+	free(threads);
+	free(chunk);
+	free(pool.jobs);
 }
 
-static ResultTable * unroll_matrix(double * array, hsize_t rank, hsize_t * offset, hsize_t* width, bool * set_dims) {
-	ResultTable * table = newResultTable(array, rank, offset, width, set_dims);
-	// We are about to start a recursion, defining a bunch of variables here
-	hsize_t write_index = 0;
-	hsize_t * offset2 = calloc(rank, sizeof(hsize_t));
-	hsize_t dim;
+static void store_values_in_matrix(FileContext * file, hsize_t count, hsize_t ** coords, double * values) {
+	hsize_t rank = file->rank;
+	hsize_t index, dim, ref, next;
+	hsize_t assembled = 0, merged = 0;
+	if (!count)
+		return;
+
+	PointRef * refs = calloc(count, sizeof(PointRef));
+	hsize_t * chunk = calloc(rank, sizeof(hsize_t));
+	hsize_t * chunk_offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * box_width = calloc(rank, sizeof(hsize_t));
+	for (index = 0; index < count; index++) {
+		for (dim = 0; dim < rank; dim++)
+			chunk[dim] = coords[index][dim] / file->chunk_sizes[dim];
+		refs[index].chunk = chunk_to_id(file, chunk);
+		refs[index].index = index;
+	}
+	qsort(refs, count, sizeof(PointRef), &cmp_point_refs);
+
+	if (file->deflate_level && file->threads > 1) {
+		store_chunks_in_parallel(file, refs, count, coords, values);
+		free(refs);
+		free(chunk);
+		free(chunk_offset);
+		free(box_width);
+		return;
+	}
 
-	for (dim = 0; dim < rank; dim++)
-		offset2[dim] = offset[dim];
-	double * reader_ptr = array;
-	unroll_matrix_recursive(&reader_ptr, rank, width, table, offset2, 0, &write_index);
-	free(offset2);
-	return table;
-}
+	double * buffer = alloc_ndim_array(rank, file->chunk_sizes, sizeof(double));
+	clock_t start = clock();
+	for (ref = 0; ref < count; ref = next) {
+		for (next = ref + 1; next < count && refs[next].chunk == refs[ref].chunk; next++)
+			continue;
+
+		// Chunks on the edge of the matrix are truncated
+		id_to_chunk(file, refs[ref].chunk, chunk);
+		for (dim = 0; dim < rank; dim++) {
+			chunk_offset[dim] = chunk[dim] * file->chunk_sizes[dim];
+			box_width[dim] = file->chunk_sizes[dim];
+			if (chunk_offset[dim] + box_width[dim] > file->dim_sizes[dim])
+				box_width[dim] = file->dim_sizes[dim] - chunk_offset[dim];
+		}
 
-static void destroy_result_table(ResultTable * table) {
-	int row;
-	if (table->rows) {
-		for (row = 0; row < table->rows; row++)
-			free(table->coords[row]);
-		free(table->coords);
+		// Existing chunks are read back, new ones start empty
+		if (chunk_allocated(file, chunk, chunk_offset)) {
+			read_values(file, chunk_offset, box_width, buffer);
+			merged++;
+		} else
+			memset(buffer, 0, volume(rank, box_width) * sizeof(double));
+
+		for (index = ref; index < next; index++) {
+			hsize_t * coord = coords[refs[index].index];
+			hsize_t pos = 0;
+			for (dim = 0; dim < rank; dim++)
+				pos = pos * box_width[dim] + coord[dim] - chunk_offset[dim];
+			buffer[pos] = values[refs[index].index];
+		}
+
+		VERIFY(H5Sselect_hyperslab(file->matrix_space, H5S_SELECT_SET, chunk_offset, NULL, box_width, NULL));
+		hid_t memspace = H5Screate_simple(rank, box_width, NULL);
+		VERIFY(memspace);
+		encode_values(file, buffer, volume(rank, box_width));
+		VERIFY(H5Dwrite(file->matrix, file->value_type, memspace, file->matrix_space, H5P_DEFAULT, buffer));
+		VERIFY(H5Sclose(memspace));
+		assembled++;
 	}
-	free(table);
+	if (DEBUG) {
+		printf("Wrote %lli points in %lli chunks, %lli of which were merged with existing data\n", count, assembled, merged);
+		printf("<<< HDF5 WRITE TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
+	}
+
+	free(buffer);
+	free(refs);
+	free(chunk);
+	free(chunk_offset);
+	free(box_width);
 }
 
 ////////////////////////////////////////////////////////
 // StringResultTable operations
 ////////////////////////////////////////////////////////
 
-static char ** stringify_dim_names(hid_t file, ResultTable * table, StringArray * dim_names) {
+static char ** stringify_dim_names(ResultTable * table, StringArray * dim_names) {
 	if (!table->columns || !table->rows)
 		return NULL;
 
@@ -966,41 +3186,47 @@ static char ** stringify_dim_names(hid_t file, ResultTable * table, StringArray
 	return res;
 }
 
-static char *** stringify_coords(hid_t file, ResultTable * table, hsize_t * offset, StringArray ** dim_labels) {
-	if (!table->rows || !table->columns)
+static hsize_t * stringify_label_offsets(ResultTable * table, hsize_t * offset) {
+	if (!table->columns)
 		return NULL;
 
-	char *** coords = calloc(table->rows, sizeof(char **));
-	hsize_t row, dim;
-
-	for (row = 0; row < table->rows; row++) {
-		coords[row] = calloc(table->columns, sizeof(char **));
-		for (dim = 0; dim < table->columns; dim++) {
-			coords[row][dim] = get_string_in_array(dim_labels[dim], table->coords[row][dim] - offset[table->dims[dim]]);
-			if (DEBUG)
-				printf("Converting dim %lli:%lli => %s\n", dim, table->coords[row][dim], coords[row][dim]);
-	
-			if (coords[row][dim] == '\0')
-				abort();
-		}
-	}
-
-	return coords;
+	hsize_t * res = calloc(table->columns, sizeof(hsize_t));
+	hsize_t column;
+	for (column = 0; column < table->columns; column++)
+		res[column] = offset[table->dims[column]];
+	return res;
 }
 
-static StringResultTable * stringify_result_table(hid_t file, hsize_t * offset, hsize_t * width, ResultTable * table) {
+// The index columns, values and dims are handed over to the string 
+// table, so that no data is copied
+static StringResultTable * stringify_result_table(FileContext * file, hsize_t * offset, hsize_t * width, ResultTable * table) {
 	StringResultTable * res = calloc(1, sizeof(StringResultTable));	
 	res->dim_indices = table->dims;
 	res->rows = table->rows;
 	res->columns = table->columns;
-	res->dim_names = get_dim_names(file);
-	res->dims = stringify_dim_names(file, table, res->dim_names);
+	res->dim_names = file->dim_names;
+	res->dims = stringify_dim_names(table, res->dim_names);
 	res->dim_labels = get_table_dims_labels(file, table, offset, width); 
-	res->coords  = stringify_coords(file, table, offset, res->dim_labels);
+	res->dim_meta = get_table_dims_meta(file, table->columns, table->dims, offset, width);
+	res->label_offsets = stringify_label_offsets(table, offset);
+	res->indices = table->indices;
 	res->values = table->values;
+	table->indices = NULL;
+	table->values = NULL;
+	table->dims = NULL;
 	return res;
 }
 
+char * get_result_label(StringResultTable * table, hsize_t column, hsize_t row) {
+	return get_string_in_array(table->dim_labels[column], table->indices[column][row] - table->label_offsets[column]);
+}
+
+DimMeta * get_result_meta(StringResultTable * table, hsize_t column, hsize_t row) {
+	if (!table->dim_meta || !table->dim_meta[column])
+		return NULL;
+	return table->dim_meta[column] + table->indices[column][row] - table->label_offsets[column];
+}
+
 ////////////////////////////////////////////////////////
 // Public functions
 ////////////////////////////////////////////////////////
@@ -1021,7 +3247,7 @@ static int cmp_dims(const void * a, const void * b) {
 		return A->original - B->original;
 }
 
-hid_t create_file(char * filename, hsize_t rank, char ** dim_names, hsize_t * dim_sizes, hsize_t * dim_label_lengths, hsize_t * chunk_sizes) {
+FileContext * create_file(char * filename, hsize_t rank, char ** dim_names, hsize_t * dim_sizes, hsize_t * dim_label_lengths, hsize_t * chunk_sizes, FileOptions * options) {
 	hsize_t dim;
 	if (DEBUG) {
 		printf(">>>>>>>>>>>>>>> CREATING FILE %s WITH RANK %lli:\n", filename, rank);
@@ -1056,81 +3282,271 @@ hid_t create_file(char * filename, hsize_t rank, char ** dim_names, hsize_t * di
 	}
 	free(dims);
 	
+	FileOptions storage_options;
+	if (options) {
+		storage_options = *options;
+		storage_options.storage = available_storage(options->storage);
+		options = &storage_options;
+	}
+
 	hid_t file = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
 	VERIFY(file);
 	store_dim_names(file, rank, dim_names);
-	create_all_dim_label_tables(file, rank, dim_sizes, dim_label_lengths);
-	create_matrix(file, rank, dim_sizes, chunk_sizes);
+	create_all_dim_label_tables(file, rank, dim_sizes, dim_label_lengths, options);
+	create_matrix(file, rank, dim_sizes, chunk_sizes, options);
 	set_file_core_rank(file, core_rank);
-	create_boundaries(file, rank, core_rank, dim_sizes);
-	return file;
+	create_boundaries(file, rank, core_rank, dim_sizes, options);
+	return new_file_context(file, false, options);
+}
+
+////////////////////////////////////////////////////////
+// Write staging
+// Points are copied into an arena, and written in one
+// bulk write once it is full. The last write of a cell
+// wins, earlier ones are dropped before the write
+////////////////////////////////////////////////////////
+
+static void flush_staged_values(FileContext * file) {
+	hsize_t rank = file->rank;
+	hsize_t index, dim, unique = 0;
+	if (!file->staged)
+		return;
+
+	// Sorted by cell, then by input order
+	PointRef * refs = calloc(file->staged, sizeof(PointRef));
+	for (index = 0; index < file->staged; index++) {
+		hsize_t * coord = file->staged_coords + index * rank;
+		refs[index].chunk = 0;
+		for (dim = 0; dim < rank; dim++)
+			refs[index].chunk = refs[index].chunk * file->dim_sizes[dim] + coord[dim];
+		refs[index].index = index;
+	}
+	qsort(refs, file->staged, sizeof(PointRef), &cmp_point_refs);
+
+	hsize_t ** coords = calloc(file->staged, sizeof(hsize_t *));
+	double * values = calloc(file->staged, sizeof(double));
+	for (index = 0; index < file->staged; index++) {
+		if (index + 1 < file->staged && refs[index + 1].chunk == refs[index].chunk)
+			continue;
+		coords[unique] = file->staged_coords + refs[index].index * rank;
+		values[unique] = file->staged_values[refs[index].index];
+		unique++;
+	}
+	if (DEBUG)
+		printf("Flushing %lli staged points, %lli distinct cells\n", file->staged, unique);
+
+	store_values_in_matrix(file, unique, coords, values);
+	set_boundaries(file, unique, coords);
+	file->staged = 0;
+	free(refs);
+	free(coords);
+	free(values);
+}
+
+static void stage_values(FileContext * file, hsize_t count, hsize_t ** coords, double * values) {
+	hsize_t index;
+	for (index = 0; index < count; index++) {
+		if (file->staged == file->staging_capacity)
+			flush_staged_values(file);
+		// The arena grows up to the budget
+		if (file->staged == file->staged_allocated) {
+			file->staged_allocated = file->staged_allocated ? 2 * file->staged_allocated : 4096;
+			if (file->staged_allocated > file->staging_capacity)
+				file->staged_allocated = file->staging_capacity;
+			file->staged_coords = realloc(file->staged_coords, file->staged_allocated * file->rank * sizeof(hsize_t));
+			file->staged_values = realloc(file->staged_values, file->staged_allocated * sizeof(double));
+		}
+		memcpy(file->staged_coords + file->staged * file->rank, coords[index], file->rank * sizeof(hsize_t));
+		file->staged_values[file->staged] = values[index];
+		file->staged++;
+	}
+}
+
+static hsize_t find_dim(FileContext * file, char * dim_name) {
+	hsize_t dim;
+	for (dim = 0; dim < file->rank; dim++)
+		if (!strcmp(dim_name, get_string_in_array(file->dim_names, dim)))
+			return dim;
+
+	printf("Could not find dimension named %s, exiting\n", dim_name);
+	abort();
 }
 
-void store_dim_labels(hid_t file, char * dim_name, hsize_t dim_size, char ** strings) {
+void store_dim_labels(FileContext * file, char * dim_name, hsize_t dim_size, char ** strings) {
 	hsize_t dim;
 	if (DEBUG) {
-		printf(">>>>>>>>>>>>>>> STORE %lli DIM LABEL(S) FOR DIM %s IN FILE %li:\n", dim_size, dim_name, file);
+		printf(">>>>>>>>>>>>>>> STORE %lli DIM LABEL(S) FOR DIM %s IN FILE %li:\n", dim_size, dim_name, file->file);
 		if (DEBUG > 1) {
 			for (dim = 0; dim < dim_size; dim++)
 				printf("%lli:\t%s\n", dim, strings[dim]);
 		}
 	}
-	hsize_t rank = get_file_rank(file);
 	fflush(stdout);
-	// TODO This could be replaced by a HDF5 attribute
-	StringArray * dim_names = get_dim_names(file);
-	for (dim = 0; dim < rank; dim++) {
-		if (!strcmp(dim_name, get_string_in_array(dim_names, dim))) {
-			store_dim_labels_in_table(file, dim, dim_size, strings);
-			destroy_string_array(dim_names);
-			return;
-		}
+	append_dim_labels(file, find_dim(file, dim_name), dim_size, strings);
+}
+
+static void extend_dataset_rows(hid_t dataset, hsize_t rows) {
+	hsize_t shape[3];
+	hid_t dataspace = H5Dget_space(dataset);
+	VERIFY(dataspace);
+	VERIFY(H5Sget_simple_extent_dims(dataspace, shape, NULL));
+	VERIFY(H5Sclose(dataspace));
+	shape[0] = rows;
+	VERIFY(H5Dset_extent(dataset, shape));
+}
+
+void extend_dimension(FileContext * file, char * dim_name, hsize_t count, char ** labels) {
+	hsize_t dim = find_dim(file, dim_name);
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> EXTEND DIM %s BY %lli IN FILE %li\n", dim_name, count, file->file);
+
+	if (file->readonly) {
+		printf("Cannot extend dimension %s of a read-only file\n", dim_name);
+		abort();
+	}
+	hsize_t * max_dim_sizes = calloc(file->rank, sizeof(hsize_t));
+	VERIFY(H5Sget_simple_extent_dims(file->matrix_space, NULL, max_dim_sizes));
+	if (max_dim_sizes[dim] != H5S_UNLIMITED) {
+		printf("Dimension %s was created with a fixed size\n", dim_name);
+		abort();
+	}
+	free(max_dim_sizes);
+	flush_staged_values(file);
+	flush_label_buffer(file, dim);
+	if (get_label_buffer(file, dim)->stored != file->dim_sizes[dim]) {
+		printf("All %lli labels of dimension %s must be stored before extending it\n", file->dim_sizes[dim], dim_name);
+		abort();
 	}
 
-	printf("Could not find dimension named %s, exiting\n", dim_name);
-	abort();
+	// The boundary cache of the dimension is sized by its length
+	flush_boundaries(file);
+	if (file->boundary_caches[dim]) {
+		destroy_boundary_cache(file->boundary_caches[dim]);
+		file->boundary_caches[dim] = NULL;
+	}
+
+	// Existing chunks stay where they are, the new cells read as zeros
+	file->dim_sizes[dim] += count;
+	VERIFY(H5Dset_extent(file->matrix, file->dim_sizes));
+	VERIFY(H5Sclose(file->matrix_space));
+	file->matrix_space = H5Dget_space(file->matrix);
+	VERIFY(file->matrix_space);
+	// Variable length tables grow as labels are written
+	if (!file->label_offset_datasets[dim])
+		extend_dataset_rows(file->label_datasets[dim], file->dim_sizes[dim]);
+	if (dim >= file->rank - file->core_rank)
+		extend_dataset_rows(file->boundary_datasets[dim], file->dim_sizes[dim]);
+
+	append_dim_labels(file, dim, count, labels);
+}
+
+void store_dim_meta(FileContext * file, char * dim_name, hsize_t count, DimMeta * meta) {
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> STORE %lli METADATA ROW(S) FOR DIM %s IN FILE %li\n", count, dim_name, file->file);
+	if (file->readonly) {
+		printf("Cannot store metadata of dimension %s into a read-only file\n", dim_name);
+		abort();
+	}
+	append_dim_meta(file, find_dim(file, dim_name), count, meta);
 }
 
-void store_values(hid_t file, hsize_t count, hsize_t ** coords, double * values) {
+// Chunk ids and buffer offsets are computed from the coordinates, which must be in bounds
+static void check_coords(FileContext * file, hsize_t count, hsize_t ** coords) {
+	hsize_t index, dim;
+	for (index = 0; index < count; index++) {
+		for (dim = 0; dim < file->rank; dim++) {
+			if (coords[index][dim] >= file->dim_sizes[dim]) {
+				printf("Coordinate %lli out of bounds on dimension %s of size %lli\n", coords[index][dim], get_string_in_array(file->dim_names, dim), file->dim_sizes[dim]);
+				abort();
+			}
+		}
+	}
+}
+
+void store_values(FileContext * file, hsize_t count, hsize_t ** coords, double * values) {
 	if (DEBUG) {
 		printf(">>>>>>>>>>>>>>> STORING %lli DATAPOINTS\n", count);
 		if (DEBUG > 1) {
 		hsize_t index;
-		hsize_t rank = get_file_rank(file);
 		for (index = 0; index < count; index++) {
 				int dim;
-				for (dim = 0; dim < rank; dim++) 
+				for (dim = 0; dim < file->rank; dim++) 
 					printf("\t%i = %lli", dim, coords[index][dim]);
 				printf("\tvalue = %lf\n", values[index]);
 			}
 		}
 	}
+	check_coords(file, count, coords);
+	if (file->staging_capacity) {
+		stage_values(file, count, coords, values);
+		return;
+	}
 	store_values_in_matrix(file, count, coords, values);
 	set_boundaries(file, count, coords);
 }
 
-hid_t open_file(char * filename, int readonly) {
+void store_values_packed(FileContext * file, hsize_t count, hsize_t * coords, double * values) {
+	// Row pointers into the packed coordinates, nothing is copied
+	hsize_t ** rows = calloc(count, sizeof(hsize_t *));
+	hsize_t index;
+	for (index = 0; index < count; index++)
+		rows[index] = coords + index * file->rank;
+	store_values(file, count, rows, values);
+	free(rows);
+}
+
+FileContext * open_file(char * filename, int readonly, FileOptions * options) {
 	if (DEBUG)
 		printf(">>>>>>>>>>>>>>> OPENING FILE %s\n", filename);
+	hid_t file;
 	if (readonly)
-		return H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+		file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
 	else
-		return H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
+		file = H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
+	VERIFY(file);
+	return new_file_context(file, readonly, options);
+}
+
+// Looks up a fully constrained cell without touching the
+// boundaries or the labels
+static StringResultTable * fetch_single_value(FileContext * file, bool * set_dims, hsize_t * constraints, ValueFilter * filter) {
+	hsize_t rank = file->rank;
+	hsize_t * width = calloc(rank, sizeof(hsize_t));
+	hsize_t dim;
+	for (dim = 0; dim < rank; dim++)
+		width[dim] = 1;
+	double value = get_value(file, constraints);
+
+	ResultTable * table = new_result_table(rank, set_dims);
+	table->filter = filter;
+	unroll_matrix(table, &value, rank, constraints, width);
+	StringResultTable * res = stringify_result_table(file, constraints, width, table);
+	destroy_result_table(table);
+	free(width);
+	return res;
 }
 
-StringResultTable * fetch_string_values(hid_t file, bool * set_dims, hsize_t * constraints) {
-	hsize_t rank = get_file_rank(file);
+StringResultTable * fetch_string_values(FileContext * file, bool * set_dims, hsize_t * constraints, ValueFilter * filter) {
+	flush_staged_values(file);
+	hsize_t rank = file->rank;
 	if (DEBUG) {
-		printf(">>>>>>>>>>>>>>> FETCHING STRING VALUES FROM FILE %li:\n", file);
+		printf(">>>>>>>>>>>>>>> FETCHING STRING VALUES FROM FILE %li:\n", file->file);
 		hid_t dim;
 		for (dim = 0; dim < rank; dim++)
 			if (set_dims[dim])
 				printf("%li = %lli\n", dim, constraints[dim]);
 	}
+	hsize_t dim;
+	for (dim = 0; dim < rank; dim++)
+		if (!set_dims[dim])
+			break;
+	if (dim == rank)
+		return fetch_single_value(file, set_dims, constraints, filter);
+
 	hsize_t * offset = calloc(rank, sizeof(hsize_t));
 	hsize_t * width = calloc(rank, sizeof(hsize_t));
 
-	if (set_query_parameters(file, rank, set_dims, constraints, offset, width))
+	if (set_query_parameters(file, set_dims, constraints, offset, width))
 		return NULL;
 
 	if (DEBUG) {
@@ -1141,12 +3557,9 @@ StringResultTable * fetch_string_values(hid_t file, bool * set_dims, hsize_t * c
 		puts(") values;");
 	}
 
-	double * array = fetch_values(file, offset, width);
-
-	ResultTable * table = unroll_matrix(array, rank, offset, width, set_dims);
+	ResultTable * table = fetch_values(file, offset, width, set_dims, filter);
 	if (DEBUG) 
 		printf("Found %lli values\n", table->rows);
-	free(array);
 	StringResultTable * res = stringify_result_table(file, offset, width, table);
 	destroy_result_table(table);
 	free(offset);
@@ -1156,24 +3569,378 @@ StringResultTable * fetch_string_values(hid_t file, bool * set_dims, hsize_t * c
 	return res;
 } 
 
+double get_value(FileContext * file, hsize_t * coords) {
+	double value;
+	get_values(file, 1, &coords, &value);
+	return value;
+}
+
+void get_values(FileContext * file, hsize_t count, hsize_t ** coords, double * values) {
+	flush_staged_values(file);
+	hsize_t rank = file->rank;
+	hsize_t index;
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> GETTING %lli VALUES FROM FILE %li\n", count, file->file);
+	if (!count)
+		return;
+
+	// One element selection for all the points, cells in unallocated chunks read as 0
+	hsize_t * points = malloc(count * rank * sizeof(hsize_t));
+	for (index = 0; index < count; index++)
+		memcpy(points + index * rank, coords[index], rank * sizeof(hsize_t));
+	VERIFY(H5Sselect_elements(file->matrix_space, H5S_SELECT_SET, count, points));
+	hid_t memspace = H5Screate_simple(1, &count, NULL);
+	VERIFY(memspace);
+	clock_t start = clock();
+	VERIFY(H5Dread(file->matrix, file->value_type, memspace, file->matrix_space, H5P_DEFAULT, values));
+	decode_values(file, values, count);
+	if (DEBUG)
+		printf("<<< HDF5 READ TIME\t%lf\n", ((double) (clock() - start)) / CLOCKS_PER_SEC);
+	VERIFY(H5Sclose(memspace));
+	free(points);
+}
+
+// Only the labels spanned by the batch are read
+static void batch_label_bounds(FileContext * file, ResultTable * batch, hsize_t * offset, hsize_t * width) {
+	hsize_t column, row;
+	for (column = 0; column < batch->columns; column++) {
+		hsize_t * indices = batch->indices[column];
+		hsize_t min = indices[0], max = indices[0];
+		for (row = 1; row < batch->rows; row++) {
+			if (indices[row] < min)
+				min = indices[row];
+			else if (indices[row] > max)
+				max = indices[row];
+		}
+		offset[batch->dims[column]] = min;
+		width[batch->dims[column]] = max - min + 1;
+	}
+}
+
+// Dimensions pinned to a single value are left out of the results, except kept_dim
+static bool * range_set_dims(FileContext * file, DimConstraint * constraints, hsize_t kept_dim) {
+	bool * set_dims = calloc(file->rank, sizeof(bool));
+	hsize_t dim;
+	for (dim = 0; dim < file->rank; dim++)
+		set_dims[dim] = dim != kept_dim && constraints[dim].count == 1 && constraints[dim].hi[0] - constraints[dim].lo[0] == 1;
+	return set_dims;
+}
+
+// Either set_dims and constraints, or ranges, describe the queries
+static StringResultTable ** fetch_batch(FileContext * file, hsize_t count, bool ** set_dims, hsize_t ** constraints, DimConstraint ** ranges) {
+	flush_staged_values(file);
+	hsize_t rank = file->rank;
+	hsize_t query;
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> FETCHING %lli BATCHED QUERIES FROM FILE %li\n", count, file->file);
+
+	hsize_t ** offsets = calloc(count, sizeof(hsize_t *));
+	hsize_t ** widths = calloc(count, sizeof(hsize_t *));
+	ResultTable ** tables = calloc(count, sizeof(ResultTable *));
+	StringResultTable ** res = calloc(count, sizeof(StringResultTable *));
+
+	// Queries with invalid constraints are left out, and get a NULL result
+	for (query = 0; query < count; query++) {
+		offsets[query] = calloc(rank, sizeof(hsize_t));
+		widths[query] = calloc(rank, sizeof(hsize_t));
+		bool invalid;
+		if (ranges)
+			invalid = set_range_query_parameters(file, ranges[query], offsets[query], widths[query]);
+		else
+			invalid = set_query_parameters(file, set_dims[query], constraints[query], offsets[query], widths[query]);
+		if (invalid) {
+			free(offsets[query]);
+			free(widths[query]);
+			offsets[query] = NULL;
+			widths[query] = NULL;
+		} else if (ranges) {
+			bool * query_set_dims = range_set_dims(file, ranges[query], rank);
+			tables[query] = new_result_table(rank, query_set_dims);
+			free(query_set_dims);
+		} else
+			tables[query] = new_result_table(rank, set_dims[query]);
+	}
+
+	fetch_values_batch(file, count, offsets, widths, ranges, tables);
+
+	for (query = 0; query < count; query++) {
+		if (!tables[query])
+			continue;
+		// Labels are only read between the extreme hits of each column
+		if (ranges && tables[query]->rows)
+			batch_label_bounds(file, tables[query], offsets[query], widths[query]);
+		res[query] = stringify_result_table(file, offsets[query], widths[query], tables[query]);
+		destroy_result_table(tables[query]);
+		free(offsets[query]);
+		free(widths[query]);
+	}
+	free(offsets);
+	free(widths);
+	free(tables);
+	return res;
+}
+
+StringResultTable ** fetch_string_values_batch(FileContext * file, hsize_t count, bool ** set_dims, hsize_t ** constraints) {
+	return fetch_batch(file, count, set_dims, constraints, NULL);
+}
+
+StringResultTable ** fetch_string_values_batch_ranges(FileContext * file, hsize_t count, DimConstraint ** constraints) {
+	return fetch_batch(file, count, NULL, NULL, constraints);
+}
+
+////////////////////////////////////////////////////////
+// Cursors
+// Hits are pulled one allocated chunk at a time and
+// handed out in batches, so that memory use is bounded
+// by the batch size and chunk size, not the result size
+////////////////////////////////////////////////////////
+
+struct cursor_st {
+	FileContext * file;
+	ChunkScan * scan;
+	// Hits read from the file but not yet returned
+	ResultTable * pending;
+	hsize_t pending_row;
+	// Copy of the intervals of open_cursor_ranges, NULL otherwise
+	DimConstraint * ranges;
+};
+
+Cursor * open_cursor(FileContext * file, bool * set_dims, hsize_t * constraints) {
+	flush_staged_values(file);
+	hsize_t rank = file->rank;
+	if (DEBUG) {
+		printf(">>>>>>>>>>>>>>> OPENING CURSOR ON FILE %li:\n", file->file);
+		hid_t dim;
+		for (dim = 0; dim < rank; dim++)
+			if (set_dims[dim])
+				printf("%li = %lli\n", dim, constraints[dim]);
+	}
+	hsize_t * offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * width = calloc(rank, sizeof(hsize_t));
+
+	if (set_query_parameters(file, set_dims, constraints, offset, width)) {
+		free(offset);
+		free(width);
+		return NULL;
+	}
+
+	Cursor * cursor = calloc(1, sizeof(Cursor));
+	cursor->file = file;
+	cursor->scan = new_chunk_scan(file, offset, width, NULL);
+	cursor->pending = new_result_table(rank, set_dims);
+	free(offset);
+	free(width);
+	return cursor;
+}
+
+Cursor * open_cursor_ranges(FileContext * file, DimConstraint * constraints) {
+	flush_staged_values(file);
+	hsize_t rank = file->rank;
+	hsize_t dim;
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> OPENING CURSOR IN RANGES ON FILE %li\n", file->file);
+	hsize_t * offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * width = calloc(rank, sizeof(hsize_t));
+
+	if (set_range_query_parameters(file, constraints, offset, width)) {
+		free(offset);
+		free(width);
+		return NULL;
+	}
+
+	// The scan borrows the intervals, which must outlive the caller's
+	Cursor * cursor = calloc(1, sizeof(Cursor));
+	cursor->file = file;
+	cursor->ranges = calloc(rank, sizeof(DimConstraint));
+	for (dim = 0; dim < rank; dim++) {
+		hsize_t count = constraints[dim].count;
+		cursor->ranges[dim].count = count;
+		if (!count)
+			continue;
+		cursor->ranges[dim].lo = malloc(count * sizeof(hsize_t));
+		cursor->ranges[dim].hi = malloc(count * sizeof(hsize_t));
+		memcpy(cursor->ranges[dim].lo, constraints[dim].lo, count * sizeof(hsize_t));
+		memcpy(cursor->ranges[dim].hi, constraints[dim].hi, count * sizeof(hsize_t));
+	}
+	cursor->scan = new_chunk_scan(file, offset, width, cursor->ranges);
+	bool * set_dims = range_set_dims(file, constraints, rank);
+	cursor->pending = new_result_table(rank, set_dims);
+	free(set_dims);
+	free(offset);
+	free(width);
+	return cursor;
+}
+
+// Drops the rows which were already returned
+static void compact_pending(Cursor * cursor) {
+	ResultTable * pending = cursor->pending;
+	if (!cursor->pending_row)
+		return;
+	hsize_t remaining = pending->rows - cursor->pending_row;
+	hsize_t column;
+	for (column = 0; column < pending->columns; column++)
+		memmove(pending->indices[column], pending->indices[column] + cursor->pending_row, remaining * sizeof(hsize_t));
+	memmove(pending->values, pending->values + cursor->pending_row, remaining * sizeof(double));
+	pending->rows = remaining;
+	cursor->pending_row = 0;
+}
+
+// Copies the next count pending rows into a table of their own
+static ResultTable * take_pending_rows(Cursor * cursor, hsize_t count) {
+	ResultTable * pending = cursor->pending;
+	ResultTable * batch = calloc(1, sizeof(ResultTable));
+	batch->rows = count;
+	batch->capacity = count;
+	batch->columns = pending->columns;
+	if (batch->columns) {
+		batch->dims = calloc(batch->columns, sizeof(hsize_t));
+		memcpy(batch->dims, pending->dims, batch->columns * sizeof(hsize_t));
+		batch->indices = calloc(batch->columns, sizeof(hsize_t *));
+	}
+	if (!count)
+		return batch;
+
+	hsize_t column;
+	for (column = 0; column < batch->columns; column++) {
+		batch->indices[column] = malloc(count * sizeof(hsize_t));
+		memcpy(batch->indices[column], pending->indices[column] + cursor->pending_row, count * sizeof(hsize_t));
+	}
+	batch->values = malloc(count * sizeof(double));
+	memcpy(batch->values, pending->values + cursor->pending_row, count * sizeof(double));
+	cursor->pending_row += count;
+	return batch;
+}
+
+StringResultTable * cursor_next(Cursor * cursor, hsize_t batch_size) {
+	ResultTable * pending = cursor->pending;
+	while (!batch_size || pending->rows - cursor->pending_row < batch_size) {
+		compact_pending(cursor);
+		if (!scan_next_chunk(cursor->scan, pending))
+			break;
+	}
+
+	hsize_t count = pending->rows - cursor->pending_row;
+	if (batch_size && count > batch_size)
+		count = batch_size;
+	if (DEBUG)
+		printf("Cursor %p returning %lli values\n", cursor, count);
+
+	FileContext * file = cursor->file;
+	ResultTable * batch = take_pending_rows(cursor, count);
+	hsize_t * offset = calloc(file->rank, sizeof(hsize_t));
+	hsize_t * width = calloc(file->rank, sizeof(hsize_t));
+	if (count)
+		batch_label_bounds(file, batch, offset, width);
+	StringResultTable * res = stringify_result_table(file, offset, width, batch);
+	destroy_result_table(batch);
+	free(offset);
+	free(width);
+	return res;
+}
+
+void cursor_close(Cursor * cursor) {
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> CLOSING CURSOR %p\n", cursor);
+	destroy_chunk_scan(cursor->scan);
+	destroy_result_table(cursor->pending);
+	if (cursor->ranges) {
+		hsize_t dim;
+		for (dim = 0; dim < cursor->file->rank; dim++) {
+			if (cursor->ranges[dim].count) {
+				free(cursor->ranges[dim].lo);
+				free(cursor->ranges[dim].hi);
+			}
+		}
+		free(cursor->ranges);
+	}
+	free(cursor);
+}
+
+static StringResultTable * fetch_ranges(FileContext * file, DimConstraint * constraints, ValueFilter * filter, hsize_t kept_dim) {
+	flush_staged_values(file);
+	hsize_t rank = file->rank;
+	hsize_t dim;
+	if (DEBUG) {
+		printf(">>>>>>>>>>>>>>> FETCHING STRING VALUES IN RANGES FROM FILE %li:\n", file->file);
+		for (dim = 0; dim < rank; dim++) {
+			hsize_t interval;
+			for (interval = 0; interval < constraints[dim].count; interval++)
+				printf("%lli in [%lli, %lli)\n", dim, constraints[dim].lo[interval], constraints[dim].hi[interval]);
+		}
+	}
+	hsize_t * offset = calloc(rank, sizeof(hsize_t));
+	hsize_t * width = calloc(rank, sizeof(hsize_t));
+	if (set_range_query_parameters(file, constraints, offset, width)) {
+		free(offset);
+		free(width);
+		return NULL;
+	}
+
+	bool * set_dims = range_set_dims(file, constraints, kept_dim);
+	ResultTable * table = new_result_table(rank, set_dims);
+	table->filter = filter;
+	ChunkScan * scan = new_chunk_scan(file, offset, width, constraints);
+	while (scan_next_chunk(scan, table))
+		continue;
+	destroy_chunk_scan(scan);
+	sort_top_k(table);
+	if (DEBUG) 
+		printf("Found %lli values\n", table->rows);
+
+	// Labels are only read between the extreme hits of each column
+	if (table->rows)
+		batch_label_bounds(file, table, offset, width);
+	StringResultTable * res = stringify_result_table(file, offset, width, table);
+	destroy_result_table(table);
+	free(set_dims);
+	free(offset);
+	free(width);
+	return res;
+}
+
+StringResultTable * fetch_string_values_ranges(FileContext * file, DimConstraint * constraints, ValueFilter * filter) {
+	return fetch_ranges(file, constraints, filter, file->rank);
+}
+
+StringResultTable * fetch_region(FileContext * file, hsize_t dim, char * chrom, hsize_t start, hsize_t end, DimConstraint * constraints, ValueFilter * filter) {
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> FETCHING REGION %s:%lli-%lli OF DIM %lli FROM FILE %li\n", chrom, start, end, dim, file->file);
+	DimConstraint * region_constraints = calloc(file->rank, sizeof(DimConstraint));
+	StringResultTable * res;
+	if (constraints)
+		memcpy(region_constraints, constraints, file->rank * sizeof(DimConstraint));
+	if (find_region(file, dim, chrom, start, end, region_constraints + dim))
+		res = fetch_ranges(file, region_constraints, filter, dim);
+	else
+		res = calloc(1, sizeof(StringResultTable));
+	free(region_constraints[dim].lo);
+	free(region_constraints[dim].hi);
+	free(region_constraints);
+	return res;
+}
+
 void destroy_string_result_table(StringResultTable * table) {
 	if (DEBUG)
 		printf(">>>>>>>>>>>>>>> DESTROY STRING RESULT TABLE %p\n", table);
-	hsize_t row;
-	if (table->rows && table->columns) {
-		for (row = 0; row < table->rows; row++)
-			free(table->coords[row]);
-		hsize_t column;
-		for (column = 0; column < table->columns; column++)
+	hsize_t column;
+	for (column = 0; column < table->columns; column++) {
+		if (table->dim_labels)
 			destroy_string_array(table->dim_labels[column]);
+		if (table->dim_meta)
+			free(table->dim_meta[column]);
+		if (table->indices[column])
+			free(table->indices[column]);
 	}
-	destroy_string_array(table->dim_names);
-	if (table->coords)
-		free(table->coords);
+	if (table->indices)
+		free(table->indices);
+	if (table->label_offsets)
+		free(table->label_offsets);
 	if (table->dims)
 		free(table->dims);
 	if (table->dim_labels)
 		free(table->dim_labels);
+	if (table->dim_meta)
+		free(table->dim_meta);
 	if (table->dim_indices)
 		free(table->dim_indices);
 	if (table->values)
@@ -1181,10 +3948,32 @@ void destroy_string_result_table(StringResultTable * table) {
 	free(table);
 }
 
-void close_file(hid_t file) {
+void flush_file(FileContext * file) {
 	if (DEBUG)
-		printf(">>>>>>>>>>>>>>> CLOSING FILE %li\n", file);
-	VERIFY(H5Fclose(file));
+		printf(">>>>>>>>>>>>>>> FLUSHING FILE %li\n", file->file);
+	if (file->readonly)
+		return;
+	flush_staged_values(file);
+	flush_labels(file);
+	flush_label_indices(file);
+	flush_position_indices(file);
+	flush_boundaries(file);
+	VERIFY(H5Fflush(file->file, H5F_SCOPE_LOCAL));
+}
+
+void close_file(FileContext * file) {
+	if (DEBUG)
+		printf(">>>>>>>>>>>>>>> CLOSING FILE %li\n", file->file);
+	if (!file->readonly) {
+		flush_staged_values(file);
+		flush_labels(file);
+		flush_label_indices(file);
+		flush_position_indices(file);
+		flush_boundaries(file);
+	}
+	hid_t handle = file->file;
+	destroy_file_context(file);
+	VERIFY(H5Fclose(handle));
 }
 
 ////////////////////////////////////////////
@@ -27,37 +27,237 @@ typedef struct string_array_st {
 	char * array;
 	hsize_t length;
 	hsize_t count;
+	// Start of each string in array, NULL if they are all length + 1 apart
+	hsize_t * offsets;
 } StringArray;
 
+// Rows of a boundary table, loaded and written back in blocks
+typedef struct boundary_cache_st {
+	hsize_t rows, row_width, block_count;
+	// NULL until loaded
+	hsize_t ** blocks;
+	bool * dirty;
+} BoundaryCache;
+
+// Labels appended to a dimension, written out in large blocks
+typedef struct label_buffer_st {
+	// Labels in the table, i.e. its "count" attribute
+	hsize_t stored;
+	// Labels waiting to be written, pending->count of them
+	StringArray * pending;
+	hsize_t capacity;
+	// Variable length labels: bytes in the blob, and room in pending->array
+	hsize_t stored_bytes, byte_capacity;
+} LabelBuffer;
+
+// Labels of a dimension in memory, with their indices sorted by label
+typedef struct label_index_st {
+	StringArray * labels;
+	hsize_t * order;
+} LabelIndex;
+
+// Metadata rows of a dimension sorted by chromosome, then start
+typedef struct position_index_st {
+	hsize_t count, chrom_count;
+	// Rows on chromosome code c are [chrom_offsets[c], chrom_offsets[c + 1])
+	hsize_t * chrom_offsets;
+	hsize_t * starts;
+	hsize_t * ends;
+	// Dimension index of each row
+	hsize_t * order;
+	// Longest end - start, bounds the search for overlapping rows
+	hsize_t max_span;
+} PositionIndex;
+
+typedef struct file_context_st {
+	hid_t file;
+	bool readonly;
+	hsize_t rank, core_rank;
+	hsize_t * dim_sizes;
+	hsize_t * chunk_sizes;
+	hsize_t * label_lengths;
+	StringArray * dim_names;
+	hid_t matrix;
+	hid_t matrix_space;
+	hid_t labels_group;
+	hid_t * label_datasets;
+	// Offsets of the labels of a variable length table, 0 for fixed width ones
+	hid_t * label_offset_datasets;
+	// NULL until labels are stored into the dimension
+	LabelBuffer ** label_buffers;
+	// NULL until a label is looked up. Stale ones are rewritten on flush
+	LabelIndex ** label_indices;
+	bool * stale_label_indices;
+	// NULL until a region is looked up. Stale ones are rewritten on flush
+	PositionIndex ** position_indices;
+	bool * stale_position_indices;
+	hid_t boundaries_group;
+	hid_t * boundary_datasets;
+	BoundaryCache ** boundary_caches;
+	// Worker threads compressing matrix chunks in bulk writes
+	int threads;
+	// zlib level of the matrix chunks if they are deflated, after an
+	// optional shuffle, and nothing else. 0 leaves the filters to HDF5
+	int deflate_level;
+	bool shuffle;
+	// Storage type of the matrix, see ValueEncoding
+	int encoding;
+	hid_t value_type;
+	size_t value_size;
+	double scale;
+	// Decoded value of each 16 bit code, NULL for other encodings
+	double * decode_table;
+	// Points held back by store_values until staging_capacity of them
+	// are waiting, 0 if staging is off. See FileOptions
+	hsize_t staging_capacity, staged, staged_allocated;
+	hsize_t * staged_coords;
+	double * staged_values;
+} FileContext;
+
+// Filters of the matrix, label and boundary datasets of a new file.
+// LZ4 and Zstd need the HDF5 filter plugins, create_file falls
+// back to shuffle+deflate when they cannot be loaded
+typedef enum {STORAGE_NONE, STORAGE_DEFLATE, STORAGE_SHUFFLE_DEFLATE, STORAGE_LZ4, STORAGE_ZSTD} StorageProfile;
+
+// How the matrix stores values, reads always return doubles.
+// ENCODING_NEG_LOG10_U16 only holds p-values in (0, 1], as round(-log10(p) * 100)
+typedef enum {ENCODING_DOUBLE, ENCODING_FLOAT, ENCODING_NEG_LOG10_U16} ValueEncoding;
+
+// How labels are stored: padded to the longest label, or concatenated
+// into a blob with an offsets table, which suits long labels of uneven length
+typedef enum {LABELS_FIXED, LABELS_BLOB} LabelFormat;
+
+// Settings of a file handle, NULL selects the defaults
+typedef struct file_options_st {
+	// 1 by default, more threads compress chunks in parallel
+	int threads;
+	// Only read by create_file, uncompressed by default
+	StorageProfile storage;
+	// Deflate or Zstd level, 0 picks the default of the filter
+	int level;
+	// Only read by create_file, doubles by default
+	ValueEncoding encoding;
+	// Memory budget of the points staged by store_values on a writable
+	// handle, merged and written at once when full, before reads and
+	// on flush_file or close_file. 0 writes every call through
+	size_t staging_bytes;
+	// Only read by create_file, fixed width labels by default
+	LabelFormat label_format;
+} FileOptions;
+
+// Optional predicate and top-k selection, applied to values as they are extracted
+typedef enum {VALUE_ANY, VALUE_LT, VALUE_GT, VALUE_ABS_GT} ValuePredicate;
+typedef enum {TOP_LARGEST, TOP_SMALLEST, TOP_LARGEST_ABS} TopOrder;
+
+typedef struct value_filter_st {
+	ValuePredicate predicate;
+	double threshold;
+	// 0 keeps all the values which pass the predicate
+	hsize_t top_k;
+	TopOrder order;
+} ValueFilter;
+
 typedef struct result_table_st {
-	hsize_t rows, columns;
+	hsize_t rows, columns, capacity;
 	hsize_t * dims;
-	hsize_t ** coords;
+	hsize_t ** indices;
 	double * values;
+	// Borrowed, NULL if none
+	ValueFilter * filter;
 } ResultTable;
 
+// Typed columns of the labels of a dimension, e.g. the location and consequence
+// of SNPs. chrom and consequence are codes into the dictionaries of the same name,
+// see store_meta_dictionary
+typedef struct dim_meta_st {
+	unsigned int chrom;
+	unsigned int consequence;
+	hsize_t start, end;
+} DimMeta;
+
 typedef struct string_result_table_st {
 	hsize_t rows, columns;
 	hsize_t * dim_indices;
 	char ** dims;
-	char *** coords;
+	hsize_t ** indices;
+	hsize_t * label_offsets;
 	double * values;
 	StringArray ** dim_labels;
+	// Metadata of the rows of dim_labels, NULL if no dimension of the file has any
+	DimMeta ** dim_meta;
 	StringArray * dim_names;
 } StringResultTable;
 
-hid_t create_file(char * filename, hsize_t rank, char ** dim_names, hsize_t * dim_sizes, hsize_t * dim_label_lengths, hsize_t * chunk_sizes);
-void store_dim_labels(hid_t file, char * dim_name, hsize_t dim_size, char ** dim_labels);
-void store_values(hid_t file, hsize_t count, hsize_t ** coords, double * values);
-hid_t open_file(char * filename, int readonly);
-StringResultTable * fetch_string_values(hid_t file, bool * set_dims, hsize_t * constraints);
+typedef struct cursor_st Cursor;
+
+// Half-open intervals [lo, hi) of indices along one dimension,
+// a dimension with no interval is unconstrained
+typedef struct dim_constraint_st {
+	hsize_t count;
+	hsize_t * lo;
+	hsize_t * hi;
+} DimConstraint;
+
+FileContext * create_file(char * filename, hsize_t rank, char ** dim_names, hsize_t * dim_sizes, hsize_t * dim_label_lengths, hsize_t * chunk_sizes, FileOptions * options);
+void store_dim_labels(FileContext * file, char * dim_name, hsize_t dim_size, char ** dim_labels);
+void store_values(FileContext * file, hsize_t count, hsize_t ** coords, double * values);
+// Same as store_values, with the coordinates of point i at coords[i * rank], in the order of get_dim_names
+void store_values_packed(FileContext * file, hsize_t count, hsize_t * coords, double * values);
+// Appends count values, with their labels, to a dimension whose labels are all stored
+void extend_dimension(FileContext * file, char * dim_name, hsize_t count, char ** labels);
+FileContext * open_file(char * filename, int readonly, FileOptions * options);
+// filter may be NULL. With a top_k, the rows come out best first
+StringResultTable * fetch_string_values(FileContext * file, bool * set_dims, hsize_t * constraints, ValueFilter * filter);
+// One DimConstraint per dimension. Returns NULL if an interval is empty or out of bounds
+StringResultTable * fetch_string_values_ranges(FileContext * file, DimConstraint * constraints, ValueFilter * filter);
+// Point lookups, every dimension constrained. Empty cells read as 0
+double get_value(FileContext * file, hsize_t * coords);
+void get_values(FileContext * file, hsize_t count, hsize_t ** coords, double * values);
+// Runs count queries in one pass over the file, reading each chunk once.
+// Returns an array of count tables, NULL where a query's constraints are invalid
+StringResultTable ** fetch_string_values_batch(FileContext * file, hsize_t count, bool ** set_dims, hsize_t ** constraints);
+// Same, with one array of DimConstraint per query, see fetch_string_values_ranges
+StringResultTable ** fetch_string_values_batch_ranges(FileContext * file, hsize_t count, DimConstraint ** constraints);
+char * get_result_label(StringResultTable * table, hsize_t column, hsize_t row);
+// NULL if the dimension of the column has no metadata
+DimMeta * get_result_meta(StringResultTable * table, hsize_t column, hsize_t row);
 void destroy_string_result_table(StringResultTable * table);
-void close_file(hid_t file);
+// Incremental fetches: cursor_next returns at most batch_size rows 
+// (all remaining rows if batch_size is 0), and an empty table once done
+Cursor * open_cursor(FileContext * file, bool * set_dims, hsize_t * constraints);
+// Same, with one DimConstraint per dimension. Returns NULL if an interval is empty or out of bounds
+Cursor * open_cursor_ranges(FileContext * file, DimConstraint * constraints);
+StringResultTable * cursor_next(Cursor * cursor, hsize_t batch_size);
+void cursor_close(Cursor * cursor);
+// Writes staged points and pending boundary updates out, close_file does so too
+void flush_file(FileContext * file);
+void close_file(FileContext * file);
+
+// Label lookups through /label_index, a permutation of the labels of each dimension
+// in sorted order. Labels are matched on their text before any tab
+bool lookup_label(FileContext * file, hsize_t dim, char * label, hsize_t * index);
+// Fills indices and found for count labels, returns how many were found
+hsize_t lookup_labels(FileContext * file, hsize_t dim, hsize_t count, char ** labels, hsize_t * indices, bool * found);
+
+// Metadata of a dimension, one row per label in label order, appended as labels are
+void store_dim_meta(FileContext * file, char * dim_name, hsize_t count, DimMeta * meta);
+// Rows [offset, offset + count), those not stored reading as zeros. NULL if the dimension has no metadata
+DimMeta * get_dim_meta(FileContext * file, hsize_t dim, hsize_t offset, hsize_t count);
+// Rows of dim whose metadata overlaps [start, end] on chrom, as sorted disjoint intervals
+// of indices in constraint, to be freed by the caller. Returns the number of rows
+hsize_t find_region(FileContext * file, hsize_t dim, char * chrom, hsize_t start, hsize_t end, DimConstraint * constraint);
+// fetch_string_values_ranges over the rows of find_region, which are always returned. constraints
+// may be NULL, its entry for dim is ignored. Returns an empty table if no row overlaps the region
+StringResultTable * fetch_region(FileContext * file, hsize_t dim, char * chrom, hsize_t start, hsize_t end, DimConstraint * constraints, ValueFilter * filter);
+// Replaces the strings of a dictionary, whose codes are their indices
+void store_meta_dictionary(FileContext * file, char * name, hsize_t count, char ** strings);
+// NULL if the file has no such dictionary
+StringArray * get_meta_dictionary(FileContext * file, char * name);
 
-hsize_t get_file_core_rank(hid_t file);
-hsize_t get_file_rank(hid_t file);
-StringArray * get_dim_names(hid_t file);
-StringArray * get_all_dim_labels(hid_t file, hsize_t dim);
+hsize_t get_file_core_rank(FileContext * file);
+hsize_t get_file_rank(FileContext * file);
+StringArray * get_dim_names(FileContext * file);
+StringArray * get_all_dim_labels(FileContext * file, hsize_t dim);
 char * get_string_in_array(StringArray * sarray, hsize_t index);
 void destroy_string_array(StringArray * sarray);
 void set_hdf5_log(int value);
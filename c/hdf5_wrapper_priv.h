@@ -17,4 +17,9 @@
 
 void set_big_dim_length(int length);
 
+ResultTable * new_result_table(hsize_t rank, bool * set_dims);
+void unroll_matrix(ResultTable * table, double * array, hsize_t rank, hsize_t * offset, hsize_t * width);
+void sort_top_k(ResultTable * table);
+void destroy_result_table(ResultTable * table);
+
 #endif
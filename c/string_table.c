@@ -0,0 +1,106 @@
+// Copyright [1999-2015] Wellcome Trust Sanger Institute and the EMBL-European Bioinformatics Institute
+// Copyright [2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include "string_table.h"
+
+////////////////////////////////////////////////////////
+// Fields
+////////////////////////////////////////////////////////
+
+int split_fields(char * line, char ** fields, int max_fields) {
+	int count = 0;
+	fields[count++] = line;
+	for (; *line && count < max_fields; line++) {
+		if (*line == '\t') {
+			*line = '\0';
+			fields[count++] = line + 1;
+		} else if (*line == '\n' || *line == '\r')
+			*line = '\0';
+	}
+	// Fields past max_fields are cut off the last one
+	for (; *line; line++)
+		if (*line == '\n' || *line == '\r' || *line == '\t')
+			*line = '\0';
+	return count;
+}
+
+////////////////////////////////////////////////////////
+// String table
+////////////////////////////////////////////////////////
+
+static size_t hash_string(char * string) {
+	// FNV-1a
+	size_t hash = 14695981039346656037ULL;
+	for (; *string; string++) {
+		hash ^= (unsigned char) *string;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Slot of key, or of the empty slot where it would go
+static size_t find_slot(StringTable * table, char * key) {
+	size_t slot = hash_string(key) & (table->slot_count - 1);
+	while (table->slots[slot] && strcmp(table->keys[table->slots[slot] - 1], key))
+		slot = (slot + 1) & (table->slot_count - 1);
+	return slot;
+}
+
+StringTable * new_string_table() {
+	return calloc(1, sizeof(StringTable));
+}
+
+void string_table_add(StringTable * table, char * key) {
+	if (table->count == table->capacity) {
+		table->capacity = table->capacity ? 2 * table->capacity : 1024;
+		table->keys = realloc(table->keys, table->capacity * sizeof(char *));
+	}
+	table->keys[table->count++] = strdup(key);
+}
+
+void string_table_index(StringTable * table) {
+	size_t index;
+	free(table->slots);
+	table->slot_count = 16;
+	while (table->slot_count < 2 * table->count)
+		table->slot_count *= 2;
+	table->slots = calloc(table->slot_count, sizeof(size_t));
+	for (index = 0; index < table->count; index++) {
+		size_t slot = find_slot(table, table->keys[index]);
+		if (!table->slots[slot])
+			table->slots[slot] = index + 1;
+	}
+}
+
+bool string_table_find(StringTable * table, char * key, size_t * index) {
+	if (!table->slots)
+		return false;
+	size_t slot = find_slot(table, key);
+	if (!table->slots[slot])
+		return false;
+	*index = table->slots[slot] - 1;
+	return true;
+}
+
+void destroy_string_table(StringTable * table) {
+	size_t index;
+	for (index = 0; index < table->count; index++)
+		free(table->keys[index]);
+	free(table->keys);
+	free(table->slots);
+	free(table);
+}
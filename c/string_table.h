@@ -0,0 +1,49 @@
+// Copyright [1999-2015] Wellcome Trust Sanger Institute and the EMBL-European Bioinformatics Institute
+// Copyright [2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Helpers shared by the command line tools: tab separated field
+// splitting and an open addressing table from strings to their index
+#ifndef _STRING_TABLE_H_
+#define _STRING_TABLE_H_
+
+#include <stddef.h>
+
+#ifndef bool
+#define bool char
+#define true 1
+#define false 0
+#endif
+
+typedef struct string_table_st {
+	// Strings in order of insertion, owned by the table
+	char ** keys;
+	size_t count, capacity;
+	// Slots hold index + 1, empty until string_table_index
+	size_t * slots;
+	size_t slot_count;
+} StringTable;
+
+// Splits a tab separated line in place, returns the number of fields
+int split_fields(char * line, char ** fields, int max_fields);
+
+StringTable * new_string_table();
+// Appends a copy of key
+void string_table_add(StringTable * table, char * key);
+// Builds the slots once all keys are added, the first of duplicate keys wins
+void string_table_index(StringTable * table);
+bool string_table_find(StringTable * table, char * key, size_t * index);
+void destroy_string_table(StringTable * table);
+
+#endif
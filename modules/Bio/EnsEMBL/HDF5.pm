@@ -18,11 +18,26 @@ our @ISA = qw(Exporter);
 our %EXPORT_TAGS = ( 'all' => [ qw(
   hdf5_close
 	hdf5_create
+	hdf5_cursor_close
+	hdf5_cursor_next
+	hdf5_extend_dimension
 	hdf5_fetch
+	hdf5_fetch_columns
+	hdf5_fetch_many
+	hdf5_fetch_region
+	hdf5_flush
 	hdf5_get_dim_labels
+	hdf5_get_dim_names
+	hdf5_get_value
+	hdf5_get_values
+	hdf5_lookup_label
+	hdf5_lookup_labels
 	hdf5_open
+	hdf5_open_cursor
 	hdf5_store
+	hdf5_store_packed
 	hdf5_store_dim_labels
+	hdf5_store_dim_meta
 ) ] );
 
 our @EXPORT_OK = ( @{ $EXPORT_TAGS{'all'} } );
@@ -37,7 +37,6 @@ package Bio::EnsEMBL::HDF5::ArrayAdaptor;
 use strict;
 use warnings;
 
-use Bio::EnsEMBL::DBSQL::DBConnection;
 use Bio::EnsEMBL::Utils::Argument qw/rearrange/;
 use feature qw/say/;
 use Data::Dumper;
@@ -57,11 +56,26 @@ use Data::Dumper;
        Bio::EnsEMBL::HDF5_sqlite->import( qw(
          hdf5_close
          hdf5_create
+         hdf5_cursor_close
+         hdf5_cursor_next
+         hdf5_extend_dimension
          hdf5_fetch
+         hdf5_fetch_columns
+         hdf5_fetch_many
+         hdf5_fetch_region
+         hdf5_flush
          hdf5_get_dim_labels
+         hdf5_get_dim_names
+         hdf5_get_value
+         hdf5_get_values
+         hdf5_lookup_label
+         hdf5_lookup_labels
          hdf5_open
+         hdf5_open_cursor
          hdf5_store
+         hdf5_store_packed
          hdf5_store_dim_labels
+         hdf5_store_dim_meta
        ));
      }
    }
@@ -70,11 +84,26 @@ use Data::Dumper;
      Bio::EnsEMBL::HDF5->import( qw (
        hdf5_close
        hdf5_create
+       hdf5_cursor_close
+       hdf5_cursor_next
+       hdf5_extend_dimension
        hdf5_fetch
+       hdf5_fetch_columns
+       hdf5_fetch_many
+       hdf5_fetch_region
+       hdf5_flush
        hdf5_get_dim_labels
+       hdf5_get_dim_names
+       hdf5_get_value
+       hdf5_get_values
+       hdf5_lookup_label
+       hdf5_lookup_labels
        hdf5_open
+       hdf5_open_cursor
        hdf5_store
+       hdf5_store_packed
        hdf5_store_dim_labels
+       hdf5_store_dim_meta
      ));
    }
  }
@@ -84,26 +113,41 @@ use Data::Dumper;
     Constructor
     Argument [1] : HDF5 Filename
     Argument [2] : Optional: Hash ref of dimension name => array ref of allowed values
+    Argument -THREADS : Optional: number of threads compressing data on store
+    Argument -STORAGE : Optional: storage profile of a new file, one of
+                        none, deflate, shuffle_deflate, lz4 or zstd
+    Argument -DEFLATE : Optional: compression level of a new file, on its own
+                        it selects the deflate profile
+    Argument -ENCODING : Optional: value type of a new file, one of double,
+                         float or neg_log10_p (p-values only)
+    Argument -STAGING_MB : Optional: memory budget, in MB, of the points held
+                           back by store and written together
+    Argument -LABEL_FORMAT : Optional: label storage of a new file, fixed
+                             (padded) or blob (variable length)
+    Argument -DBNAME : Obsolete, labels are looked up through an index
+                       inside the HDF5 file
     Returntype   : Bio::EnsEMBL::HDF5::ArrayAdaptor
 
 =cut
 
 sub new {
   my $class = shift;
-  my ($filename, $dim_sizes, $dim_label_lengths, $dbname, $read_only) =
-  rearrange(['FILENAME','SIZES', 'LABEL_LENGTHS','DBNAME', 'READ_ONLY'], @_);
+  my ($filename, $dim_sizes, $dim_label_lengths, $dbname, $read_only, $threads, $storage, $deflate, $encoding, $staging_mb, $label_format) =
+  rearrange(['FILENAME','SIZES', 'LABEL_LENGTHS','DBNAME', 'READ_ONLY', 'THREADS', 'STORAGE', 'DEFLATE', 'ENCODING', 'STAGING_MB', 'LABEL_FORMAT'], @_);
 
   defined $filename || die ("Must specify HDF5 filename!");
 
-  $dbname ||= $filename . ".sqlite3";
   if(!defined $read_only or $read_only != 1){
     $read_only = 0;
   } 
+  my $options = {threads => $threads || 1, deflate => $deflate || 0};
+  $options->{storage} = $storage if defined $storage;
+  $options->{encoding} = $encoding if defined $encoding;
+  $options->{staging_mb} = $staging_mb if defined $staging_mb;
+  $options->{labels} = $label_format if defined $label_format;
 
   my $self = {
     hdf5 => undef,
-    sqlite3 => Bio::EnsEMBL::DBSQL::DBConnection->new(-DBNAME => $dbname, -DRIVER => 'SQLite'),
-    st_handles => {}
   };
 
   bless $self, $class;
@@ -133,120 +177,77 @@ sub new {
       unlink $filename;
     }
 
-    hdf5_create($filename, $dim_sizes, $dim_label_lengths);
-
-    my @dim_names = keys %$dim_sizes;
-    $self->_create_sqlite3_file($filename, \@dim_names);
+    hdf5_create($filename, $dim_sizes, $dim_label_lengths, $options);
   }
 
-  $self->{hdf5} = hdf5_open($filename, $read_only);
+  $self->{hdf5} = hdf5_open($filename, $read_only, $options);
 
   return $self;
 }
 
-=head2 _create_sqllite3_file
-
-    Argument [1] : HDF5 Filename
-    Argument [2] : Hash ref of dimension name => array ref of allowed values
-
-=cut
-
-sub _create_sqlite3_file {
-  my ($self, $filename, $dim_names) = @_;
-
-  foreach my $key (@$dim_names) {
-    $self->_create_sqlite3_table($key);
-  }
-}
-
-
-=head2 _create_sqlite3_table
+=head2 store_dim_labels
 
-  Argument [1]: Dimension name
+  Argument [1]: dim name
+  Argument [2]: array of labels
 
 =cut
 
-sub _create_sqlite3_table {
-  my ($self, $dim_name) = @_;
-
-  print "CREATING table $dim_name\n";
-  my $sql = "
-  CREATE TABLE IF NOT EXISTS $dim_name (
-    hdf5_index	INTEGER PRIMARY KEY AUTOINCREMENT,
-    external_id	VARCHAR(100)
-  )
-  ";
-  $self->{sqlite3}->do($sql);
+sub store_dim_labels {
+  my ($self, $dim_name, $dim_labels) = @_;
+  hdf5_store_dim_labels($self->{hdf5}, $dim_name, $dim_labels);
 }
 
+=head2 store_dim_meta
 
-=head2 store_dim_labels
-
+  Appends typed columns to the labels of a dimension, in label order
   Argument [1]: dim name
-  Argument [2]: array of labels
+  Argument [2]: Hashref of chrom, start, end and consequence => arrayref of values
 
 =cut
 
-sub store_dim_labels {
-  my ($self, $dim_name, $dim_labels) = @_;
-  my $start = time;
-  hdf5_store_dim_labels($self->{hdf5}, $dim_name, $dim_labels);
-  print "HDF5 time =\t" . (time - $start). "\n";
-  $start = time;
-  $self->_insert_into_sqlite3_table($dim_name, $dim_labels);
-  print "SQLite3 time =\t" . (time - $start) . "\n";
+sub store_dim_meta {
+  my ($self, $dim_name, $columns) = @_;
+  hdf5_store_dim_meta($self->{hdf5}, $dim_name, $columns);
 }
 
-=head2 _insert_into_sqlite3_table
+=head2 extend_dimension
 
+  Appends values to a dimension of an existing file
   Argument [1]: Dimension name
-  Argument [2]: Array of ids
+  Argument [2]: Array ref of labels of the new values
 
 =cut
 
-sub _insert_into_sqlite3_table {
+sub extend_dimension {
   my ($self, $dim_name, $dim_labels) = @_;
-  my $sql2 = "INSERT INTO $dim_name (external_id) VALUES (?)";
-  # Enable transactions (by turning AutoCommit off) until the next call to commit or rollback.
-  # After the next commit or rollback, AutoCommit will automatically be turned on again.
-  $self->{sqlite3}->db_handle->begin_work;
-  my $sth = $self->{sqlite3}->prepare($sql2);
-  $sth->execute_array({}, $dim_labels);
-  $self->{sqlite3}->db_handle->commit;
+  hdf5_extend_dimension($self->{hdf5}, $dim_name, $dim_labels);
 }
 
 =head2 index_tables
 
-  Create indexes of SQLite3 tables
+  Writes the label indices into the file. Closing the file does so too
 
 =cut
 
 sub index_tables {
   my ($self) = @_;
-  my $sth = $self->{sqlite3}->db_handle->table_info('%','%','%','TABLE');
-  while (my @row = $sth->fetchrow_array) {
-    my $table = $row[2];
-    if (! ($table eq 'sqlite_sequence')) {
-      $self->{sqlite3}->do("CREATE INDEX idx_$table ON $table (external_id)");
-    }
-  }
+  hdf5_flush($self->{hdf5});
 }
 
-=head2 get_indiced_hashref
+=head2 dim_indices
 
-  Returns a hashref representation of a given table
+  Returns a hashref of label => index for a given dimension, labels
+  being cut at their first tab
 
 =cut
 
 sub dim_indices {
   my ($self, $dim) = @_;
   my %res = ();
-  my $sql = "SELECT external_id, hdf5_index FROM $dim";
-  my $sth = $self->{sqlite3}->prepare($sql);
-  $sth->execute();
-  while (my @row = $sth->fetchrow_array) {
-    ## Note that SQLite3 autoincrement starts at 1, instead of 0 for HDF5 indices
-    $res{$row[0]} = $row[1] - 1;
+  my $labels = hdf5_get_dim_labels($self->{hdf5}, $dim);
+  for (my $index = 0; $index < scalar @$labels; $index++) {
+    my ($label) = split("\t", $labels->[$index]);
+    $res{$label} = $index if defined $label && ! exists $res{$label};
   }
   return \%res;
 }
@@ -264,32 +265,15 @@ sub _get_numerical_value {
   if ($dim eq 'value') {
     return $label;
   }
-  if (! exists $self->{st_handles}{$dim}) {
-    $self->{st_handles}{$dim} = $self->{sqlite3}->prepare("SELECT hdf5_index FROM $dim WHERE external_id=?")
-  }
-  $self->{st_handles}{$dim}->execute($label);
-  my @row =  $self->{st_handles}{$dim}->fetchrow_array;
-
-  if (scalar @row) {
-    ## Note that SQLite3 autoincrement starts at 1, instead of 0 for HDF5 indices
-    if ($row[0] <= 0) {
-      die;
-    }
-    return $row[0] - 1;
-  } else {
-    # print "Could not find $label in dimensions $dim\n";
-    my $sth = $self->{sqlite3}->prepare("SELECT hdf5_index FROM $dim LIMIT 10");
-    while (my @array = $sth->fetchrow_array) {
-      print "Suggest $array[0]\n";
-    }
-    return undef;
-  }
+  return hdf5_lookup_label($self->{hdf5}, $dim, $label);
 }
 
 =head2 _convert_coords
 
-  Arguments [1]: Hash ref of coord string => string label
-  Returntype: Hash ref of coord string => integer index
+  Arguments [1]: Hash ref of coord string => string label, array ref of labels,
+                 or hash ref {start => label, end => label} (both ends included)
+  Returntype: Hash ref of coord string => integer index, array ref of indices,
+              or hash ref {start => index, end => index} (end excluded)
 
 =cut
 
@@ -297,7 +281,22 @@ sub _convert_coords {
   my ($self, $coords) = @_;
   my $numerical_coords = {};
   foreach my $key (keys %$coords) {
-    $numerical_coords->{$key} = $self->_get_numerical_value($key, $coords->{$key});
+    my $label = $coords->{$key};
+    if (ref $label eq 'ARRAY') {
+      # Unknown labels are dropped, an empty list matches nothing
+      $numerical_coords->{$key} = [ grep { defined } @{hdf5_lookup_labels($self->{hdf5}, $key, $label)} ];
+    } elsif (ref $label eq 'HASH') {
+      my $start = $self->_get_numerical_value($key, $label->{start});
+      my $end = $self->_get_numerical_value($key, $label->{end});
+      # Labels are not sorted: like unknown labels, reversed ends match nothing
+      if (defined $start && defined $end && $start <= $end) {
+        $numerical_coords->{$key} = { start => $start, end => $end + 1 };
+      } else {
+        $numerical_coords->{$key} = [];
+      }
+    } else {
+      $numerical_coords->{$key} = $self->_get_numerical_value($key, $label);
+    }
   }
   defined $numerical_coords->{$_} or delete $numerical_coords->{$_} for keys %{$numerical_coords};
   return $numerical_coords;
@@ -315,14 +314,49 @@ sub store {
   my $start = time;
   my @converted_points = ();
   foreach my $point (@$data_points) {
-    # If IDs are not recognized, eval stifles the error warning
-    # and the entry is simply ignored
-    eval { push @converted_points, $self->_convert_coords($point); };
+    # Points with unknown labels are simply ignored
+    my $converted_point = $self->_convert_coords($point);
+    push @converted_points, $converted_point if scalar(keys %$converted_point) == scalar(keys %$point);
   }
   print "CONVERTED VALUES ". (time - $start) . "\n";
   hdf5_store($self->{hdf5}, \@converted_points);
 }
 
+=head2 store_packed
+
+  Stores points without building a hash per point
+  Arguments [1]: pack('Q*') string of dimension indices, point by point, in the order of dim_names
+  Arguments [2]: pack('d*') string of values
+
+=cut
+
+sub store_packed {
+  my ($self, $coords, $values) = @_;
+  hdf5_store_packed($self->{hdf5}, $coords, $values);
+}
+
+=head2 dim_names
+
+  Returntype: Arrayref of dimension names, in the order of packed coordinates
+
+=cut
+
+sub dim_names {
+  my ($self) = @_;
+  return hdf5_get_dim_names($self->{hdf5});
+}
+
+=head2 flush
+
+  Writes pending updates to the file, e.g. between large store batches
+
+=cut
+
+sub flush {
+  my ($self) = @_;
+  hdf5_flush($self->{hdf5});
+}
+
 =head2 get_dim_labels
 
   Arguments [1]: dimension name
@@ -338,21 +372,168 @@ sub get_dim_labels {
 
 =head2 fetch
 
-  Arguments [1]: Hashref of dimension name => label
+  Arguments [1]: Hashref of dimension name => label, arrayref of labels,
+                 or hashref {start => label, end => label}
+  Arguments [2]: Optional: Hashref filter on values, applied in the C layer:
+                 lt, gt or abs_gt => threshold, and/or top_k => count with
+                 order => 'largest' (default), 'smallest' or 'largest_abs'
+  Arguments [3]: Optional: Hashref of fetch options: meta => 1 adds the <dim>_chrom,
+                 <dim>_start, <dim>_end and <dim>_consequence fields of dimensions
+                 with metadata to the data points
   Returntype   : Arrayref of hashrefs: dimension name => label
 
 =cut
 
 sub fetch {
-  my ($self, $constraints) = @_;
+  my ($self, $constraints, $filter, $options) = @_;
 
   my $local_constraints = $constraints;
   defined $constraints->{$_} or delete $constraints->{$_} for keys %{$constraints};
 
-  my $temp = hdf5_fetch($self->{hdf5}, $self->_convert_coords($local_constraints));
+  my $temp = hdf5_fetch($self->{hdf5}, $self->_convert_coords($local_constraints), $filter, $options);
   return $temp;
 }
 
+=head2 fetch_columns
+
+  Same as fetch, with the results column by column
+  Arguments [1]: Hashref of constraints, see fetch
+  Arguments [2]: Optional: Hashref filter on values, see fetch
+  Returntype   : Hashref of dimension name or value => arrayref, one entry per row.
+                 Dimensions with metadata add <dim>_chrom, <dim>_start,
+                 <dim>_end and <dim>_consequence columns
+
+=cut
+
+sub fetch_columns {
+  my ($self, $constraints, $filter) = @_;
+  defined $constraints->{$_} or delete $constraints->{$_} for keys %{$constraints};
+  return hdf5_fetch_columns($self->{hdf5}, $self->_convert_coords($constraints), $filter);
+}
+
+=head2 fetch_region
+
+  Fetches the rows of a dimension with location metadata which overlap
+  a genomic interval, read as one hyperslab when its rows are sorted by position
+  Arguments [1]: Dimension name
+  Arguments [2]: Chromosome name
+  Arguments [3]: Start (included)
+  Arguments [4]: End (included)
+  Arguments [5]: Optional: Hashref of constraints on the other dimensions, see fetch
+  Arguments [6]: Optional: Hashref filter on values, see fetch
+  Arguments [7]: Optional: Hashref of fetch options, see fetch
+  Returntype   : Arrayref of hashrefs: dimension name => label
+
+=cut
+
+sub fetch_region {
+  my ($self, $dim_name, $chrom, $start, $end, $constraints, $filter, $options) = @_;
+  $constraints ||= {};
+  defined $constraints->{$_} or delete $constraints->{$_} for keys %{$constraints};
+  return hdf5_fetch_region($self->{hdf5}, $dim_name, $chrom, $start, $end, $self->_convert_coords($constraints), $filter, $options);
+}
+
+=head2 get_value
+
+  Arguments [1]: Hashref of dimension name => label, for every dimension
+  Returntype   : Value of the cell, 0 if empty or if a label is unknown
+
+=cut
+
+sub get_value {
+  my ($self, $point) = @_;
+  return $self->get_values([$point])->[0];
+}
+
+=head2 get_values
+
+  Arguments [1]: Arrayref of hashrefs of dimension name => label, for every dimension
+  Returntype   : Arrayref of values, in the order of the points
+
+=cut
+
+sub get_values {
+  my ($self, $points) = @_;
+  my @known = ();
+  my @numerical_points = ();
+  foreach my $point (@$points) {
+    my $numerical_point = $self->_convert_coords($point);
+    my $is_known = scalar(keys %$numerical_point) == scalar(keys %$point);
+    push @known, $is_known;
+    push @numerical_points, $numerical_point if $is_known;
+  }
+  my $values = scalar @numerical_points ? hdf5_get_values($self->{hdf5}, \@numerical_points) : [];
+  return [ map { $_ ? shift @$values : 0 } @known ];
+}
+
+=head2 fetch_many
+
+  Runs several fetches in one pass over the file
+  Arguments [1]: Arrayref of hashrefs of dimension name => label
+  Arguments [2]: Optional: Hashref of fetch options, see fetch
+  Returntype   : Arrayref of arrayrefs of hashrefs: dimension name => label,
+                 in the order of the constraints
+
+=cut
+
+sub fetch_many {
+  my ($self, $constraints_list, $options) = @_;
+
+  foreach my $constraints (@$constraints_list) {
+    defined $constraints->{$_} or delete $constraints->{$_} for keys %{$constraints};
+  }
+
+  my @numerical_constraints = map { $self->_convert_coords($_) } @$constraints_list;
+  my $results = hdf5_fetch_many($self->{hdf5}, \@numerical_constraints, $options);
+  for (my $index = 0; $index < scalar @$results; $index++) {
+    $results->[$index] = $self->_post_process($constraints_list->[$index], $results->[$index]);
+  }
+  return $results;
+}
+
+=head2 fetch_iterator
+
+  Arguments [1]: Hashref of dimension name => label
+  Arguments [2]: Optional: maximum number of data points per batch (default 10000)
+  Arguments [3]: Optional: Hashref of fetch options, see fetch
+  Returntype   : Closure which returns the next arrayref of hashrefs: dimension name => label,
+                 or undef once all the data points were returned
+
+=cut
+
+sub fetch_iterator {
+  my ($self, $constraints, $batch_size, $options) = @_;
+
+  defined $batch_size or $batch_size = 10000;
+  defined $constraints->{$_} or delete $constraints->{$_} for keys %{$constraints};
+
+  my $cursor = hdf5_open_cursor($self->{hdf5}, $self->_convert_coords($constraints), $options);
+  return sub {
+    defined $cursor or return undef;
+    my $batch = hdf5_cursor_next($cursor, $batch_size);
+    if (! defined $batch) {
+      hdf5_cursor_close($cursor);
+      $cursor = undef;
+      return undef;
+    }
+    return $self->_post_process($constraints, $batch);
+  };
+}
+
+=head2 _post_process
+
+  Hook for subclasses to decorate fetched data points
+  Arguments [1]: Hashref of dimension name => label, as given to the fetch
+  Arguments [2]: Arrayref of hashrefs: dimension name => label
+  Returntype   : Arrayref of hashrefs: dimension name => label
+
+=cut
+
+sub _post_process {
+  my ($self, $constraints, $data_points) = @_;
+  return $data_points;
+}
+
 =head2 close
 
 =cut
@@ -360,14 +541,7 @@ sub fetch {
 sub close {
   my ($self) = @_;
   hdf5_close($self->{hdf5});
-  foreach my $key (keys %{$self->{st_handles}}) {
-    $self->{st_handles}{$key}->finish;
-  }
-  $self->{sqlite3}->db_handle->disconnect;
-
-  $self->{st_handles} = undef;
-  $self->{hdf5}       = undef;
-  $self->{sqlite3}    = undef;
+  $self->{hdf5} = undef;
 }
 
 =head2 DESTROY
@@ -87,7 +87,18 @@ use Data::Dumper;
       -CORE_DB_ADAPTOR : Bio::EnsEMBL::DBSQL::DBAdaptor (required if creating new HDF5)
       -VAR_DB_ADAPTOR  : Bio::EnsEMBL::Variation::DBSQL::DBAdaptor (required if creating new HDF5)
       -TISSUES         : Array ref of string names (required if creating new HDF5)
-      -DBFILE          : path to SQLite3 file, if non standard
+      -DBFILE          : obsolete, labels are indexed inside the HDF5 file
+      -THREADS         : number of threads compressing data on store
+      -STORAGE         : storage profile of a new HDF5 file (none, deflate,
+                         shuffle_deflate, lz4 or zstd)
+      -DEFLATE         : compression level of a new HDF5 file
+      -ENCODING        : value type of a new HDF5 file (double or float, as
+                         the statistics are not all p-values)
+      -STAGING_MB      : memory budget of the points held back by store
+      -LABEL_FORMAT    : label storage of a new HDF5 file (fixed or blob)
+      -VARIANT_INFO    : GTEx variant table (e.g. GTEx_Analysis_var_info.txt.gz)
+                         to curate the SNPs against offline, instead of
+                         looking each one up in the variation database
     Returntype   : Bio::EnsEMBL::HDF5::EQTLAdaptor
 
 =cut
@@ -95,26 +106,24 @@ use Data::Dumper;
 sub new {
   my $class = shift;
   my ($hdf5_file, $core_db, $variation_db,
-    $tissues, $statistics, $db_file, $snp_id_file, $gene_ids) =
+    $tissues, $statistics, $db_file, $snp_id_file, $gene_ids, $threads, $storage, $deflate, $encoding, $staging_mb, $label_format, $variant_info) =
   rearrange(['FILENAME','CORE_DB_ADAPTOR','VAR_DB_ADAPTOR',
-    'TISSUES','STATISTICS','DBFILE','SNP_IDS', 'GENE_IDS'], @_);
+    'TISSUES','STATISTICS','DBFILE','SNP_IDS', 'GENE_IDS', 'THREADS', 'STORAGE', 'DEFLATE', 'ENCODING', 'STAGING_MB', 'LABEL_FORMAT', 'VARIANT_INFO'], @_);
 
   if (! defined $hdf5_file) {
     die("Cannot create HDF5 adaptor around undef filename!");
   }
-  # If not hdf5 sqlite3 file has provided, create one using base of hdf5 file
-  $db_file ||= $hdf5_file . ".sqlite3";
 
   my $self;
   ## If creating a new database
   if (! -e $hdf5_file || -z $hdf5_file) {
     say 'Creating a new DB (no hdf5 file passed or size 0)';
-    my $curated_snp_id_file = _curate_variant_names($variation_db, $snp_id_file, $hdf5_file.".snp.ids");
+    my $curated_snp_id_file = _curate_variant_names($variation_db, $snp_id_file, $hdf5_file.".snp.ids", $variant_info);
 
     my $snp_count = `wc -l $curated_snp_id_file | sed -e 's/ .*//'`;
     chomp $snp_count;
 
-    my $snp_max_length = `awk 'length(\$0) > max {max = length(\$0)} END {print max}' $curated_snp_id_file`;
+    my $snp_max_length = `awk 'length(\$4) > max {max = length(\$4)} END {print max}' $curated_snp_id_file`;
     chomp($snp_max_length);
 
     my $gene_stats;
@@ -131,7 +140,12 @@ sub new {
 
     $self = $class->SUPER::new(
       -FILENAME   => $hdf5_file,
-      -DBNAME     => $db_file,
+      -THREADS    => $threads,
+      -STORAGE    => $storage,
+      -DEFLATE    => $deflate,
+      -ENCODING   => $encoding,
+      -STAGING_MB => $staging_mb,
+      -LABEL_FORMAT => $label_format,
       -SIZES      => {
         gene      => $gene_stats->{count},
         snp       => $snp_count,
@@ -156,7 +170,7 @@ sub new {
     $self->index_tables;
   } else {
     say "$hdf5_file";
-    $self = $class->SUPER::new(-FILENAME => $hdf5_file, -DBNAME => $db_file);
+    $self = $class->SUPER::new(-FILENAME => $hdf5_file, -THREADS => $threads, -STAGING_MB => $staging_mb);
     $self->{hdf5_file} = $hdf5_file;
   }
 
@@ -244,18 +258,29 @@ sub _store_gene_labels {
   $snps_id_file = list of unique IDs (rs or GTEX) parsed from GTEX file
   $file_hdf5_snps = contains chr, pos, rsID, ID from $snps_id_file.
                     sorted first by chr, then by pos
+  $variant_info = optional GTEx variant table, joined against $snps_id_file by the
+                  curate_snps tool of the C directory ($ENV{CURATE_SNPS} if set).
+                  The table has no consequences, so that column is left empty
 
   Output:
   $seq_region_name	$seq_region_start	$seq_region_end	$rs_id	$old_rs_id	$display_consequence
 =cut
 
 sub _curate_variant_names {
-  my ($variation_db, $snps_id_file, $file_hdf5_snps) = @_;
+  my ($variation_db, $snps_id_file, $file_hdf5_snps, $variant_info) = @_;
 
   if (-e $file_hdf5_snps && ! -z $file_hdf5_snps) {
     return $file_hdf5_snps;
   }
 
+  if (defined $variant_info) {
+    print "Curating dataset variation IDs against $variant_info\n";
+    my $curate = $ENV{CURATE_SNPS} // 'curate_snps';
+    system($curate, $variant_info, $snps_id_file, $file_hdf5_snps) == 0
+      or die "Could not curate '$snps_id_file' against '$variant_info' with $curate";
+    return $file_hdf5_snps;
+  }
+
   print "Storing dataset variation IDs in temporary table\n";
   my $va  = $variation_db->get_adaptor("variation");
 
@@ -292,7 +317,8 @@ sub _curate_variant_names {
 
 =head2 _store_variation_labels
 
-  Counts all the variations and their max ID length throughout the database
+  Stores the variation IDs as SNP labels, and their location and
+  consequence as SNP metadata
   Argument [1] : File location
 
 =cut
@@ -306,31 +332,39 @@ sub _store_variation_labels {
   print "Streaming variation IDs from database\n";
   open my $file2, "<", $snp_id_file;
   my @labels = ();
+  my %meta = map { $_ => [] } qw(chrom start end consequence);
   while (my $line = <$file2>) {
     chomp $line;
     my ($chrom, $start, $end, $name, $given_name, $consequence) = split("\t", $line);
     if (!($given_name eq $name)) {
       $self->{snp_ids}{$given_name} = $name;
     }
-    push @labels, join("\t", ($name, $chrom, $start, $end, $consequence));
+    push @labels, $name;
+    push @{$meta{chrom}}, $chrom;
+    push @{$meta{start}}, $start;
+    push @{$meta{end}}, $end;
+    push @{$meta{consequence}}, $consequence // '';
 
-    # If buffer full, push into SQLite and HDF5 storage
+    # If buffer full, push into HDF5 storage
     if (scalar @labels > 10000) {
-       hdf5_store_dim_labels($self->{hdf5}, 'snp', \@labels);
-       my @rsIds = map {my @array = split("\t", $_); $array[0] } @labels;
-       $self->_insert_into_sqlite3_table('snp', \@rsIds);
-       @labels = ();
+       $self->_store_variation_buffer(\@labels, \%meta);
     }
   }
 
   # Flush out remaining buffer
   if (scalar @labels) {
-    hdf5_store_dim_labels($self->{hdf5}, 'snp', \@labels);
-    my @rsIds = map {my @array = split("\t", $_); $array[0] } @labels;
-    $self->_insert_into_sqlite3_table('snp', \@rsIds);
+    $self->_store_variation_buffer(\@labels, \%meta);
   }
 }
 
+sub _store_variation_buffer {
+  my ($self, $labels, $meta) = @_;
+  hdf5_store_dim_labels($self->{hdf5}, 'snp', $labels);
+  $self->store_dim_meta('snp', $meta);
+  @$labels = ();
+  @$_ = () for values %$meta;
+}
+
 =head2 _load_snp_aliases
 
   Reads off list of SNP id replacements
@@ -380,7 +414,7 @@ sub _by_position {
     Possible dimensions are:
     * gene   : Ensembl gene ID or common name
     * snp    : rsID or Ensembl ID
-    * tissue : string
+    * tissue : string, or arrayref of strings
     * value  : floating point scalar
   Returntype : Arrayref of hashrefs
 
@@ -443,7 +477,9 @@ sub _convert_coords {
     }
   }
 
-  if (defined $coords->{tissue}) {
+  if (ref $coords->{tissue} eq 'ARRAY') {
+    $tissue = [ map { $self->{tissue_ids}{$_} // die("Did not recognise tissue $_\n") } @{$coords->{tissue}} ];
+  } elsif (defined $coords->{tissue}) {
     $tissue = $self->{tissue_ids}{$coords->{tissue}};
     if (! defined $tissue) {
       die("Did not recognise tissue $coords->{tissue}\n");
@@ -489,20 +525,92 @@ sub fetch_all_tissues {
   return $self->get_dim_labels("tissue");
 }
 
+# Fields of the SNP metadata, as returned by fetch
+my %snp_meta_names = (
+  snp_chrom       => 'seq_region_name',
+  snp_start       => 'seq_region_start',
+  snp_end         => 'seq_region_end',
+  snp_consequence => 'display_consequence',
+);
+
 =head2 fetch
 
   Returns all data subject to constraints
   Arg[1]: hash ref of { $dim => $value } constraints
-  Arg[2]: Bool, true if return value augmented with data for web display (snp data and snp consequence)
+  Arg[2]: Optional hash ref of value filters, e.g. { lt => 1e-5 } for p-values below a cutoff,
+          or { top_k => 10, order => 'largest_abs' } for the strongest betas
   Returntype : List ref of hashrefs of {$dim => $value} data points
 
 =cut
 
 sub fetch{
-  my ($self, $constraints) = @_;
-  my $res = $self->SUPER::fetch($constraints);
+  my ($self, $constraints, $filter) = @_;
+  # Rows are built in XS with the SNP metadata, _post_process only renames it
+  return $self->_post_process($constraints, $self->SUPER::fetch($constraints, $filter, {meta => 1}));
+}
+
+=head2 fetch_iterator
+
+  Same as fetch, in batches, see Bio::EnsEMBL::HDF5::ArrayAdaptor::fetch_iterator
+  Arg[1]: hash ref of { $dim => $value } constraints
+  Arg[2]: Optional: maximum number of data points per batch
+  Returntype : Closure which returns the next list ref of hashrefs, or undef once done
+
+=cut
+
+sub fetch_iterator {
+  my ($self, $constraints, $batch_size) = @_;
+  return $self->SUPER::fetch_iterator($constraints, $batch_size, {meta => 1});
+}
+
+=head2 fetch_many
+
+  Same as fetch, for several sets of constraints in one pass over the file
+  Arg[1]: list ref of hash refs of { $dim => $value } constraints
+  Returntype : List ref of list refs of hashrefs of {$dim => $value} data points
+
+=cut
+
+sub fetch_many {
+  my ($self, $constraints_list) = @_;
+  return $self->SUPER::fetch_many($constraints_list, {meta => 1});
+}
+
+=head2 fetch_region
+
+  Returns the data of the SNPs which overlap a genomic interval
+  Arg[1]: Chromosome name
+  Arg[2]: Start (included)
+  Arg[3]: End (included)
+  Arg[4]: Optional hash ref of { $dim => $value } constraints on the other dimensions
+  Arg[5]: Optional hash ref of value filters, see fetch
+  Returntype : List ref of hashrefs of {$dim => $value} data points
+
+=cut
+
+sub fetch_region {
+  my ($self, $chrom, $start, $end, $constraints, $filter) = @_;
+  $constraints ||= {};
+  return $self->_post_process($constraints, $self->SUPER::fetch_region('snp', $chrom, $start, $end, $constraints, $filter, {meta => 1}));
+}
+
+=head2 _post_process
+
+  Names the SNP metadata fields, or splits them out of the SNP labels
+  of files which predate the metadata, and computes -log10 p-values,
+  for both fetch and fetch_iterator
+  Arg[1]: hash ref of { $dim => $value } constraints
+  Arg[2]: List ref of hashrefs of {$dim => $value} data points
+  Returntype : List ref of hashrefs of {$dim => $value} data points
+
+=cut
+
+sub _post_process {
+  my ($self, $constraints, $res) = @_;
   foreach my $correlation (@$res) {
-    if (! exists $constraints->{snp}) {
+    if (exists $correlation->{snp_chrom}) {
+      $correlation->{$snp_meta_names{$_}} = delete $correlation->{$_} for keys %snp_meta_names;
+    } elsif (! exists $constraints->{snp} && defined $correlation->{snp} && index($correlation->{snp}, "\t") >= 0) {
       my ($rs_id, $seq_region_name, $seq_region_start, $seq_region_end, $display_consequence) = split("\t", $correlation->{snp});
       $correlation->{snp}                 = $rs_id;
       $correlation->{seq_region_name}     = $seq_region_name;
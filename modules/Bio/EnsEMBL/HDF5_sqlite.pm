@@ -56,12 +56,27 @@ our @ISA = qw(Exporter);
 our %EXPORT_TAGS = ( 'all' => [ qw(
   hdf5_close
   hdf5_create
+  hdf5_cursor_close
+  hdf5_cursor_next
+  hdf5_extend_dimension
   hdf5_fetch
+  hdf5_fetch_columns
+  hdf5_fetch_many
+  hdf5_fetch_region
+  hdf5_flush
   hdf5_get_dim_labels
+  hdf5_get_dim_names
+  hdf5_get_value
+  hdf5_get_values
+  hdf5_lookup_label
+  hdf5_lookup_labels
   hdf5_get_all_dim_labels
   hdf5_open
+  hdf5_open_cursor
   hdf5_store
+  hdf5_store_packed
   hdf5_store_dim_labels
+  hdf5_store_dim_meta
   hdf5_set_log
 ) ] );
 
@@ -181,6 +196,57 @@ sub hdf5_store_dim_labels {
   $sth->execute_array({}, $dim_labels);
 }
 
+=head2 store_dim_meta
+
+  Appends metadata rows to a dimension, in the order of its labels
+  Argument [1] : Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2] : Dimension name
+  Argument [3] : Hashref { chrom => listref, start => listref, end => listref, consequence => listref }
+
+=cut
+
+sub hdf5_store_dim_meta {
+  my ($sqlite, $dim_name, $columns) = @_;
+  $sqlite->do("CREATE TABLE IF NOT EXISTS ${dim_name}_meta (chrom TEXT, start INTEGER, end INTEGER, consequence TEXT)");
+  my $sth = $sqlite->prepare("INSERT INTO ${dim_name}_meta (chrom, start, end, consequence) VALUES (?, ?, ?, ?)");
+  $sth->execute_array({}, @$columns{qw(chrom start end consequence)});
+}
+
+=head2 _get_all_dim_meta
+
+  Get the metadata of all dimensions which have any
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Returntype: Hashref { dimension name => listref of listrefs [chrom, start, end, consequence] }
+
+=cut
+
+sub _get_all_dim_meta {
+  my ($sqlite) = @_;
+  my %meta = ();
+  foreach my $dim_name (@{_get_all_dim_names($sqlite)}) {
+    my ($exists) = $sqlite->db_handle->selectrow_array("SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = ?", {}, "${dim_name}_meta");
+    if ($exists) {
+      $meta{$dim_name} = $sqlite->db_handle->selectall_arrayref("SELECT chrom, start, end, consequence FROM ${dim_name}_meta ORDER BY rowid");
+    }
+  }
+  return \%meta;
+}
+
+=head2 extend_dimension
+
+  Appends values to a dimension. SQLite tables have no fixed size,
+  so this only stores the new labels
+  Argument [1] : Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2] : Dimension name
+  Argument [3] : Listref of new labels for that dimension
+
+=cut
+
+sub hdf5_extend_dimension {
+  my ($sqlite, $dim_name, $dim_labels) = @_;
+  hdf5_store_dim_labels($sqlite, $dim_name, $dim_labels);
+}
+
 =head2 _get_all_dim_names
 
   Get all dimension names
@@ -197,6 +263,19 @@ sub _get_all_dim_names {
   return \@names;
 }
 
+=head2 hdf5_get_dim_names
+
+  Get all dimension names, in the order of packed coordinates
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Returntype: Listref(dimension names)
+
+=cut
+
+sub hdf5_get_dim_names {
+  my ($sqlite) = @_;
+  return _get_all_dim_names($sqlite);
+}
+
 =head2 hdf5_get_all_dim_labels
 
   Get all labels associated to all dimensions
@@ -229,6 +308,76 @@ sub hdf5_get_dim_labels {
   return \@labels;
 }
 
+=head2 lookup_label
+
+  Index of a label, matched on its text before any tab
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Dimension name
+  Argument [3]: Label
+  Returntype: Integer, undef if the label is unknown
+
+=cut
+
+sub hdf5_lookup_label {
+  my ($sqlite, $dim_name, $label) = @_;
+  return hdf5_lookup_labels($sqlite, $dim_name, [$label])->[0];
+}
+
+=head2 lookup_labels
+
+  Indices of several labels
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Dimension name
+  Argument [3]: Listref of labels
+  Returntype: Listref of integers in the order of the labels, undef where unknown
+
+=cut
+
+sub hdf5_lookup_labels {
+  my ($sqlite, $dim_name, $labels) = @_;
+  ## Row ids start at 1, indices at 0
+  my $sth = $sqlite->prepare("SELECT MIN(rowid) - 1 FROM $dim_name WHERE label = ? OR substr(label, 1, length(?) + 1) = ? || char(9)");
+  my @indices = map {
+    $sth->execute($_, $_, $_);
+    my ($index) = $sth->fetchrow_array;
+    $index;
+  } @$labels;
+  return \@indices;
+}
+
+=head2 get_value
+
+  Get the value of a single cell
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Hashref { dimension name => dimension value }, for every dimension
+  Returntype: scalar, 0 for an empty cell
+
+=cut
+
+sub hdf5_get_value {
+  my ($sqlite, $point) = @_;
+  my @dim_names = keys %$point;
+  my $sth = $sqlite->prepare("SELECT value FROM matrix WHERE ".join(" AND ", map { "$_ = ?" } @dim_names));
+  $sth->execute(map { $point->{$_} } @dim_names);
+  my @row = $sth->fetchrow_array;
+  $sth->finish;
+  return scalar @row ? $row[0] : 0;
+}
+
+=head2 get_values
+
+  Get the values of a list of cells
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Listref of hashrefs { dimension name => dimension value }
+  Returntype: Listref of scalars, in the order of the cells
+
+=cut
+
+sub hdf5_get_values {
+  my ($sqlite, $points) = @_;
+  return [ map { hdf5_get_value($sqlite, $_) } @$points ];
+}
+
 =head2 store
 
   Stores a bunch of datapoints into the matrix
@@ -253,17 +402,156 @@ sub hdf5_store {
 
 }
 
+=head2 hdf5_store_packed
+
+  Store data points given as packed buffers
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: pack('Q*') string of dimension indices, point by point, in the order of hdf5_get_dim_names
+  Argument [3]: pack('d*') string of values
+
+=cut
+
+sub hdf5_store_packed {
+  my ($sqlite, $coords, $values) = @_;
+  my $dim_names = hdf5_get_dim_names($sqlite);
+  my @coords = unpack('Q*', ref $coords ? $$coords : $coords);
+  my @values = unpack('d*', ref $values ? $$values : $values);
+  my @points = map {
+    my $point = { value => $values[$_] };
+    @$point{@$dim_names} = @coords[$_ * @$dim_names .. ($_ + 1) * @$dim_names - 1];
+    $point;
+  } 0 .. $#values;
+  hdf5_store($sqlite, \@points);
+}
+
 =head2 fetch
 
   Fetches all values that fit a given pattern
   Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
   Argument [2]: Hashref { dimension name => required dimension_value }
+  Argument [3]: Optional: Hashref of value filters, see _apply_filter
+  Argument [4]: Optional: Hashref of fetch options, see open_cursor
   Returntype: Listref of hashrefs { dimension name => dimension label, value => scalar }
 
 =cut
 
 sub hdf5_fetch {
-  my ($sqlite, $constraints) = @_;
+  my ($sqlite, $constraints, $filter, $options) = @_;
+  my $cursor = hdf5_open_cursor($sqlite, $constraints, $options);
+  my @array = ();
+  while (my $batch = hdf5_cursor_next($cursor, 0)) {
+    push @array, @$batch;
+  }
+  hdf5_cursor_close($cursor);
+  return defined $filter ? _apply_filter(\@array, $filter) : \@array;
+}
+
+=head2 fetch_columns
+
+  Fetches all values that fit a given pattern, column by column
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Hashref { dimension name => required dimension_value }
+  Argument [3]: Optional: Hashref of value filters, see _apply_filter
+  Returntype: Hashref { field name => listref of values, one per row }
+
+=cut
+
+sub hdf5_fetch_columns {
+  my ($sqlite, $constraints, $filter) = @_;
+  my $rows = hdf5_fetch($sqlite, $constraints, $filter, { meta => 1 });
+  my %columns = ();
+  foreach my $row (@$rows) {
+    foreach my $key (keys %$row) {
+      push @{$columns{$key}}, $row->{$key};
+    }
+  }
+  return \%columns;
+}
+
+=head2 _apply_filter
+
+  Argument [1]: Listref of hashrefs { dimension name => dimension label, value => scalar }
+  Argument [2]: Hashref: lt, gt or abs_gt => threshold, and/or top_k => count
+                with order => 'largest' (default), 'smallest' or 'largest_abs'
+  Returntype: Listref of hashrefs, best first if top_k is set
+
+=cut
+
+sub _apply_filter {
+  my ($points, $filter) = @_;
+  my @res = @$points;
+  if (defined $filter->{lt}) {
+    @res = grep { $_->{value} < $filter->{lt} } @res;
+  } elsif (defined $filter->{gt}) {
+    @res = grep { $_->{value} > $filter->{gt} } @res;
+  } elsif (defined $filter->{abs_gt}) {
+    @res = grep { abs($_->{value}) > $filter->{abs_gt} } @res;
+  }
+  if ($filter->{top_k}) {
+    my $order = $filter->{order} || 'largest';
+    if ($order eq 'smallest') {
+      @res = sort { $a->{value} <=> $b->{value} } @res;
+    } elsif ($order eq 'largest_abs') {
+      @res = sort { abs($b->{value}) <=> abs($a->{value}) } @res;
+    } else {
+      @res = sort { $b->{value} <=> $a->{value} } @res;
+    }
+    splice(@res, $filter->{top_k}) if scalar @res > $filter->{top_k};
+  }
+  return \@res;
+}
+
+=head2 fetch_region
+
+  Fetches the values of the rows of a dimension which overlap a genomic interval
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Dimension name, with metadata
+  Argument [3]: Chromosome name
+  Argument [4]: Start (included)
+  Argument [5]: End (included)
+  Argument [6]: Optional: Hashref of constraints on the other dimensions, see hdf5_open_cursor
+  Argument [7]: Optional: Hashref of value filters, see _apply_filter
+  Argument [8]: Optional: Hashref of fetch options, see open_cursor
+  Returntype: Listref of hashrefs { dimension name => dimension label, value => scalar }
+
+=cut
+
+sub hdf5_fetch_region {
+  my ($sqlite, $dim_name, $chrom, $start, $end, $constraints, $filter, $options) = @_;
+  my $rows = $sqlite->db_handle->selectcol_arrayref("SELECT rowid - 1 FROM ${dim_name}_meta WHERE chrom = ? AND start <= ? AND end >= ? ORDER BY rowid", {}, $chrom, $end, $start);
+  return hdf5_fetch($sqlite, { %{$constraints || {}}, $dim_name => $rows }, $filter, $options);
+}
+
+=head2 fetch_many
+
+  Fetches the values that fit each of a list of patterns
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Listref of hashrefs { dimension name => required dimension_value }
+  Argument [3]: Optional: Hashref of fetch options, see open_cursor
+  Returntype: Listref of listrefs of hashrefs { dimension name => dimension label, value => scalar },
+              in the order of the patterns
+
+=cut
+
+sub hdf5_fetch_many {
+  my ($sqlite, $constraints_list, $options) = @_;
+  return [ map { hdf5_fetch($sqlite, $_, undef, $options) } @$constraints_list ];
+}
+
+=head2 open_cursor
+
+  Prepares an incremental fetch of all values that fit a given pattern
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+  Argument [2]: Hashref { dimension name => required dimension_value, listref of values,
+                or hashref { start => value, end => value } (end excluded) }
+  Argument [3]: Optional: Hashref of fetch options: meta => 1 adds the <dim>_chrom, <dim>_start,
+                <dim>_end and <dim>_consequence fields of dimensions with metadata to the rows
+  Returntype: Cursor, to be passed to hdf5_cursor_next and hdf5_cursor_close
+
+=cut
+
+sub hdf5_open_cursor {
+  my ($sqlite, $constraints, $options) = @_;
 
   # Remove null constraints
   foreach my $key (keys %$constraints) {
@@ -276,27 +564,87 @@ sub hdf5_fetch {
   push @$dim_names, "value";
 
   my @constrained_dims = keys %$constraints;
-  my %hash = map { $_ => 1 } @constrained_dims;
+  # Dimensions constrained to a list or range of values are still returned
+  my %hash = map { $_ => 1 } grep { ! ref $constraints->{$_} } @constrained_dims;
   my @free_dims = grep { ! exists $hash{$_} } @$dim_names;
   my $free_dims_string = join(", ", @free_dims);
   my $constraints_string = '';
   if (scalar @constrained_dims) {
-    defined $constraints->{$_} or delete $constraints->{$_} for keys %{$constraints};
-    if( scalar(keys %{$constraints}) > 0 ) {
-      $constraints_string = "WHERE ".join(" AND ", map { "$_ = $constraints->{$_}" } @constrained_dims);
-    }
+    $constraints_string = "WHERE ".join(" AND ", map { _constraint_sql($_, $constraints->{$_}) } @constrained_dims);
   }
 
   my $sql_command = "SELECT $free_dims_string FROM matrix $constraints_string";
   my $sth = $sqlite->prepare($sql_command);
   $sth->execute;
+  return { sth => $sth, dim_labels => $dim_labels, dim_meta => $options && $options->{meta} ? _get_all_dim_meta($sqlite) : {} };
+}
+
+=head2 _constraint_sql
+
+  Argument [1]: Dimension name
+  Argument [2]: Index, listref of indices, or hashref { start => index, end => index } (end excluded)
+  Returntype: SQL condition
+
+=cut
+
+sub _constraint_sql {
+  my ($dim_name, $constraint) = @_;
+  if (ref $constraint eq 'ARRAY') {
+    return scalar @$constraint ? "$dim_name IN (".join(", ", @$constraint).")" : "0";
+  } elsif (ref $constraint eq 'HASH') {
+    return "$dim_name >= $constraint->{start} AND $dim_name < $constraint->{end}";
+  } else {
+    return "$dim_name = $constraint";
+  }
+}
+
+=head2 cursor_next
+
+  Fetches the next values from a cursor
+  Argument [1]: Cursor
+  Argument [2]: Maximum number of values returned, 0 for all remaining values
+  Returntype: Listref of hashrefs { dimension name => dimension label, value => scalar },
+              undef once the cursor is exhausted
+
+=cut
+
+sub hdf5_cursor_next {
+  my ($cursor, $batch_size) = @_;
+  my $dim_labels = $cursor->{dim_labels};
   my @array = ();
-  while (my $row = $sth->fetchrow_hashref) {
-    my %hash = map { $_ => $dim_labels->{$_}->[$row->{$_}]} keys $row;
+  while ((!$batch_size || scalar @array < $batch_size) && (my $row = $cursor->{sth}->fetchrow_hashref)) {
+    my %hash = map { $_ => $dim_labels->{$_}->[$row->{$_}]} keys %$row;
     $hash{value} = $row->{value};
+    foreach my $dim_name (grep { exists $row->{$_} } keys %{$cursor->{dim_meta}}) {
+      my $meta = $cursor->{dim_meta}{$dim_name}[$row->{$dim_name}] || [];
+      @hash{map { "${dim_name}_$_" } qw(chrom start end consequence)} = @$meta;
+    }
     push @array, \%hash;
   }
-  return \@array;
+  return scalar @array ? \@array : undef;
+}
+
+=head2 cursor_close
+
+  Releases a cursor
+  Argument [1]: Cursor
+
+=cut
+
+sub hdf5_cursor_close {
+  my ($cursor) = @_;
+  $cursor->{sth}->finish;
+}
+
+=head2 flush
+
+  Writes pending updates out, a no-op as SQLite commits as it goes
+  Argument [1]: Bio::EnsEMBL::DBSQL::DBConnection
+
+=cut
+
+sub hdf5_flush {
+  my ($sqlite) = @_;
 }
 
 =head2 close
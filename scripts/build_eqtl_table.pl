@@ -55,9 +55,7 @@ sub main {
     $fill = 1;
   }
 
-  $options{sqlite3} ||= $options{hdf5} . ".sqlite3";
-
-  print "Opening file $options{sqlite3}\n";
+  print "Opening file $options{hdf5}\n";
   my $eqtl_adaptor = build_eqtl_table(\%options);
 
   ## Stash the content of the files
@@ -74,7 +72,7 @@ sub main {
 
 sub get_options {
   my %options = ();
-  GetOptions(\%options, "help=s", "host|h=s", "port|p=s", "species|s=s", "user|u=s", "pass|p=s", "tissues|t=s@", "files|f=s@","hdf5=s", "sqlite3|d=s");
+  GetOptions(\%options, "help=s", "host|h=s", "port|p=s", "species|s=s", "user|u=s", "pass|p=s", "tissues|t=s@", "files|f=s@","hdf5=s", "sqlite3|d=s", "staging_mb=i", "variant_info=s");
   if (defined $options{tissues} 
       && defined $options{files} 
       && (scalar @{$options{tissues}} != scalar @{$options{files}})) {
@@ -133,8 +131,9 @@ sub build_eqtl_table {
           -var_db_adaptor   => $registry->get_DBAdaptor('human', 'variation'),
           -tissues          => $options->{tissues},
           -statistics       => ['beta','p-value'],
-          -dbfile           => $options->{sqlite3},
           -snp_ids          => $snp_id_file,
+          -staging_mb       => $options->{staging_mb},
+          -variant_info     => $options->{variant_info},
   )
 }
 
@@ -64,34 +64,56 @@ sub main {
             -var_db_adaptor => $registry->get_DBAdaptor('human', 'variation'),
   );
 
-  my $results = $eqtl_adaptor->fetch( {
+  my $constraints = {
       gene        => $options->{gene},
       tissue      => $options->{tissue},
       snp         => $options->{snp},
       statistic   => $options->{statistic},
-      chromosome  => $options->{chromosome},
-      position    => $options->{position},
-      });
-  print scalar(@$results)."\n";
+  };
+  my $iterator;
+  if (defined $options->{chromosome}) {
+    # Region queries read the SNPs of the interval through the position index
+    my $start = $options->{position} // $options->{start} // 1;
+    my $end = $options->{position} // $options->{end} // ~0;
+    my $results = $eqtl_adaptor->fetch_region($options->{chromosome}, $start, $end, $constraints);
+    $iterator = sub { my $batch = $results; $results = undef; return $batch };
+  } else {
+    # Results are streamed in batches, so that large queries run in bounded memory
+    $iterator = $eqtl_adaptor->fetch_iterator($constraints);
+  }
 
-  print join("\t", qw/tissue snp gene statistic value chromosome position/)."\n";
-  foreach my $result (@$results) {
-    foreach my $column (qw/tissue snp gene statistic value chromosome position/) {
-      if (defined $options->{$column}) {
-        print "*$options->{$column}\t";
-      } else {
-        print "$result->{$column}\t";
+  # Rows are spooled to a temporary file so that the count still comes first
+  my ($spool, $spool_file) = tempfile(UNLINK => 1);
+  my $count = 0;
+  while (my $results = $iterator->()) {
+    foreach my $result (@$results) {
+      foreach my $column (qw/tissue snp gene statistic value chromosome position/) {
+        if (defined $options->{$column}) {
+          print $spool "*$options->{$column}\t";
+        } elsif ($column eq 'chromosome') {
+          print $spool "$result->{seq_region_name}\t";
+        } elsif ($column eq 'position') {
+          print $spool "$result->{seq_region_start}\t";
+        } else {
+          print $spool "$result->{$column}\t";
+        }
       }
+      print $spool "\n";
     }
-    print "\n";
+    $count += scalar(@$results);
   }
+  close $spool;
+
+  print "$count\n";
+  print join("\t", qw/tissue snp gene statistic value chromosome position/)."\n";
+  copy($spool_file, \*STDOUT);
 
   $eqtl_adaptor->close;
 }
 
 sub get_options {
   my %options = ();
-  GetOptions(\%options, "help=s", "host|h=s", "port|p=s", "user|u=s", "pass|p=s", "tissue=s", "gene=s", "snp=s", "statistic=s", "hdf5=s", "sqlite3|d=s");
+  GetOptions(\%options, "help=s", "host|h=s", "port|p=s", "user|u=s", "pass|p=s", "tissue=s", "gene=s", "snp=s", "statistic=s", "chromosome=s", "position=i", "start=i", "end=i", "hdf5=s", "sqlite3|d=s");
   if (defined $options{tissues}
       && defined $options{files}
       && (scalar @{$options{tissues}} != scalar @{$options{files}})) {
@@ -83,6 +83,11 @@ ok(abs($data_point->{value} - .1) < 1e-4);
 # Test whether an error is raised when an unkown gene is requested
 ok(eval {$aa->fetch({gene => 'C'}); 0;} || 1);
 
+# Reversed or unknown range ends match nothing
+ok(scalar(@{$aa->fetch({gene => {start => 'B', end => 'A'}})}) == 0);
+ok(scalar(@{$aa->fetch({gene => {start => 'A', end => 'Q'}})}) == 0);
+ok(scalar(@{$aa->fetch({gene => {start => 'A', end => 'B'}})}) == 2);
+
 $aa->close;
 
 done_testing;
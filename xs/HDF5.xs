@@ -20,19 +20,490 @@
 #include "ppport.h"
 
 struct hdf5_file_st {
-	hid_t file;
+	FileContext * file;
 	HV * dim_indices;
 	int * dim_name_lengths;
 };
 
+// Metadata dictionaries of a file, read once per fetch or cursor
+typedef struct meta_dictionaries_st {
+	StringArray * chroms;
+	StringArray * consequences;
+} MetaDictionaries;
+
+struct hdf5_cursor_st {
+	struct hdf5_file_st * file;
+	Cursor * cursor;
+	// NULL unless the rows carry metadata
+	MetaDictionaries * meta;
+};
+
+// Reads a constraint hash ref to fill two C arrays (set_dims and constraints) with values
+static void read_constraints(struct hdf5_file_st * file_st, HV * constraints_hv, bool * set_dims, hsize_t * constraints) {
+	int index, dim, constraint_count;
+	char * dim_name;
+	I32 length;
+
+	constraint_count = hv_iterinit(constraints_hv);
+	for (index = 0; index < constraint_count; index++) {
+		// Iteration
+		HE * hash_entry = hv_iternext(constraints_hv);
+
+		// Extract info from hash entry
+		dim_name = hv_iterkey(hash_entry, &length);
+		dim = SvIV(*hv_fetch(file_st->dim_indices, dim_name, strlen(dim_name), 0));
+
+		// Updating C data
+		set_dims[dim] = 1;
+		constraints[dim] = SvIV(hv_iterval(constraints_hv, hash_entry));
+	}
+}
+
+// Reads a hash ref of dimension name => index into coords, every dimension must be set
+static void read_point(struct hdf5_file_st * file_st, HV * point_hv, hsize_t rank, hsize_t * coords) {
+	hsize_t dim;
+	StringArray * dim_names_sa = get_dim_names(file_st->file);
+	for (dim = 0; dim < rank; dim++) {
+		char * dim_name = get_string_in_array(dim_names_sa, dim);
+		SV ** coord_sv = hv_fetch(point_hv, dim_name, file_st->dim_name_lengths[dim], 0);
+		if (coord_sv == NULL) {
+			printf("Point lookups need a value for dimension '%s'!\n", dim_name);
+			exit(1);
+		}
+		coords[dim] = SvIV(*coord_sv);
+	}
+}
+
+// Returns true if any constraint is a range or a list of values rather than a single value
+static bool has_range_constraints(HV * constraints_hv) {
+	HE * hash_entry;
+	hv_iterinit(constraints_hv);
+	while ((hash_entry = hv_iternext(constraints_hv)) != NULL)
+		if (SvROK(hv_iterval(constraints_hv, hash_entry)))
+			return true;
+	return false;
+}
+
+// Reads a constraint hash ref into one DimConstraint per dimension. Each value can be 
+// an index, an array ref of indices, or a hash ref {start => index, end => index} (end excluded).
+// Returns false if an empty list or range of indices rules out any match
+static bool read_range_constraints(struct hdf5_file_st * file_st, HV * constraints_hv, DimConstraint * ranges) {
+	int index, dim, constraint_count;
+	hsize_t interval;
+	char * dim_name;
+	I32 length;
+	bool satisfiable = true;
+
+	constraint_count = hv_iterinit(constraints_hv);
+	for (index = 0; index < constraint_count; index++) {
+		// Iteration
+		HE * hash_entry = hv_iternext(constraints_hv);
+		SV * value_sv = hv_iterval(constraints_hv, hash_entry);
+
+		// Extract info from hash entry
+		dim_name = hv_iterkey(hash_entry, &length);
+		dim = SvIV(*hv_fetch(file_st->dim_indices, dim_name, strlen(dim_name), 0));
+
+		// Updating C data
+		if (SvROK(value_sv) && SvTYPE(SvRV(value_sv)) == SVt_PVAV) {
+			AV * values_av = (AV *) SvRV(value_sv);
+			ranges[dim].count = av_len(values_av) + 1;
+			if (ranges[dim].count == 0) {
+				satisfiable = false;
+				continue;
+			}
+			ranges[dim].lo = calloc(ranges[dim].count, sizeof(hsize_t));
+			ranges[dim].hi = calloc(ranges[dim].count, sizeof(hsize_t));
+			for (interval = 0; interval < ranges[dim].count; interval++) {
+				ranges[dim].lo[interval] = SvIV(*av_fetch(values_av, interval, 0));
+				ranges[dim].hi[interval] = ranges[dim].lo[interval] + 1;
+			}
+		} else if (SvROK(value_sv) && SvTYPE(SvRV(value_sv)) == SVt_PVHV) {
+			HV * range_hv = (HV *) SvRV(value_sv);
+			SV ** start_sv = hv_fetch(range_hv, "start", 5, 0);
+			SV ** end_sv = hv_fetch(range_hv, "end", 3, 0);
+			if (start_sv == NULL || end_sv == NULL) {
+				printf("Range on dimension '%s' needs a start and an end!\n", dim_name);
+				exit(1);
+			}
+			if (SvIV(*end_sv) <= SvIV(*start_sv)) {
+				satisfiable = false;
+				continue;
+			}
+			ranges[dim].count = 1;
+			ranges[dim].lo = calloc(1, sizeof(hsize_t));
+			ranges[dim].hi = calloc(1, sizeof(hsize_t));
+			ranges[dim].lo[0] = SvIV(*start_sv);
+			ranges[dim].hi[0] = SvIV(*end_sv);
+		} else {
+			ranges[dim].count = 1;
+			ranges[dim].lo = calloc(1, sizeof(hsize_t));
+			ranges[dim].hi = calloc(1, sizeof(hsize_t));
+			ranges[dim].lo[0] = SvIV(value_sv);
+			ranges[dim].hi[0] = ranges[dim].lo[0] + 1;
+		}
+	}
+	return satisfiable;
+}
+
+static void free_range_constraints(DimConstraint * ranges, hsize_t rank) {
+	hsize_t dim;
+	for (dim = 0; dim < rank; dim++) {
+		if (ranges[dim].count) {
+			free(ranges[dim].lo);
+			free(ranges[dim].hi);
+		}
+	}
+	free(ranges);
+}
+
+// Reads an optional filter hash ref: at most one of lt, gt or abs_gt => threshold, 
+// and optionally top_k => count with order => largest, smallest or largest_abs
+static ValueFilter * read_filter(SV * filter_sv, ValueFilter * filter) {
+	HV * filter_hv;
+	SV ** value_sv;
+
+	if (filter_sv == NULL || !SvROK(filter_sv))
+		return NULL;
+	filter_hv = (HV *) SvRV(filter_sv);
+	memset(filter, 0, sizeof(ValueFilter));
+
+	if ((value_sv = hv_fetch(filter_hv, "lt", 2, 0)) != NULL) {
+		filter->predicate = VALUE_LT;
+		filter->threshold = SvNV(*value_sv);
+	} else if ((value_sv = hv_fetch(filter_hv, "gt", 2, 0)) != NULL) {
+		filter->predicate = VALUE_GT;
+		filter->threshold = SvNV(*value_sv);
+	} else if ((value_sv = hv_fetch(filter_hv, "abs_gt", 6, 0)) != NULL) {
+		filter->predicate = VALUE_ABS_GT;
+		filter->threshold = SvNV(*value_sv);
+	}
+
+	if ((value_sv = hv_fetch(filter_hv, "top_k", 5, 0)) != NULL)
+		filter->top_k = SvUV(*value_sv);
+	if ((value_sv = hv_fetch(filter_hv, "order", 5, 0)) != NULL) {
+		char * order = SvPV_nolen(*value_sv);
+		if (strcmp(order, "smallest") == 0)
+			filter->order = TOP_SMALLEST;
+		else if (strcmp(order, "largest_abs") == 0)
+			filter->order = TOP_LARGEST_ABS;
+		else if (strcmp(order, "largest") == 0)
+			filter->order = TOP_LARGEST;
+		else {
+			printf("Unknown order '%s'!\n", order);
+			exit(1);
+		}
+	}
+	return filter;
+}
+
+// Reads {threads => N, storage => profile, level => N, encoding => type, staging_mb => N,
+// labels => 'fixed' or 'blob'},
+// deflate => level being short for a deflate profile. Returns NULL if no hash ref was given
+static FileOptions * read_file_options(SV * options_sv, FileOptions * options) {
+	HV * options_hv;
+	SV ** value_sv;
+
+	if (options_sv == NULL || !SvROK(options_sv))
+		return NULL;
+	options_hv = (HV *) SvRV(options_sv);
+	memset(options, 0, sizeof(FileOptions));
+
+	if ((value_sv = hv_fetch(options_hv, "threads", 7, 0)) != NULL)
+		options->threads = SvIV(*value_sv);
+	if ((value_sv = hv_fetch(options_hv, "deflate", 7, 0)) != NULL && SvIV(*value_sv) > 0) {
+		options->storage = STORAGE_DEFLATE;
+		options->level = SvIV(*value_sv);
+	}
+	if ((value_sv = hv_fetch(options_hv, "storage", 7, 0)) != NULL) {
+		char * storage = SvPV_nolen(*value_sv);
+		if (strcmp(storage, "none") == 0)
+			options->storage = STORAGE_NONE;
+		else if (strcmp(storage, "deflate") == 0)
+			options->storage = STORAGE_DEFLATE;
+		else if (strcmp(storage, "shuffle_deflate") == 0)
+			options->storage = STORAGE_SHUFFLE_DEFLATE;
+		else if (strcmp(storage, "lz4") == 0)
+			options->storage = STORAGE_LZ4;
+		else if (strcmp(storage, "zstd") == 0)
+			options->storage = STORAGE_ZSTD;
+		else {
+			printf("Unknown storage profile '%s'!\n", storage);
+			exit(1);
+		}
+	}
+	if ((value_sv = hv_fetch(options_hv, "staging_mb", 10, 0)) != NULL && SvNV(*value_sv) > 0)
+		options->staging_bytes = SvNV(*value_sv) * 1024 * 1024;
+	if ((value_sv = hv_fetch(options_hv, "level", 5, 0)) != NULL)
+		options->level = SvIV(*value_sv);
+	if ((value_sv = hv_fetch(options_hv, "labels", 6, 0)) != NULL) {
+		char * format = SvPV_nolen(*value_sv);
+		if (strcmp(format, "fixed") == 0)
+			options->label_format = LABELS_FIXED;
+		else if (strcmp(format, "blob") == 0)
+			options->label_format = LABELS_BLOB;
+		else {
+			printf("Unknown label format '%s'!\n", format);
+			exit(1);
+		}
+	}
+	if ((value_sv = hv_fetch(options_hv, "encoding", 8, 0)) != NULL) {
+		char * encoding = SvPV_nolen(*value_sv);
+		if (strcmp(encoding, "double") == 0)
+			options->encoding = ENCODING_DOUBLE;
+		else if (strcmp(encoding, "float") == 0)
+			options->encoding = ENCODING_FLOAT;
+		else if (strcmp(encoding, "neg_log10_p") == 0)
+			options->encoding = ENCODING_NEG_LOG10_U16;
+		else {
+			printf("Unknown value encoding '%s'!\n", encoding);
+			exit(1);
+		}
+	}
+	return options;
+}
+
+// Index of a dimension from its name, exits if unknown
+static hsize_t read_dim_index(struct hdf5_file_st * file_st, SV * dim_name_sv) {
+	char * dim_name = SvPV_nolen(dim_name_sv);
+	SV ** dim_sv = hv_fetch(file_st->dim_indices, dim_name, strlen(dim_name), 0);
+	if (dim_sv == NULL) {
+		printf("Dimension '%s' unknown!\n", dim_name);
+		exit(1);
+	}
+	return SvIV(*dim_sv);
+}
+
+// Returns the bytes of a packed string, or of the scalar it references
+// (e.g. the data ref of a PDL). Misaligned buffers are copied into *copy.
+static char * read_packed_buffer(SV * packed_sv, STRLEN * length, char ** copy) {
+	char * buffer;
+	if (SvROK(packed_sv))
+		packed_sv = SvRV(packed_sv);
+	buffer = SvPV(packed_sv, *length);
+	*copy = NULL;
+	if ((uintptr_t) buffer % sizeof(hsize_t)) {
+		*copy = malloc(*length);
+		memcpy(*copy, buffer, *length);
+		buffer = *copy;
+	}
+	return buffer;
+}
+
+// Codes of strings_av in a metadata dictionary, which is extended and
+// written back if new strings come up
+static void encode_meta_strings(FileContext * file, char * name, AV * strings_av, hsize_t count, unsigned int * codes) {
+	StringArray * dictionary = get_meta_dictionary(file, name);
+	hsize_t known = dictionary ? dictionary->count : 0;
+	hsize_t total = known, index;
+	char ** strings = calloc(known + count, sizeof(char *));
+	HV * codes_hv = newHV();
+	SV ** code_sv;
+
+	for (index = 0; index < known; index++) {
+		strings[index] = get_string_in_array(dictionary, index);
+		hv_store(codes_hv, strings[index], strlen(strings[index]), newSVuv(index), 0);
+	}
+	for (index = 0; index < count; index++) {
+		STRLEN length;
+		char * string = SvPV(*av_fetch(strings_av, index, 0), length);
+		if ((code_sv = hv_fetch(codes_hv, string, length, 0)) != NULL)
+			codes[index] = SvUV(*code_sv);
+		else {
+			codes[index] = total;
+			strings[total] = string;
+			hv_store(codes_hv, string, length, newSVuv(total++), 0);
+		}
+	}
+	if (total > known)
+		store_meta_dictionary(file, name, total, strings);
+
+	SvREFCNT_dec((SV *) codes_hv);
+	free(strings);
+	if (dictionary)
+		destroy_string_array(dictionary);
+}
+
+static SV * decode_meta_string(StringArray * dictionary, unsigned int code) {
+	if (dictionary == NULL || code >= dictionary->count)
+		return newSV(0);
+	return newSVpv(get_string_in_array(dictionary, code), 0);
+}
+
+static const char * meta_fields[] = {"chrom", "start", "end", "consequence"};
+#define META_FIELD_COUNT 4
+
+static void meta_field_svs(DimMeta * meta, StringArray * chroms, StringArray * consequences, SV ** svs) {
+	svs[0] = decode_meta_string(chroms, meta->chrom);
+	svs[1] = newSVuv(meta->start);
+	svs[2] = newSVuv(meta->end);
+	svs[3] = decode_meta_string(consequences, meta->consequence);
+}
+
+// Metadata fields are keyed <dim>_chrom, <dim>_start, <dim>_end and <dim>_consequence
+static SV * meta_field_key(StringResultTable * table, int dim, int field) {
+	return newSVpvf("%s_%s", table->dims[dim], meta_fields[field]);
+}
+
+static MetaDictionaries * read_meta_dictionaries(struct hdf5_file_st * file_st) {
+	MetaDictionaries * meta = calloc(1, sizeof(MetaDictionaries));
+	meta->chroms = get_meta_dictionary(file_st->file, "chrom");
+	meta->consequences = get_meta_dictionary(file_st->file, "consequence");
+	return meta;
+}
+
+// Reads an optional fetch option hash ref: meta => 1 adds the metadata
+// fields to the rows. Returns NULL if the rows carry no metadata
+static MetaDictionaries * read_fetch_options(struct hdf5_file_st * file_st, SV * options_sv) {
+	SV ** meta_sv;
+	if (options_sv == NULL || !SvROK(options_sv))
+		return NULL;
+	if ((meta_sv = hv_fetch((HV *) SvRV(options_sv), "meta", 4, 0)) == NULL || !SvTRUE(*meta_sv))
+		return NULL;
+	return read_meta_dictionaries(file_st);
+}
+
+static void destroy_meta_dictionaries(MetaDictionaries * meta) {
+	if (meta == NULL)
+		return;
+	if (meta->chroms)
+		destroy_string_array(meta->chroms);
+	if (meta->consequences)
+		destroy_string_array(meta->consequences);
+	free(meta);
+}
+
+// Appends hash refs built from the rows of a C-style StringResultTable object,
+// with the metadata fields of their labels if meta is set
+static void push_result_rows(struct hdf5_file_st * file_st, StringResultTable * table, AV * results_av, MetaDictionaries * meta) {
+	hsize_t index;
+	int dim, field;
+	HV * row_hv;
+	SV * meta_svs[META_FIELD_COUNT];
+	DimMeta * dim_meta;
+	// Metadata keys of each column, built once. NULL if the rows carry no metadata
+	SV ** meta_keys = NULL;
+
+	if (meta && table->dim_meta) {
+		meta_keys = calloc(table->columns * META_FIELD_COUNT, sizeof(SV *));
+		for (dim = 0; dim < table->columns; dim++)
+			if (table->dim_meta[dim])
+				for (field = 0; field < META_FIELD_COUNT; field++)
+					meta_keys[dim * META_FIELD_COUNT + field] = meta_field_key(table, dim, field);
+	}
+
+	av_extend(results_av, av_len(results_av) + 1 + table->rows);
+	for (index = 0; index < table->rows; index++) {
+		// Create hash ref from row of C-style StringResultTable object
+		row_hv = newHV();
+		for (dim = 0; dim < table->columns; dim++) {
+			hv_store(row_hv, table->dims[dim], file_st->dim_name_lengths[table->dim_indices[dim]], newSVpv(get_result_label(table, dim, index), 0), 0);
+			if (meta_keys && (dim_meta = get_result_meta(table, dim, index)) != NULL) {
+				meta_field_svs(dim_meta, meta->chroms, meta->consequences, meta_svs);
+				for (field = 0; field < META_FIELD_COUNT; field++)
+					hv_store_ent(row_hv, meta_keys[dim * META_FIELD_COUNT + field], meta_svs[field], 0);
+			}
+		}
+		hv_store(row_hv, "value", 5, newSVnv(table->values[index]), 0);
+
+		// Append to output array ref
+		av_push(results_av, newRV_noinc((SV*) row_hv));
+	}
+	if (meta_keys) {
+		for (index = 0; index < table->columns * META_FIELD_COUNT; index++)
+			if (meta_keys[index])
+				SvREFCNT_dec(meta_keys[index]);
+		free(meta_keys);
+	}
+}
+
+// Same fields as push_result_rows with metadata, one array ref per field
+static HV * result_columns(struct hdf5_file_st * file_st, StringResultTable * table) {
+	HV * columns_hv = newHV();
+	AV * column_av;
+	AV * meta_avs[META_FIELD_COUNT];
+	SV * meta_svs[META_FIELD_COUNT];
+	hsize_t index;
+	int dim, field;
+	MetaDictionaries * meta = NULL;
+
+	if (table->dim_meta)
+		meta = read_meta_dictionaries(file_st);
+	for (dim = 0; dim < table->columns; dim++) {
+		column_av = newAV();
+		av_extend(column_av, table->rows);
+		for (index = 0; index < table->rows; index++)
+			av_push(column_av, newSVpv(get_result_label(table, dim, index), 0));
+		hv_store(columns_hv, table->dims[dim], file_st->dim_name_lengths[table->dim_indices[dim]], newRV_noinc((SV *) column_av), 0);
+
+		if (!table->dim_meta || !table->dim_meta[dim])
+			continue;
+		for (field = 0; field < META_FIELD_COUNT; field++) {
+			SV * key_sv = meta_field_key(table, dim, field);
+			meta_avs[field] = newAV();
+			av_extend(meta_avs[field], table->rows);
+			hv_store_ent(columns_hv, key_sv, newRV_noinc((SV *) meta_avs[field]), 0);
+			SvREFCNT_dec(key_sv);
+		}
+		for (index = 0; index < table->rows; index++) {
+			meta_field_svs(get_result_meta(table, dim, index), meta->chroms, meta->consequences, meta_svs);
+			for (field = 0; field < META_FIELD_COUNT; field++)
+				av_push(meta_avs[field], meta_svs[field]);
+		}
+	}
+	column_av = newAV();
+	av_extend(column_av, table->rows);
+	for (index = 0; index < table->rows; index++)
+		av_push(column_av, newSVnv(table->values[index]));
+	hv_store(columns_hv, "value", 5, newRV_noinc((SV *) column_av), 0);
+	destroy_meta_dictionaries(meta);
+	return columns_hv;
+}
+
+// Runs a fetch, with ranges or lists of values pushed down to the C layer
+static StringResultTable * fetch_table(struct hdf5_file_st * file_st, HV * constraints_hv, ValueFilter * filter) {
+	hsize_t rank;
+	bool * set_dims;
+	hsize_t * constraints;
+	DimConstraint * ranges;
+	StringResultTable * table;
+
+	rank = get_file_rank(file_st->file);
+	if (has_range_constraints(constraints_hv)) {
+		ranges = calloc(rank, sizeof(DimConstraint));
+		if (read_range_constraints(file_st, constraints_hv, ranges))
+			table = fetch_string_values_ranges(file_st->file, ranges, filter);
+		else
+			table = calloc(1, sizeof(StringResultTable));
+		free_range_constraints(ranges, rank);
+		if (table == NULL)
+			croak("Invalid range constraints");
+	} else {
+		// Allocating dynamic arrays
+		set_dims = calloc(rank, sizeof(bool));
+		constraints = calloc(rank, sizeof(hsize_t));
+		read_constraints(file_st, constraints_hv, set_dims, constraints);
+
+		// Query the file
+		table = fetch_string_values(file_st->file, set_dims, constraints, filter);
+
+		// Cleaning up dynamically allocated arrays
+		free(set_dims);
+		free(constraints);
+	}
+	return table;
+}
+
 MODULE = Bio::EnsEMBL::HDF5 PACKAGE = Bio::EnsEMBL::HDF5
 
 void
-hdf5_create(filename_sv, dim_sizes_hv, dim_label_lengths_hv)
+hdf5_create(filename_sv, dim_sizes_hv, dim_label_lengths_hv, options_sv=NULL)
 		SV * filename_sv
 		HV * dim_sizes_hv
 		HV * dim_label_lengths_hv
+		SV * options_sv
 	PREINIT:
+		FileOptions options;
 		hsize_t rank;
 		char ** dim_names;
 		hsize_t * dim_sizes;
@@ -40,7 +511,7 @@ hdf5_create(filename_sv, dim_sizes_hv, dim_label_lengths_hv)
 		int dim;
 		hsize_t index;
 		char * filename;
-		hid_t file;
+		FileContext * file;
 	CODE:
 		// Allocate memory
 		rank = hv_iterinit(dim_sizes_hv);
@@ -68,7 +539,8 @@ hdf5_create(filename_sv, dim_sizes_hv, dim_label_lengths_hv)
 
 		// Create file
 		filename = SvPV_nolen(filename_sv);
-		file = create_file(filename, rank, dim_names, dim_sizes, dim_label_lengths, NULL);
+		file = create_file(filename, rank, dim_names, dim_sizes, dim_label_lengths, NULL, read_file_options(options_sv, &options));
+		close_file(file);
 
 		// Clean up memory
 		free(dim_names);
@@ -76,10 +548,12 @@ hdf5_create(filename_sv, dim_sizes_hv, dim_label_lengths_hv)
 		free(dim_label_lengths);
 
 void * 
-hdf5_open(filename_sv, readonly=NULL)
+hdf5_open(filename_sv, readonly=NULL, options_sv=NULL)
 		SV * filename_sv
 		SV * readonly
+		SV * options_sv
 	PREINIT:
+		FileOptions options;
 		struct hdf5_file_st * file;
 		char * filename;
 		StringArray * dim_names_sa;
@@ -90,7 +564,7 @@ hdf5_open(filename_sv, readonly=NULL)
 
 		// Open file
 		filename = SvPV_nolen(filename_sv);
-		file->file = open_file(filename, 1);
+		file->file = open_file(filename, readonly != NULL && SvTRUE(readonly), read_file_options(options_sv, &options));
 
 		// Allocate storage
 		rank = get_file_rank(file->file);
@@ -106,7 +580,6 @@ hdf5_open(filename_sv, readonly=NULL)
 			// Store length of dimension name
 			file->dim_name_lengths[dim] = strlen(name);
 		}
-		destroy_string_array(dim_names_sa);
 
 		RETVAL = file; 
 	OUTPUT:
@@ -151,6 +624,83 @@ hdf5_store_dim_labels(file, dim_name_sv, dim_labels_sv)
 		// Clean up data
 		free(dim_labels);
 
+void
+hdf5_store_dim_meta(file, dim_name_sv, columns_hv)
+		void * file
+		SV * dim_name_sv
+		HV * columns_hv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		AV * columns[META_FIELD_COUNT];
+		SV ** column_sv;
+		unsigned int * codes;
+		DimMeta * meta;
+		hsize_t count, index;
+		int field;
+	CODE:
+		// {chrom => [...], start => [...], end => [...], consequence => [...]},
+		// chromosomes and consequences are encoded through the dictionaries of the file
+		for (field = 0; field < META_FIELD_COUNT; field++) {
+			if ((column_sv = hv_fetch(columns_hv, meta_fields[field], strlen(meta_fields[field]), 0)) == NULL || !SvROK(*column_sv)) {
+				printf("Missing metadata column %s\n", meta_fields[field]);
+				exit(1);
+			}
+			columns[field] = (AV *) SvRV(*column_sv);
+		}
+		count = av_len(columns[0]) + 1;
+		for (field = 1; field < META_FIELD_COUNT; field++) {
+			if (av_len(columns[field]) + 1 != count) {
+				puts("Metadata columns differ in length");
+				exit(1);
+			}
+		}
+
+		meta = calloc(count, sizeof(DimMeta));
+		codes = calloc(count, sizeof(unsigned int));
+		encode_meta_strings(file_st->file, "chrom", columns[0], count, codes);
+		for (index = 0; index < count; index++) {
+			meta[index].chrom = codes[index];
+			meta[index].start = SvUV(*av_fetch(columns[1], index, 0));
+			meta[index].end = SvUV(*av_fetch(columns[2], index, 0));
+		}
+		encode_meta_strings(file_st->file, "consequence", columns[3], count, codes);
+		for (index = 0; index < count; index++)
+			meta[index].consequence = codes[index];
+
+		store_dim_meta(file_st->file, SvPV_nolen(dim_name_sv), count, meta);
+		free(codes);
+		free(meta);
+
+void
+hdf5_extend_dimension(file, dim_name_sv, dim_labels_sv)
+		void * file
+		SV * dim_name_sv
+		SV * dim_labels_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		char * dim_name;
+		AV * dim_labels_av;
+		char ** dim_labels;
+		hsize_t count, index;
+	CODE:
+		if (file_st == NULL) {
+			puts("Cannot write into null file handle");
+			exit(1);
+		}
+
+		dim_name = SvPV_nolen(dim_name_sv);
+		dim_labels_av = (AV *) SvRV(dim_labels_sv);
+		count = av_len(dim_labels_av) + 1;
+		dim_labels = calloc(count, sizeof(char *));
+		for (index = 0; index < count; index++) {
+			SV ** dim_label_sv = av_fetch(dim_labels_av, index, 0);
+			dim_labels[index] = SvPV_nolen(*dim_label_sv);
+		}
+
+		// Grow the file and append the new labels
+		extend_dimension(file_st->file, dim_name, count, dim_labels);
+		free(dim_labels);
+
 SV *
 hdf5_get_all_dim_labels(file)
 		void * file
@@ -183,7 +733,6 @@ hdf5_get_all_dim_labels(file)
 			// Free names
 			destroy_string_array(dim_labels_sa);
 		}
-		destroy_string_array(dim_names_sa);
 
 		// Return reference
 		RETVAL = newRV_noinc((SV *) dim_labels_hv);
@@ -229,6 +778,60 @@ hdf5_get_dim_labels(file, dim_name_sv)
 	OUTPUT:
 		RETVAL
 
+SV *
+hdf5_lookup_label(file, dim_name_sv, label_sv)
+		void * file
+		SV * dim_name_sv
+		SV * label_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		hsize_t index;
+	CODE:
+		// Index of the label, undef if unknown
+		if (lookup_label(file_st->file, read_dim_index(file_st, dim_name_sv), SvPV_nolen(label_sv), &index))
+			RETVAL = newSVuv(index);
+		else
+			RETVAL = &PL_sv_undef;
+	OUTPUT:
+		RETVAL
+
+SV *
+hdf5_lookup_labels(file, dim_name_sv, labels_sv)
+		void * file
+		SV * dim_name_sv
+		SV * labels_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		AV * labels_av;
+		AV * indices_av;
+		char ** labels;
+		hsize_t * indices;
+		bool * found;
+		hsize_t count, index;
+	CODE:
+		labels_av = (AV *) SvRV(labels_sv);
+		count = av_len(labels_av) + 1;
+		labels = calloc(count, sizeof(char *));
+		indices = calloc(count, sizeof(hsize_t));
+		found = calloc(count, sizeof(bool));
+		for (index = 0; index < count; index++)
+			labels[index] = SvPV_nolen(*av_fetch(labels_av, index, 0));
+
+		lookup_labels(file_st->file, read_dim_index(file_st, dim_name_sv), count, labels, indices, found);
+
+		// Array ref of indices in the order of the labels, undef where unknown
+		indices_av = newAV();
+		av_extend(indices_av, count);
+		for (index = 0; index < count; index++)
+			av_push(indices_av, found[index] ? newSVuv(indices[index]) : newSV(0));
+		free(labels);
+		free(indices);
+		free(found);
+
+		RETVAL = newRV_noinc((SV *) indices_av);
+	OUTPUT:
+		RETVAL
+
 void
 hdf5_store(file, points_sv)
 		void * file
@@ -305,70 +908,376 @@ hdf5_store(file, points_sv)
 		free(coords);
 		free(values);
 
+void
+hdf5_store_packed(file, coords_sv, values_sv)
+		void * file
+		SV * coords_sv
+		SV * values_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		char * coords_copy;
+		char * values_copy;
+		hsize_t * coords;
+		double * values;
+		hsize_t count, rank;
+		STRLEN coords_length, values_length;
+	CODE:
+		if (file_st == NULL) {
+			puts("Cannot write into null file handle");
+			exit(1);
+		}
+
+		// pack('Q*') coordinates, in the order of hdf5_get_dim_names, and pack('d*') values
+		coords = (hsize_t *) read_packed_buffer(coords_sv, &coords_length, &coords_copy);
+		values = (double *) read_packed_buffer(values_sv, &values_length, &values_copy);
+		rank = get_file_rank(file_st->file);
+		count = values_length / sizeof(double);
+		if (values_length % sizeof(double) || coords_length != count * rank * sizeof(hsize_t)) {
+			printf("Packed buffers of %lu coordinate bytes and %lu value bytes do not hold whole points of rank %lli!\n", (unsigned long) coords_length, (unsigned long) values_length, rank);
+			exit(1);
+		}
+
+		if (count)
+			store_values_packed(file_st->file, count, coords, values);
+
+		free(coords_copy);
+		free(values_copy);
+
+SV *
+hdf5_get_dim_names(file)
+		void * file
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		StringArray * dim_names_sa;
+		AV * dim_names_av;
+		int dim, rank;
+	CODE:
+		dim_names_sa = get_dim_names(file_st->file);
+		rank = get_file_rank(file_st->file);
+		dim_names_av = newAV();
+		for (dim = 0; dim < rank; dim++)
+			av_push(dim_names_av, newSVpv(get_string_in_array(dim_names_sa, dim), 0));
+		RETVAL = newRV_noinc((SV *) dim_names_av);
+	OUTPUT:
+		RETVAL
+
 SV * 
-hdf5_fetch(file, constraints_hv)
+hdf5_fetch(file, constraints_hv, filter_sv=NULL, options_sv=NULL)
+		void * file
+		HV * constraints_hv
+		SV * filter_sv
+		SV * options_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		ValueFilter filter_st;
+		StringResultTable * table;
+		AV * results_av;
+		MetaDictionaries * meta;
+	CODE:
+		table = fetch_table(file_st, constraints_hv, read_filter(filter_sv, &filter_st));
+
+		// Produce array ref of hash refs for output
+		results_av = newAV();
+		meta = read_fetch_options(file_st, options_sv);
+		push_result_rows(file_st, table, results_av, meta);
+		destroy_meta_dictionaries(meta);
+		destroy_string_result_table(table);
+
+		RETVAL = newRV_noinc((SV *) results_av);
+	OUTPUT:
+		RETVAL
+
+SV *
+hdf5_fetch_columns(file, constraints_hv, filter_sv=NULL)
 		void * file
 		HV * constraints_hv
+		SV * filter_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		ValueFilter filter_st;
+		StringResultTable * table;
+	CODE:
+		// Hash ref of dim name or "value" => array ref, one entry per row
+		table = fetch_table(file_st, constraints_hv, read_filter(filter_sv, &filter_st));
+		RETVAL = newRV_noinc((SV *) result_columns(file_st, table));
+		destroy_string_result_table(table);
+	OUTPUT:
+		RETVAL
+
+SV *
+hdf5_fetch_region(file, dim_name_sv, chrom_sv, start_sv, end_sv, constraints_sv=NULL, filter_sv=NULL, options_sv=NULL)
+		void * file
+		SV * dim_name_sv
+		SV * chrom_sv
+		SV * start_sv
+		SV * end_sv
+		SV * constraints_sv
+		SV * filter_sv
+		SV * options_sv
 	PREINIT:
+		MetaDictionaries * meta;
 		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
 		hsize_t rank;
-		int index, dim, constraint_count, value;
-		bool * set_dims;
-		hsize_t * constraints;
+		DimConstraint * ranges;
+		ValueFilter filter_st;
 		StringResultTable * table;
 		AV * results_av;
-		char * dim_name;
-		int * dim_lengths;
-		HV * row_hv;
-		I32 length;
 	CODE:
-		// Allocating dynamic arrays
+		// Rows of the dimension overlapping chrom:start-end (inclusive),
+		// the other dimensions constrained as in hdf5_fetch
 		rank = get_file_rank(file_st->file);
-		set_dims = calloc(rank, sizeof(bool));
-		constraints = calloc(rank, sizeof(hsize_t));
+		ranges = calloc(rank, sizeof(DimConstraint));
+		if (constraints_sv != NULL && SvROK(constraints_sv) && !read_range_constraints(file_st, (HV *) SvRV(constraints_sv), ranges))
+			table = calloc(1, sizeof(StringResultTable));
+		else
+			table = fetch_region(file_st->file, read_dim_index(file_st, dim_name_sv), SvPV_nolen(chrom_sv), SvUV(start_sv), SvUV(end_sv), ranges, read_filter(filter_sv, &filter_st));
+		free_range_constraints(ranges, rank);
+		if (table == NULL)
+			croak("Invalid range constraints");
 
-		// Reading constraint hash ref to fill two C arrays (set_dims and constraints) with values
-		constraint_count = hv_iterinit(constraints_hv);
-		for (index = 0; index < constraint_count; index++) {
-			// Iteration
-			HE * hash_entry = hv_iternext(constraints_hv);
+		results_av = newAV();
+		meta = read_fetch_options(file_st, options_sv);
+		push_result_rows(file_st, table, results_av, meta);
+		destroy_meta_dictionaries(meta);
+		destroy_string_result_table(table);
+		RETVAL = newRV_noinc((SV *) results_av);
+	OUTPUT:
+		RETVAL
+
+SV *
+hdf5_fetch_many(file, constraints_sv, options_sv=NULL)
+		void * file
+		SV * constraints_sv
+		SV * options_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		hsize_t rank, count, query, valid;
+		AV * constraints_av;
+		bool ranged = false;
+		bool ** set_dims;
+		hsize_t ** constraints;
+		DimConstraint ** ranges;
+		StringResultTable ** tables;
+		AV * results_av;
+		MetaDictionaries * meta;
+	CODE:
+		// Dereference array ref of constraint hash refs
+		constraints_av = (AV *) SvRV(constraints_sv);
+		count = av_len(constraints_av) + 1;
+		for (query = 0; query < count; query++)
+			if (has_range_constraints((HV *) SvRV(*av_fetch(constraints_av, query, 0))))
+				ranged = true;
 
-			// Extract info from hash entry
-			dim_name = hv_iterkey(hash_entry, &length);
-			dim = SvIV(*hv_fetch(file_st->dim_indices, dim_name, strlen(dim_name), 0));
-			value = SvIV(hv_iterval(constraints_hv, hash_entry));
+		// Allocating dynamic arrays
+		rank = get_file_rank(file_st->file);
+		set_dims = calloc(count, sizeof(bool *));
+		constraints = calloc(count, sizeof(hsize_t *));
+		ranges = calloc(count, sizeof(DimConstraint *));
+		tables = calloc(count, sizeof(StringResultTable *));
+		if (ranged) {
+			// Queries ruled out by an empty list are left out, and get no rows
+			DimConstraint ** valid_ranges = calloc(count, sizeof(DimConstraint *));
+			StringResultTable ** valid_tables;
+			valid = 0;
+			for (query = 0; query < count; query++) {
+				ranges[query] = calloc(rank, sizeof(DimConstraint));
+				if (read_range_constraints(file_st, (HV *) SvRV(*av_fetch(constraints_av, query, 0)), ranges[query]))
+					valid_ranges[valid++] = ranges[query];
+			}
 
-			// Updating C data
-			set_dims[dim] = 1;
-			constraints[dim] = value;
-		}
+			// Query the file
+			valid_tables = fetch_string_values_batch_ranges(file_st->file, valid, valid_ranges);
+			valid = 0;
+			for (query = 0; query < count; query++)
+				if (valid_ranges[valid] == ranges[query])
+					tables[query] = valid_tables[valid++];
+			free(valid_tables);
+			free(valid_ranges);
+		} else {
+			for (query = 0; query < count; query++) {
+				SV ** constraints_hv = av_fetch(constraints_av, query, 0);
+				set_dims[query] = calloc(rank, sizeof(bool));
+				constraints[query] = calloc(rank, sizeof(hsize_t));
+				read_constraints(file_st, (HV *) SvRV(*constraints_hv), set_dims[query], constraints[query]);
+			}
 
-		// Query the file
-		table = fetch_string_values(file_st->file, set_dims, constraints);
+			// Query the file
+			free(tables);
+			tables = fetch_string_values_batch(file_st->file, count, set_dims, constraints);
+		}
 
-		// Produce array ref of hash refs for output from C-style StringResultTable object
+		// Produce array ref of array refs of hash refs, in the order of the queries
 		results_av = newAV();
-		for (index = 0; index < table->rows; index++) {
-			// Create hash ref from row of C-style StringResultTable object
-			row_hv = newHV();
-			for (dim = 0; dim < table->columns; dim++) {
-				hv_store(row_hv, table->dims[dim], file_st->dim_name_lengths[table->dim_indices[dim]], newSVpv(table->coords[index][dim], 0), 0);
+		meta = read_fetch_options(file_st, options_sv);
+		for (query = 0; query < count; query++) {
+			AV * query_av = newAV();
+			if (tables[query] != NULL) {
+				push_result_rows(file_st, tables[query], query_av, meta);
+				destroy_string_result_table(tables[query]);
+			}
+			av_push(results_av, newRV_noinc((SV*) query_av));
+			if (ranged)
+				free_range_constraints(ranges[query], rank);
+			else {
+				free(set_dims[query]);
+				free(constraints[query]);
 			}
-			hv_store(row_hv, "value", 5, newSVnv(table->values[index]), 0);
-
-			// Append to output array ref
-			av_push(results_av, newRV_noinc((SV*) row_hv));
 		}
 
 		// Cleaning up dynamically allocated arrays
+		destroy_meta_dictionaries(meta);
+		free(tables);
 		free(set_dims);
 		free(constraints);
-		destroy_string_result_table(table);
+		free(ranges);
 
 		RETVAL = newRV_noinc((SV *) results_av);
 	OUTPUT:
 		RETVAL
 
+NV
+hdf5_get_value(file, point_hv)
+		void * file
+		HV * point_hv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		hsize_t rank;
+		hsize_t * coords;
+	CODE:
+		rank = get_file_rank(file_st->file);
+		coords = calloc(rank, sizeof(hsize_t));
+		read_point(file_st, point_hv, rank, coords);
+		RETVAL = get_value(file_st->file, coords);
+		free(coords);
+	OUTPUT:
+		RETVAL
+
+SV *
+hdf5_get_values(file, points_sv)
+		void * file
+		SV * points_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		hsize_t rank, count, index;
+		AV * points_av;
+		AV * values_av;
+		hsize_t ** coords;
+		double * values;
+	CODE:
+		// Dereference array ref of point hash refs
+		points_av = (AV *) SvRV(points_sv);
+		count = av_len(points_av) + 1;
+
+		// Allocating dynamic arrays
+		rank = get_file_rank(file_st->file);
+		coords = calloc(count, sizeof(hsize_t *));
+		values = calloc(count, sizeof(double));
+		for (index = 0; index < count; index++) {
+			SV ** point_sv = av_fetch(points_av, index, 0);
+			coords[index] = calloc(rank, sizeof(hsize_t));
+			read_point(file_st, (HV *) SvRV(*point_sv), rank, coords[index]);
+		}
+
+		// Query the file
+		get_values(file_st->file, count, coords, values);
+
+		// Array ref of values, in the order of the points
+		values_av = newAV();
+		av_extend(values_av, count);
+		for (index = 0; index < count; index++) {
+			av_push(values_av, newSVnv(values[index]));
+			free(coords[index]);
+		}
+		free(coords);
+		free(values);
+
+		RETVAL = newRV_noinc((SV *) values_av);
+	OUTPUT:
+		RETVAL
+
+void *
+hdf5_open_cursor(file, constraints_hv, options_sv=NULL)
+		void * file
+		HV * constraints_hv
+		SV * options_sv
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+		struct hdf5_cursor_st * cursor_st;
+		hsize_t rank;
+		bool * set_dims;
+		hsize_t * constraints;
+		DimConstraint * ranges;
+	CODE:
+		// The cursor keeps a pointer to the file, which must outlive it
+		cursor_st = calloc(1, sizeof(struct hdf5_cursor_st));
+		cursor_st->file = file_st;
+		cursor_st->meta = read_fetch_options(file_st, options_sv);
+
+		rank = get_file_rank(file_st->file);
+		if (has_range_constraints(constraints_hv)) {
+			// A cursor ruled out by an empty list is left NULL, and returns no rows
+			ranges = calloc(rank, sizeof(DimConstraint));
+			if (read_range_constraints(file_st, constraints_hv, ranges))
+				cursor_st->cursor = open_cursor_ranges(file_st->file, ranges);
+			free_range_constraints(ranges, rank);
+		} else {
+			// Allocating dynamic arrays
+			set_dims = calloc(rank, sizeof(bool));
+			constraints = calloc(rank, sizeof(hsize_t));
+			read_constraints(file_st, constraints_hv, set_dims, constraints);
+
+			cursor_st->cursor = open_cursor(file_st->file, set_dims, constraints);
+
+			free(set_dims);
+			free(constraints);
+		}
+
+		RETVAL = cursor_st;
+	OUTPUT:
+		RETVAL
+
+SV *
+hdf5_cursor_next(cursor, batch_size)
+		void * cursor
+		SV * batch_size
+	PREINIT:
+		struct hdf5_cursor_st * cursor_st = (struct hdf5_cursor_st *) cursor;
+		StringResultTable * table;
+		AV * results_av;
+	CODE:
+		// Returns undef once the cursor is exhausted
+		RETVAL = &PL_sv_undef;
+		if (cursor_st->cursor != NULL) {
+			table = cursor_next(cursor_st->cursor, SvUV(batch_size));
+			if (table->rows) {
+				results_av = newAV();
+				push_result_rows(cursor_st->file, table, results_av, cursor_st->meta);
+				RETVAL = newRV_noinc((SV *) results_av);
+			}
+			destroy_string_result_table(table);
+		}
+	OUTPUT:
+		RETVAL
+
+void
+hdf5_cursor_close(cursor)
+		void * cursor
+	PREINIT:
+		struct hdf5_cursor_st * cursor_st = (struct hdf5_cursor_st *) cursor;
+	CODE:
+		if (cursor_st->cursor != NULL)
+			cursor_close(cursor_st->cursor);
+		destroy_meta_dictionaries(cursor_st->meta);
+		free(cursor_st);
+
+void
+hdf5_flush(file)
+		void * file
+	PREINIT:
+		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
+	CODE:
+		flush_file(file_st->file);
+
 void
 hdf5_close(file)
 		void * file
@@ -376,6 +1285,9 @@ hdf5_close(file)
 		struct hdf5_file_st * file_st = (struct hdf5_file_st *) file;
 	CODE:
 		close_file(file_st->file);
+		SvREFCNT_dec((SV *) file_st->dim_indices);
+		free(file_st->dim_name_lengths);
+		free(file_st);
 
 void
 hdf5_set_log(value)
@@ -91,6 +91,139 @@ ok(defined $data_point->{value});
 ok($data_point->{snp} eq 'rs1');
 ok(abs($data_point->{value} - .1) < 1e-4);
 
+# Range and list constraints
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh, {gene => [0, 1]})};
+ok(scalar(@output_data) == 2);
+ok(defined $output_data[0]->{gene});
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh, {gene => {start => 1, end => 2}})};
+ok(scalar(@output_data) == 1 && $output_data[0]->{snp} eq 'rs2');
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh, {gene => {start => 1, end => 0}})};
+ok(scalar(@output_data) == 0);
+ok(!eval { Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh, {gene => {start => 0, end => 5}}); 1 } && $@ =~ /Invalid range/);
+
+# Value filters
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh, {}, {gt => .15})};
+ok(scalar(@output_data) == 1 && $output_data[0]->{gene} eq 'B');
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh, {}, {top_k => 1, order => 'smallest'})};
+ok(scalar(@output_data) == 1 && $output_data[0]->{gene} eq 'A');
+
+# Point lookups
+ok(abs(Bio::EnsEMBL::HDF5::hdf5_get_value($hdfh, {gene => 1, snp => 1}) - .2) < 1e-4);
+my $point_values = Bio::EnsEMBL::HDF5::hdf5_get_values($hdfh, [{gene => 0, snp => 0}, {gene => 0, snp => 1}]);
+ok(abs($point_values->[0] - .1) < 1e-4 && $point_values->[1] == 0);
+
+# Running several queries at once
+my $batch_results = Bio::EnsEMBL::HDF5::hdf5_fetch_many($hdfh, [{gene => 0}, {}, {gene => 1}]);
+ok(scalar(@$batch_results) == 3);
+ok(scalar(@{$batch_results->[0]}) == 1 && $batch_results->[0][0]{snp} eq 'rs1');
+ok(scalar(@{$batch_results->[1]}) == 2);
+ok(scalar(@{$batch_results->[2]}) == 1 && $batch_results->[2][0]{snp} eq 'rs2');
+
+# Streaming the data through a cursor, one data point at a time
+my $cursor = Bio::EnsEMBL::HDF5::hdf5_open_cursor($hdfh, {});
+my $streamed = 0;
+while (my $batch = Bio::EnsEMBL::HDF5::hdf5_cursor_next($cursor, 1)) {
+  ok(scalar(@$batch) == 1);
+  $streamed += scalar(@$batch);
+}
+ok(!defined Bio::EnsEMBL::HDF5::hdf5_cursor_next($cursor, 1));
+Bio::EnsEMBL::HDF5::hdf5_cursor_close($cursor);
+ok($streamed == 2);
+
+# List and range constraints through the batch and cursor entry points
+$batch_results = Bio::EnsEMBL::HDF5::hdf5_fetch_many($hdfh, [{gene => [1]}, {gene => []}, {snp => {start => 0, end => 2}}]);
+ok(scalar(@{$batch_results->[0]}) == 1 && $batch_results->[0][0]{snp} eq 'rs2');
+ok(scalar(@{$batch_results->[1]}) == 0 && scalar(@{$batch_results->[2]}) == 2);
+$cursor = Bio::EnsEMBL::HDF5::hdf5_open_cursor($hdfh, {gene => [0, 1]});
+$streamed = 0;
+while (my $batch = Bio::EnsEMBL::HDF5::hdf5_cursor_next($cursor, 1)) {
+  $streamed += scalar(@$batch);
+}
+Bio::EnsEMBL::HDF5::hdf5_cursor_close($cursor);
+ok($streamed == 2);
+
+# Compressed file written by worker threads
+my ($fh2, $filename2) = tempfile();
+Bio::EnsEMBL::HDF5::hdf5_create($filename2, {gene => 2, snp => 2}, {gene => 1, snp => 3}, {storage => 'shuffle_deflate', level => 6, encoding => 'float'});
+ok(my $hdfh2 = Bio::EnsEMBL::HDF5::hdf5_open($filename2, 0, {threads => 2}));
+Bio::EnsEMBL::HDF5::hdf5_store($hdfh2, [@$original_data, @$original_data2]);
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh2);
+$hdfh2 = Bio::EnsEMBL::HDF5::hdf5_open($filename2, 1);
+ok(abs(Bio::EnsEMBL::HDF5::hdf5_get_value($hdfh2, {gene => 1, snp => 1}) - .2) < 1e-4);
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh2);
+unlink $filename2;
+
+# Variable length labels
+($fh2, $filename2) = tempfile();
+Bio::EnsEMBL::HDF5::hdf5_create($filename2, {gene => 2, snp => 2}, {gene => 0, snp => 0}, {labels => 'blob'});
+$hdfh2 = Bio::EnsEMBL::HDF5::hdf5_open($filename2, 0);
+Bio::EnsEMBL::HDF5::hdf5_store_dim_labels($hdfh2, 'gene', ['ENSG00000139618', 'A']);
+Bio::EnsEMBL::HDF5::hdf5_store_dim_labels($hdfh2, 'snp', ['rs1', "rs1234567890\t13\t32315474"]);
+Bio::EnsEMBL::HDF5::hdf5_store($hdfh2, [{gene => 0, snp => 1, value => .5}]);
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh2);
+$hdfh2 = Bio::EnsEMBL::HDF5::hdf5_open($filename2, 1);
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh2, {snp => Bio::EnsEMBL::HDF5::hdf5_lookup_label($hdfh2, 'snp', 'rs1234567890')})};
+ok(scalar(@output_data) == 1 && $output_data[0]->{gene} eq 'ENSG00000139618');
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh2);
+unlink $filename2;
+
+# Typed SNP metadata, returned as columns and with the rows on request
+($fh2, $filename2) = tempfile();
+Bio::EnsEMBL::HDF5::hdf5_create($filename2, {gene => 2, snp => 2}, {gene => 1, snp => 3});
+$hdfh2 = Bio::EnsEMBL::HDF5::hdf5_open($filename2, 0);
+Bio::EnsEMBL::HDF5::hdf5_store_dim_labels($hdfh2, 'gene', ['A', 'B']);
+Bio::EnsEMBL::HDF5::hdf5_store_dim_labels($hdfh2, 'snp', ['rs1', 'rs2']);
+Bio::EnsEMBL::HDF5::hdf5_store_dim_meta($hdfh2, 'snp', {chrom => ['1', 'X'], start => [100, 200], end => [100, 201], consequence => ['intron_variant', 'intron_variant']});
+Bio::EnsEMBL::HDF5::hdf5_store($hdfh2, [{gene => 0, snp => 1, value => .5}, {gene => 1, snp => 0, value => .6}]);
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh2);
+$hdfh2 = Bio::EnsEMBL::HDF5::hdf5_open($filename2, 1);
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh2, {gene => 0})};
+ok(scalar(@output_data) == 1 && !exists $output_data[0]->{snp_chrom});
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh2, {gene => 0}, undef, {meta => 1})};
+ok(scalar(@output_data) == 1 && $output_data[0]->{snp_chrom} eq 'X' && $output_data[0]->{snp_end} == 201);
+$cursor = Bio::EnsEMBL::HDF5::hdf5_open_cursor($hdfh2, {}, {meta => 1});
+my @chroms = ();
+while (my $batch = Bio::EnsEMBL::HDF5::hdf5_cursor_next($cursor, 1)) {
+  push @chroms, map { $_->{snp_chrom} } @$batch;
+}
+Bio::EnsEMBL::HDF5::hdf5_cursor_close($cursor);
+ok(join(',', sort @chroms) eq '1,X');
+my $columns = Bio::EnsEMBL::HDF5::hdf5_fetch_columns($hdfh2, {});
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch_region($hdfh2, 'snp', 'X', 150, 250, {gene => 0})};
+ok(scalar(@output_data) == 1 && $output_data[0]->{snp} eq 'rs2' && $output_data[0]->{value} == .5);
+my %snp_starts = map { $columns->{snp}[$_] => $columns->{snp_start}[$_] } 0..1;
+ok($snp_starts{rs1} == 100 && $snp_starts{rs2} == 200 && $columns->{snp_consequence}[1] eq 'intron_variant' && !exists $columns->{gene_chrom});
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh2);
+unlink $filename2;
+
+# Growing a dimension in place
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh);
+$hdfh = Bio::EnsEMBL::HDF5::hdf5_open($filename);
+Bio::EnsEMBL::HDF5::hdf5_extend_dimension($hdfh, 'gene', ['C']);
+Bio::EnsEMBL::HDF5::hdf5_store($hdfh, [{gene => 2, snp => 0, value => .3}]);
+@output_data = @{Bio::EnsEMBL::HDF5::hdf5_fetch($hdfh, {gene => 2})};
+ok(scalar(@output_data) == 1 && $output_data[0]->{snp} eq 'rs1');
+ok(scalar(@{Bio::EnsEMBL::HDF5::hdf5_get_dim_labels($hdfh, "gene")}) == 3);
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh);
+
+# Storing packed buffers, coordinates in the order of the dimension names,
+# through the staging arena which reads flush
+$hdfh = Bio::EnsEMBL::HDF5::hdf5_open($filename, 0, {staging_mb => 1});
+my $dim_names = Bio::EnsEMBL::HDF5::hdf5_get_dim_names($hdfh);
+ok(join(',', sort @$dim_names) eq 'gene,snp');
+my %packed_point = (gene => 1, snp => 0);
+Bio::EnsEMBL::HDF5::hdf5_store_packed($hdfh, pack('Q*', @packed_point{@$dim_names}), pack('d*', .4));
+ok(abs(Bio::EnsEMBL::HDF5::hdf5_get_value($hdfh, {gene => 1, snp => 0}) - .4) < 1e-4);
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh);
+
+# Label lookups through the index in the file
+$hdfh = Bio::EnsEMBL::HDF5::hdf5_open($filename, 1);
+ok(Bio::EnsEMBL::HDF5::hdf5_lookup_label($hdfh, 'snp', 'rs2') == 1);
+ok(!defined Bio::EnsEMBL::HDF5::hdf5_lookup_label($hdfh, 'snp', 'rs3'));
+my $indices = Bio::EnsEMBL::HDF5::hdf5_lookup_labels($hdfh, 'gene', ['C', 'D', 'A']);
+ok($indices->[0] == 2 && !defined $indices->[1] && $indices->[2] == 0);
+Bio::EnsEMBL::HDF5::hdf5_close($hdfh);
+
 # Test whether an error is raised when an unkown gene is requested
 #@output_data = @{Bio::EnsEMBL::HDF5::fetch($hdfh, {gene => 2})};
 